@@ -0,0 +1,326 @@
+// Allocation-Test.cpp : the evaluation hot path should not allocate on the heap.
+// The steady-state model, jacobian, normal equations, normals, distance and cost evaluations are each run once
+// to size their buffers and then repeated with the allocations counted, on a single-threaded pool and on a pool
+// of all the hardware threads.
+//
+// Usage: Allocation-Test <SMPL resources folder or bundle>
+// Exits with 1 if any of the repeated evaluations allocated.
+//
+// The allocations are counted by the replaced global operator new, and by the malloc hook where it's available:
+// glibc (the malloc family is wrapped) and the MSVC debug CRT (_CrtSetAllocHook). Eigen allocates with malloc,
+// so elsewhere only the operator new calls are counted.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+#include <crtdbg.h>
+#endif
+
+#include <GeneralMesh/GeneralMesh.h>
+#include "SMPLWrapper.h"
+#include "MeshDistanceQuery.h"
+#include "ThreadPool.h"
+#include "AbsoluteDistanceBase.h"
+#include "FusedDistanceCost.h"
+
+namespace
+{
+    constexpr int REPEATS = 3;
+
+    std::atomic<long> allocations_num(0);
+    std::atomic<bool> counting(false);
+
+    void countAllocation()
+    {
+        if (counting.load(std::memory_order_relaxed))
+            allocations_num.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+#if defined(__GLIBC__)
+#define MALLOC_HOOKED
+extern "C"
+{
+    void* __libc_malloc(std::size_t size);
+    void* __libc_calloc(std::size_t num, std::size_t size);
+    void* __libc_realloc(void* ptr, std::size_t size);
+
+    void* malloc(std::size_t size)
+    {
+        countAllocation();
+        return __libc_malloc(size);
+    }
+    void* calloc(std::size_t num, std::size_t size)
+    {
+        countAllocation();
+        return __libc_calloc(num, size);
+    }
+    void* realloc(void* ptr, std::size_t size)
+    {
+        countAllocation();
+        return __libc_realloc(ptr, size);
+    }
+}
+#elif defined(_MSC_VER) && defined(_DEBUG)
+#define MALLOC_HOOKED
+static int allocationHook(int alloc_type, void*, std::size_t, int, long, const unsigned char*, int)
+{
+    if (alloc_type == _HOOK_ALLOC || alloc_type == _HOOK_REALLOC)
+        countAllocation();
+    return TRUE;
+}
+#endif
+
+// with the malloc hook, operator new is counted there
+void* operator new(std::size_t size)
+{
+#ifndef MALLOC_HOOKED
+    countAllocation();
+#endif
+    void* ptr = std::malloc(size > 0 ? size : 1);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try { return operator new(size); }
+    catch (...) { return nullptr; }
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    try { return operator new(size); }
+    catch (...) { return nullptr; }
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+// runs the evaluation once to size the buffers, then counts the allocations of the repeated runs
+template<typename Evaluation>
+bool expectNoAllocations(const std::string& name, int threads_num, const Evaluation& evaluate)
+{
+    evaluate();
+
+    allocations_num = 0;
+    counting = true;
+    for (int i = 0; i < REPEATS; ++i)
+        evaluate();
+    counting = false;
+
+    const long allocations = allocations_num;
+    std::cout << (allocations == 0 ? "ok     " : "FAILED ") << name << " (" << threads_num << " threads): "
+        << allocations << " allocations" << std::endl;
+    return allocations == 0;
+}
+
+// moves the state a little, so that the evaluations are not skipped as repeated
+void perturb(SMPLWrapper::State& state)
+{
+    state.pose(3, 1) += 1e-3;
+    state.shape(2) += 1e-3;
+    state.translation(0) += 1e-3;
+}
+
+bool expectNoCostAllocations(const std::string& name, int threads_num, SMPLWrapper::State& state,
+    AbsoluteDistanceBase::EvaluationContext& context, const AbsoluteDistanceBase& cost, double* parameter_block)
+{
+    std::vector<double> residuals(cost.num_residuals());
+    std::vector<double> jacobian(cost.num_residuals() * cost.parameter_block_sizes()[0]);
+    const double* parameters[] = { parameter_block };
+    double* jacobians[] = { jacobian.data() };
+
+    return expectNoAllocations(name, threads_num, [&]()
+    {
+        perturb(state);
+        context.PrepareForEvaluation(true, true);
+        cost.Evaluate(parameters, residuals.data(), jacobians);
+    });
+}
+
+int runChecks(const std::string& smpl_path)
+{
+    std::mt19937 generator(1);
+    std::normal_distribution<double> distribution(0., 0.2);
+
+    // the scan: the other body in the other pose
+    SMPLWrapper scan_smpl('f', smpl_path);
+    SMPLWrapper::State& scan_state = scan_smpl.getStatePointers();
+    for (int i = 0; i < scan_state.pose.size(); ++i)
+        scan_state.pose.data()[i] = distribution(generator);
+    for (int i = 0; i < scan_state.shape.size(); ++i)
+        scan_state.shape(i) = 3. * distribution(generator);
+    const std::string scan_filename = "allocation_test_scan.obj";
+    scan_smpl.saveToObj(scan_filename);
+    GeneralMesh scan(scan_filename.c_str(), GeneralMesh::FEMALE);
+    MeshDistanceQuery query(scan);
+    query.buildDistanceField(0.01, 0.05);
+
+    SMPLWrapper smpl('f', smpl_path);
+    SMPLWrapper::State& state = smpl.getStatePointers();
+    for (int i = 0; i < state.pose.size(); ++i)
+        state.pose.data()[i] = distribution(generator);
+    for (int i = 0; i < state.shape.size(); ++i)
+        state.shape(i) = distribution(generator);
+    state.displacements = SMPLWrapper::ERMatrixXd::Zero(SMPLWrapper::VERTICES_NUM, SMPLWrapper::SPACE_DIM);
+
+    const Eigen::MatrixXd residual_grads = Eigen::MatrixXd::Random(SMPLWrapper::VERTICES_NUM, SMPLWrapper::SPACE_DIM);
+    const Eigen::VectorXd vertex_residuals = Eigen::VectorXd::Random(SMPLWrapper::VERTICES_NUM);
+
+    int failed = 0;
+    const int hardware_threads = (int)std::thread::hardware_concurrency();
+    for (const int threads_num : { 1, std::max(2, hardware_threads) })
+    {
+        auto thread_pool = std::make_shared<ThreadPool>(threads_num);
+        smpl.setThreadPool(thread_pool);
+        query.setThreadPool(thread_pool);
+
+        SMPLWrapper::Workspace workspace;
+        Eigen::MatrixXd verts, normals;
+        SMPLWrapper::PoseJacobian pose_jac;
+        SMPLWrapper::ERMatrixXd shape_jac, displacement_jac;
+        SMPLWrapper::NormalEquations pose_normal_equations, shape_normal_equations;
+        Eigen::VectorXd signed_dists;
+        Eigen::VectorXi closest_face_ids;
+        Eigen::MatrixXd closest_points, normals_for_sign;
+
+        for (const bool single_precision : { false, true })
+        {
+            smpl.setSinglePrecision(single_precision);
+            const std::string mode = single_precision ? " (float)" : "";
+
+            failed += !expectNoAllocations("forward" + mode, threads_num, [&]()
+            {
+                perturb(state);
+                smpl.calcModel(&state.translation, &state.pose, &state.shape, &state.displacements, workspace, verts);
+            });
+            failed += !expectNoAllocations("pose jacobian" + mode, threads_num, [&]()
+            {
+                perturb(state);
+                smpl.calcModel(&state.translation, &state.pose, &state.shape, &state.displacements, workspace, verts,
+                    &pose_jac);
+            });
+            failed += !expectNoAllocations("shape jacobian" + mode, threads_num, [&]()
+            {
+                perturb(state);
+                smpl.calcModel(&state.translation, &state.pose, &state.shape, &state.displacements, workspace, verts,
+                    nullptr, &shape_jac);
+            });
+            failed += !expectNoAllocations("displacement jacobian" + mode, threads_num, [&]()
+            {
+                perturb(state);
+                smpl.calcModel(&state.translation, &state.pose, &state.shape, &state.displacements, workspace, verts,
+                    nullptr, nullptr, &displacement_jac);
+            });
+            failed += !expectNoAllocations("vertex normals" + mode, threads_num, [&]()
+            {
+                smpl.calcVertexNormals(verts, normals);
+            });
+            failed += !expectNoAllocations("normal equations" + mode, threads_num, [&]()
+            {
+                perturb(state);
+                smpl.calcPoseNormalEquations(state.pose, &state.shape, &state.displacements,
+                    residual_grads, vertex_residuals, workspace, pose_normal_equations);
+                smpl.calcShapeNormalEquations(&state.pose, state.shape,
+                    residual_grads, vertex_residuals, workspace, shape_normal_equations);
+            });
+            failed += !expectNoAllocations("distance" + mode, threads_num, [&]()
+            {
+                query.signedDistance(verts, signed_dists, closest_face_ids, closest_points, normals_for_sign,
+                    single_precision);
+            });
+            failed += !expectNoAllocations("distance, warm start" + mode, threads_num, [&]()
+            {
+                query.signedDistance(verts, signed_dists, closest_face_ids, closest_points, normals_for_sign,
+                    single_precision, true);
+            });
+        }
+        smpl.setSinglePrecision(false);
+
+        query.setUseDistanceField(true);
+        failed += !expectNoAllocations("distance field", threads_num, [&]()
+        {
+            query.signedDistance(verts, signed_dists, closest_face_ids, closest_points, normals_for_sign);
+        });
+        query.setUseDistanceField(false);
+
+        // the costs, as set up by ShapeUnderClothOptimizer
+        using Context = AbsoluteDistanceBase::EvaluationContext;
+        {
+            std::shared_ptr<Context> context(new Context(&smpl, &query, AbsoluteDistanceBase::TRANSLATION));
+            AbsoluteDistanceBase cost(context, &scan);
+            failed += !expectNoCostAllocations("translation cost", threads_num, state, *context, cost,
+                state.translation.data());
+        }
+        {
+            std::shared_ptr<Context> context(new Context(&smpl, &query, AbsoluteDistanceBase::DISPLACEMENT));
+            AbsoluteDistanceBase cost(context, &scan, AbsoluteDistanceBase::BOTH_DIST, 100., 0);
+            failed += !expectNoCostAllocations("displacement cost", threads_num, state, *context, cost,
+                state.displacements.data());
+        }
+        for (const auto parameter : { AbsoluteDistanceBase::SHAPE, AbsoluteDistanceBase::POSE })
+        {
+            double* parameter_block = parameter == AbsoluteDistanceBase::SHAPE ? state.shape.data() : state.pose.data();
+            const std::string parameter_name = parameter == AbsoluteDistanceBase::SHAPE ? "shape" : "pose";
+            for (const bool compress_residuals : { false, true })
+            {
+                const std::string mode = compress_residuals ? " (compressed)" : "";
+                std::shared_ptr<Context> context(new Context(&smpl, &query, parameter, compress_residuals));
+
+                AbsoluteDistanceBase cost(context, &scan);
+                failed += !expectNoCostAllocations(parameter_name + " cost" + mode, threads_num, state, *context, cost,
+                    parameter_block);
+
+                FusedDistanceCost fused_cost(context, &scan);
+                failed += !expectNoCostAllocations(parameter_name + " fused cost" + mode, threads_num, state,
+                    *context, fused_cost, parameter_block);
+
+                FusedDistanceCost fused_loss_cost(context, &scan, new ceres::CauchyLoss(1.));
+                failed += !expectNoCostAllocations(parameter_name + " fused cost with loss" + mode, threads_num, state,
+                    *context, fused_loss_cost, parameter_block);
+            }
+        }
+    }
+
+    std::cout << (failed == 0 ? "All evaluations are allocation-free" : std::to_string(failed) + " evaluations allocated")
+        << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cout << "Usage: Allocation-Test <SMPL resources folder or bundle>" << std::endl;
+        return 2;
+    }
+#if defined(_MSC_VER) && defined(_DEBUG)
+    _CrtSetAllocHook(allocationHook);
+#endif
+#ifndef MALLOC_HOOKED
+    std::cout << "WARNING: malloc can't be hooked on this platform, only operator new calls are counted" << std::endl;
+#endif
+
+    try
+    {
+        return runChecks(argv[1]);
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "Exception encountered: " << e.what() << std::endl;
+        return 2;
+    }
+}
@@ -1,26 +1,39 @@
 #include "AbsoluteDistanceBase.h"
+#include "ThreadPool.h"
 
-AbsoluteDistanceBase::DistanceResult AbsoluteDistanceBase::last_result_;
-
-AbsoluteDistanceBase::AbsoluteDistanceBase(SMPLWrapper* smpl, GeneralMesh * toMesh,
-    ParameterType parameter, DistanceType dist_type,  double pruning_threshold, std::size_t vertex_id)
-    : ceres::EvaluationCallback(),
-    toMesh_(toMesh), smpl_(smpl),
+AbsoluteDistanceBase::AbsoluteDistanceBase(std::shared_ptr<const EvaluationContext> context, GeneralMesh * toMesh,
+    DistanceType dist_type, double pruning_threshold, std::size_t vertex_id)
+    : context_(std::move(context)),
+    toMesh_(toMesh),
     pruning_threshold_(pruning_threshold),
-    parameter_type_(parameter), vertex_id_for_displacement_(vertex_id), dist_evaluation_type_(dist_type)
+    vertex_id_for_displacement_(vertex_id), dist_evaluation_type_(dist_type)
 {
-    switch (parameter)
+    if (context_ == nullptr)
+        throw std::invalid_argument("DistanceBase initialization::ERROR:: no evaluation context");
+    smpl_ = context_->getSMPL();
+    parameter_type_ = context_->getParameterType();
+    compress_residuals_ = context_->isCompressingResiduals();
+    // the full-size buffers are only for the compressed evaluation: the per-vertex DISPLACEMENT costs are numerous
+    if (compress_residuals_)
+    {
+        allocateNormalEquationsBuffers();
+        eigen_solver_ = Eigen::SelfAdjointEigenSolver<NormalMatrix>(
+            parameter_type_ == POSE ? SMPLWrapper::POSE_SIZE : SMPLWrapper::SHAPE_SIZE);
+        projected_Jtr_.resize(parameter_type_ == POSE ? SMPLWrapper::POSE_SIZE : SMPLWrapper::SHAPE_SIZE);
+    }
+
+    switch (parameter_type_)
     {
         case TRANSLATION:
             this->set_num_residuals(SMPLWrapper::VERTICES_NUM);
             this->mutable_parameter_block_sizes()->push_back(SMPLWrapper::SPACE_DIM);
             break;
         case SHAPE:
-            this->set_num_residuals(SMPLWrapper::VERTICES_NUM);
+            this->set_num_residuals(compress_residuals_ ? SMPLWrapper::SHAPE_SIZE + 1 : SMPLWrapper::VERTICES_NUM);
             this->mutable_parameter_block_sizes()->push_back(SMPLWrapper::SHAPE_SIZE);
             break;
         case POSE:
-            this->set_num_residuals(SMPLWrapper::VERTICES_NUM);
+            this->set_num_residuals(compress_residuals_ ? SMPLWrapper::POSE_SIZE + 1 : SMPLWrapper::VERTICES_NUM);
             this->mutable_parameter_block_sizes()->push_back(SMPLWrapper::POSE_SIZE);
             break;
         case DISPLACEMENT: 
@@ -36,18 +49,28 @@ AbsoluteDistanceBase::~AbsoluteDistanceBase()
 {
 }
 
-void AbsoluteDistanceBase::PrepareForEvaluation(bool evaluate_jacobians, bool new_evaluation_point)
-{
-    if (evaluate_jacobians || new_evaluation_point)
-        updateDistanceCalculations(evaluate_jacobians, last_result_);
-}
-
 bool AbsoluteDistanceBase::Evaluate(double const * const * parameters, double * residuals, double ** jacobians) const
 {
     assert(SMPLWrapper::SPACE_DIM == 3 && "Distance evaluation is only implemented in 3D");
     
-    // TODO add the checks for the expected parameter size and the one used for calculating last_result
-    DistanceResult& distance_to_use = last_result_;
+    const DistanceResult& distance_to_use = context_->getResult();
+
+    if (compress_residuals_)
+    {
+        calcVertexResiduals(distance_to_use, vertex_residuals_.data());
+
+        if (jacobians != NULL && jacobians[0] != NULL)
+        {
+            calcNormalEquations(distance_to_use, vertex_residuals_, normal_equations_);
+            fillCompressed(normal_equations_, vertex_residuals_.squaredNorm(), residuals, jacobians[0]);
+        }
+        else
+        {
+            std::fill(residuals, residuals + num_residuals(), 0.);
+            residuals[num_residuals() - 1] = vertex_residuals_.norm();
+        }
+        return true;
+    }
 
     // fill resuduals
     const Eigen::MatrixXd& input_face_normals = toMesh_->getFaceNormals();
@@ -64,15 +87,7 @@ bool AbsoluteDistanceBase::Evaluate(double const * const * parameters, double *
     }
     else
     {
-        for (int i = 0; i < SMPLWrapper::VERTICES_NUM; ++i)
-        {
-            residuals[i] = residual_elem_(distance_to_use.signedDists(i),
-                distance_to_use.verts_normals.row(i),
-                input_face_normals.row(distance_to_use.closest_face_ids(i)),
-                toMesh_->isClothSegmented() ? 
-                    toMesh_->getFacesClothProbabilities()[distance_to_use.closest_face_ids(i)] 
-                    : 1.);
-        }
+        calcVertexResiduals(distance_to_use, residuals);
     }
 
     // fill out jacobians
@@ -84,9 +99,11 @@ bool AbsoluteDistanceBase::Evaluate(double const * const * parameters, double *
             fillTranslationJac(distance_to_use, residuals, jacobians[0]);
             break;
         case SHAPE:
-        case POSE:
             fillJac(distance_to_use, residuals, jacobians[0]);
             break;
+        case POSE:
+            fillPoseJac(distance_to_use, residuals, jacobians[0]);
+            break;
         case DISPLACEMENT:
             fillDisplacementJac(distance_to_use, residuals, jacobians[0]);
             break;
@@ -98,124 +115,239 @@ bool AbsoluteDistanceBase::Evaluate(double const * const * parameters, double *
     return true;
 }
 
-void AbsoluteDistanceBase::updateDistanceCalculations(bool with_jacobian, DistanceResult& out_distance_result)
+void AbsoluteDistanceBase::calcNormalEquations(SMPLWrapper::NormalEquations & out) const
 {
-    bool calc_jac = 
-        parameter_type_ == TRANSLATION || parameter_type_ == DISPLACEMENT && displacement_jac_evaluated
-        ? false : with_jacobian;
+    allocateNormalEquationsBuffers();
+    calcVertexResiduals(context_->getResult(), vertex_residuals_.data());
+    calcNormalEquations(context_->getResult(), vertex_residuals_, out);
+}
 
-    if (calc_jac)
-    {
-        out_distance_result.jacobian.resize(parameter_block_sizes()[0]);
+void AbsoluteDistanceBase::allocateNormalEquationsBuffers() const
+{
+    // no-op if already sized
+    vertex_residuals_.resize(SMPLWrapper::VERTICES_NUM);
+    residual_grads_.resize(SMPLWrapper::VERTICES_NUM, SMPLWrapper::SPACE_DIM);
+}
 
-        switch (parameter_type_)
+void AbsoluteDistanceBase::calcVertexResiduals(const DistanceResult & distance_res, double * residuals) const
+{
+    const Eigen::MatrixXd& input_face_normals = toMesh_->getFaceNormals();
+    parallelForVertices_([&](int v_begin, int v_end)
+    {
+        for (int i = v_begin; i < v_end; ++i)
         {
-        case SHAPE:
-            out_distance_result.verts = smpl_->calcModel(
-                &smpl_->getStatePointers().translation, 
-                &smpl_->getStatePointers().pose, 
-                &smpl_->getStatePointers().shape, 
-                &smpl_->getStatePointers().displacements,
-                nullptr, &out_distance_result.jacobian[0], nullptr);
-            break;
-        case POSE:
-            out_distance_result.verts = smpl_->calcModel(
-                &smpl_->getStatePointers().translation, 
-                &smpl_->getStatePointers().pose, 
-                &smpl_->getStatePointers().shape,
-                &smpl_->getStatePointers().displacements,
-                &out_distance_result.jacobian[0], nullptr, nullptr);
-            break;
-        case DISPLACEMENT:
-            out_distance_result.verts = smpl_->calcModel(
-                &smpl_->getStatePointers().translation,
-                &smpl_->getStatePointers().pose,
-                &smpl_->getStatePointers().shape,
-                &smpl_->getStatePointers().displacements,
-                nullptr, nullptr, &out_distance_result.jacobian[0]);
-            displacement_jac_evaluated = true;
-            break;
-        default:
-            throw std::invalid_argument("DistanceBase Update::WARNING:: no parameter type for Jac calculation specified");
+            residuals[i] = residual_elem_(distance_res.signedDists(i),
+                distance_res.verts_normals.row(i),
+                input_face_normals.row(distance_res.closest_face_ids(i)),
+                toMesh_->isClothSegmented() ? 
+                    toMesh_->getFacesClothProbabilities()[distance_res.closest_face_ids(i)] 
+                    : 1.);
         }
-    }
-    else
+    });
+}
+
+void AbsoluteDistanceBase::calcNormalEquations(const DistanceResult & distance_res, const Eigen::VectorXd & vertex_residuals,
+    SMPLWrapper::NormalEquations & out) const
+{
+    if (parameter_type_ != SHAPE && parameter_type_ != POSE)
+        throw std::invalid_argument("DistanceBase Normal Equations::ERROR:: only available for shape and pose");
+
+    // the same as the jac_elem_ of fillJac() for the model jacobian of each axis
+    Eigen::MatrixXd& residual_grads = residual_grads_;
+    parallelForVertices_([&](int v_begin, int v_end)
     {
-        out_distance_result.verts = smpl_->calcModel(
-            &smpl_->getStatePointers().translation, 
-            &smpl_->getStatePointers().pose, 
-            &smpl_->getStatePointers().shape, 
-            &smpl_->getStatePointers().displacements);
-    }
-    // get vertex normals
-    out_distance_result.verts_normals = smpl_->calcVertexNormals(&out_distance_result.verts);
-        
-    calcSignedDistByVertecies(out_distance_result);
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
+            residual_grads.row(v_id) = residual_grad_(distance_res, v_id, vertex_residuals(v_id));
+    });
+
+    calcModelNormalEquations(residual_grads, vertex_residuals, out);
+}
+
+void AbsoluteDistanceBase::calcModelNormalEquations(const Eigen::MatrixXd & residual_grads, const Eigen::VectorXd & vertex_residuals,
+    SMPLWrapper::NormalEquations & out) const
+{
+    SMPLWrapper::State& state = smpl_->getStatePointers();
+    if (parameter_type_ == POSE)
+        smpl_->calcPoseNormalEquations(state.pose, &state.shape, &state.displacements,
+            residual_grads, vertex_residuals, workspace_, out);
+    else
+        smpl_->calcShapeNormalEquations(&state.pose, state.shape,
+            residual_grads, vertex_residuals, workspace_, out);
 }
 
-void AbsoluteDistanceBase::calcSignedDistByVertecies(DistanceResult & out_distance_result) const
+void AbsoluteDistanceBase::fillCompressed(const SMPLWrapper::NormalEquations & normal_equations, 
+    double residuals_squared_norm, double * residuals, double * jacobian) const
 {
-    igl::SignedDistanceType type = igl::SIGNED_DISTANCE_TYPE_PSEUDONORMAL;
-    igl::signed_distance(out_distance_result.verts,
-        toMesh_->getNormalizedVertices(),
-        toMesh_->getFaces(),
-        type,
-        out_distance_result.signedDists,
-        out_distance_result.closest_face_ids,
-        out_distance_result.closest_points,
-        out_distance_result.normals_for_sign);
+    const int params_num = parameter_block_sizes()[0];
+    eigen_solver_.compute(normal_equations.JtJ);
+    const auto& eigenvalues = eigen_solver_.eigenvalues();
+    const auto& eigenvectors = eigen_solver_.eigenvectors();
+    Eigen::VectorXd& projected_Jtr = projected_Jtr_;
+    projected_Jtr.noalias() = eigenvectors.transpose() * normal_equations.Jtr;
 
-    assert(out_distance_result.signedDists.size() == SMPLWrapper::VERTICES_NUM
-        && "Size of the set of distances should equal main parameters");
-    assert(out_distance_result.closest_points.rows() == SMPLWrapper::VERTICES_NUM
-        && "Size of the set of distances should equal main parameters");
+    // J^T r lies in the range of J^T J => the null space directions are dropped
+    const double rank_threshold = 1e-12 * std::max(eigenvalues.maxCoeff(), 0.);
+    Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> jacobian_map(
+        jacobian, params_num + 1, params_num);
+    jacobian_map.setZero();
+    double compressed_squared_norm = 0.;
+    for (int i = 0; i < params_num; ++i)
+    {
+        residuals[i] = 0.;
+        if (eigenvalues(i) > rank_threshold)
+        {
+            const double singular_value = sqrt(eigenvalues(i));
+            residuals[i] = projected_Jtr(i) / singular_value;
+            jacobian_map.row(i) = singular_value * eigenvectors.col(i).transpose();
+            compressed_squared_norm += residuals[i] * residuals[i];
+        }
+    }
+    // the rest of the cost: not affected by the linearized step
+    residuals[params_num] = sqrt(std::max(residuals_squared_norm - compressed_squared_norm, 0.));
 }
 
 void AbsoluteDistanceBase::fillJac(const DistanceResult& distance_res, const double* residuals, double * jacobian) const
 {
-    for (int v_id = 0; v_id < SMPLWrapper::VERTICES_NUM; ++v_id)
+    // both jacobians are vertex-major => the row of the residual is a combination of the contiguous vertex rows
+    const int params_num = parameter_block_sizes()[0];
+    parallelForVertices_([&](int v_begin, int v_end)
     {
-        for (int param_id = 0; param_id < parameter_block_sizes()[0]; ++param_id)
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
         {
-            jacobian[v_id * parameter_block_sizes()[0] + param_id]
-                = jac_elem_(distance_res.verts.row(v_id), 
-                    distance_res.closest_points.row(v_id), 
-                    residuals[v_id],
-                    distance_res.jacobian[param_id].row(v_id), 
-                    toMesh_->isClothSegmented() ?
-                        toMesh_->getFacesClothProbabilities()[distance_res.closest_face_ids(v_id)]
-                        : 1.);
+            Eigen::Map<Eigen::RowVectorXd> residual_jac(jacobian + v_id * params_num, params_num);
+            residual_jac.noalias() = residual_grad_(distance_res, v_id, residuals[v_id])
+                * distance_res.jacobian.middleRows<SMPLWrapper::SPACE_DIM>(v_id * SMPLWrapper::SPACE_DIM);
         }
-    }
+    });
 }
 
-void AbsoluteDistanceBase::fillDisplacementJac(const DistanceResult & distance_res, const double * residuals, double * jacobian) const
+void AbsoluteDistanceBase::fillPoseJac(const DistanceResult& distance_res, const double* residuals, double * jacobian) const
 {
-    double distance = abs(distance_res.signedDists(vertex_id_for_displacement_));
-    for (int axis_id = 0; axis_id < parameter_block_sizes()[0]; ++axis_id)
+    // only the parameters that affect the vertex have non-zero entries
+    const SMPLWrapper::PoseJacobian& pose_jac = distance_res.pose_jacobian;
+    const int params_num = parameter_block_sizes()[0];
+    parallelForVertices_([&](int v_begin, int v_end)
     {
-        jacobian[axis_id]
-            = jac_elem_(distance_res.verts.row(vertex_id_for_displacement_),
-                distance_res.closest_points.row(vertex_id_for_displacement_),
-                residuals[0],
-                distance_res.jacobian[axis_id].row(vertex_id_for_displacement_), 
-                toMesh_->isClothSegmented() ?
-                    toMesh_->getFacesClothProbabilities()[distance_res.closest_face_ids(vertex_id_for_displacement_)]
-                    : 1.);
+        std::fill(jacobian + v_begin * params_num, jacobian + v_end * params_num, 0.);
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
+        {
+            for (int entry = pose_jac.offsets[v_id]; entry < pose_jac.offsets[v_id + 1]; ++entry)
+            {
+                jacobian[v_id * params_num + pose_jac.params[entry]]
+                    = jac_elem_(distance_res.verts.row(v_id), 
+                        distance_res.closest_points.row(v_id), 
+                        residuals[v_id],
+                        pose_jac.values.row(entry), 
+                        toMesh_->isClothSegmented() ?
+                            toMesh_->getFacesClothProbabilities()[distance_res.closest_face_ids(v_id)]
+                            : 1.);
+            }
+        }
+    });
+}
 
-    }
+void AbsoluteDistanceBase::fillDisplacementJac(const DistanceResult & distance_res, const double * residuals, double * jacobian) const
+{
+    Eigen::Map<Eigen::RowVector3d> residual_jac(jacobian);
+    residual_jac.noalias() = residual_grad_(distance_res, (int)vertex_id_for_displacement_, residuals[0])
+        * distance_res.jacobian.middleRows<SMPLWrapper::SPACE_DIM>(vertex_id_for_displacement_ * SMPLWrapper::SPACE_DIM);
 }
 
 void AbsoluteDistanceBase::fillTranslationJac(const DistanceResult& distance_res, const double* residuals, double * jacobian) const
 {
-    for (int v_id = 0; v_id < SMPLWrapper::VERTICES_NUM; ++v_id)
+    const int params_num = parameter_block_sizes()[0];
+    parallelForVertices_([&](int v_begin, int v_end)
     {
-        for (int p_id = 0; p_id < parameter_block_sizes()[0]; ++p_id)
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
         {
-            jacobian[v_id * parameter_block_sizes()[0] + p_id]
-                = translation_jac_elem_(distance_res.verts(v_id, p_id),
-                    distance_res.closest_points(v_id, p_id),
-                    residuals[v_id]);
+            for (int p_id = 0; p_id < params_num; ++p_id)
+            {
+                jacobian[v_id * params_num + p_id]
+                    = translation_jac_elem_(distance_res.verts(v_id, p_id),
+                        distance_res.closest_points(v_id, p_id),
+                        residuals[v_id]);
+            }
+        }
+    });
+}
+
+AbsoluteDistanceBase::EvaluationContext::EvaluationContext(SMPLWrapper * smpl, const MeshDistanceQuery * toMeshQuery,
+    ParameterType parameter, bool compress_residuals)
+    : smpl_(smpl), toMeshQuery_(toMeshQuery), parameter_type_(parameter), compress_residuals_(compress_residuals)
+{
+    if (compress_residuals && parameter != SHAPE && parameter != POSE)
+        throw std::invalid_argument("DistanceBase initialization::ERROR:: residuals compression is only available for shape and pose");
+}
+
+AbsoluteDistanceBase::EvaluationContext::~EvaluationContext()
+{
+}
+
+void AbsoluteDistanceBase::EvaluationContext::PrepareForEvaluation(bool evaluate_jacobians, bool new_evaluation_point)
+{
+    if (evaluate_jacobians || new_evaluation_point)
+        updateDistanceCalculations_(evaluate_jacobians);
+}
+
+void AbsoluteDistanceBase::EvaluationContext::updateDistanceCalculations_(bool with_jacobian)
+{
+    // compressed residuals stream through the model jacobian themselves
+    const bool calc_jac = with_jacobian
+        && !compress_residuals_
+        && parameter_type_ != TRANSLATION
+        && !(parameter_type_ == DISPLACEMENT && displacement_jac_evaluated_);
+
+    // the results are written into the buffers of the previous evaluation => no re-allocation
+    SMPLWrapper::State& state = smpl_->getStatePointers();
+    if (calc_jac)
+    {
+        switch (parameter_type_)
+        {
+        case SHAPE:
+            smpl_->calcModel(&state.translation, &state.pose, &state.shape, &state.displacements,
+                workspace_, result_.verts,
+                nullptr, &result_.jacobian, nullptr);
+            break;
+        case POSE:
+            smpl_->calcModel(&state.translation, &state.pose, &state.shape, &state.displacements,
+                workspace_, result_.verts,
+                &result_.pose_jacobian, nullptr, nullptr);
+            break;
+        case DISPLACEMENT:
+            smpl_->calcModel(&state.translation, &state.pose, &state.shape, &state.displacements,
+                workspace_, result_.verts,
+                nullptr, nullptr, &result_.jacobian);
+            displacement_jac_evaluated_ = true;
+            break;
+        default:
+            throw std::invalid_argument("DistanceBase Update::WARNING:: no parameter type for Jac calculation specified");
         }
     }
+    else
+    {
+        smpl_->calcModel(&state.translation, &state.pose, &state.shape, &state.displacements,
+            workspace_, result_.verts);
+    }
+    // get vertex normals
+    smpl_->calcVertexNormals(result_.verts, result_.verts_normals);
+
+    calcSignedDistByVertecies_();
+}
+
+void AbsoluteDistanceBase::EvaluationContext::calcSignedDistByVertecies_()
+{
+    // the tree and pseudonormals of the input are pre-computed
+    // the vertices move little between the evaluations => the previous correspondences seed the search
+    toMeshQuery_->signedDistance(result_.verts,
+        result_.signedDists,
+        result_.closest_face_ids,
+        result_.closest_points,
+        result_.normals_for_sign,
+        smpl_->isSinglePrecision(),
+        true);
+
+    assert(result_.signedDists.size() == SMPLWrapper::VERTICES_NUM
+        && "Size of the set of distances should equal main parameters");
+    assert(result_.closest_points.rows() == SMPLWrapper::VERTICES_NUM
+        && "Size of the set of distances should equal main parameters");
 }
@@ -1,12 +1,25 @@
 #pragma once
+/*
+Point-to-surface distance cost between the SMPL vertices and the input mesh.
+
+The model and the distance queries are evaluated once per evaluation point for all the distance costs of a problem:
+the costs share an EvaluationContext, which is set as the problem's evaluation callback
+(Solver::Options::evaluation_callback) and keeps the vertices, normals, correspondences and model jacobian.
+Each problem owns its context, so the fits with their own models (SMPLWrapper) can run side by side, e.g. on different threads.
+*/
+
+#include <memory>
+
 #include <ceres/ceres.h>
 #include <igl/point_mesh_squared_distance.h>
 #include <igl/signed_distance.h>
 
 #include <GeneralMesh/GeneralMesh.h>
 #include "SMPLWrapper.h"
+#include "MeshDistanceQuery.h"
+#include "ThreadPool.h"
 
-class AbsoluteDistanceBase : public ceres::CostFunction, public ceres::EvaluationCallback
+class AbsoluteDistanceBase : public ceres::CostFunction
 {
 public:
     enum ParameterType{
@@ -25,42 +38,107 @@ public:
         SKIN_BOTH
     };
 
-    AbsoluteDistanceBase(SMPLWrapper*, GeneralMesh *,
-        ParameterType parameter = BASE, DistanceType dist_type = BOTH_DIST,
+    struct DistanceResult {
+        Eigen::MatrixXd verts;
+        Eigen::MatrixXd verts_normals;
+        // SHAPE and DISPLACEMENT: vertex-major, as the residual jacobian (see SMPLWrapper::calcModel())
+        SMPLWrapper::ERMatrixXd jacobian;
+        SMPLWrapper::PoseJacobian pose_jacobian;    // for the POSE only
+        // libigl output
+        Eigen::VectorXd signedDists;
+        Eigen::VectorXi closest_face_ids;
+        Eigen::MatrixXd closest_points;
+        Eigen::MatrixXd normals_for_sign;
+    };
+
+    // Evaluation state of the distance costs of a single problem, to be set as its evaluation callback.
+    // The model state is expected to be the parameter blocks of the problem (see SMPLWrapper::getStatePointers())
+    class EvaluationContext : public ceres::EvaluationCallback
+    {
+    public:
+        // the distance query structures are expected to be built for the GeneralMesh of the costs.
+        // compress_residuals (SHAPE and POSE only): the VERTICES_NUM residuals are replaced by the equivalent
+        // (parameters + 1) residuals built from the normal equations, so the per-vertex jacobian is never stored.
+        // All the costs of the context optimize the given parameter in the given mode
+        EvaluationContext(SMPLWrapper*, const MeshDistanceQuery*, ParameterType parameter, bool compress_residuals = false);
+        ~EvaluationContext();
+
+        // Callback to be called before the evaluation of the optimization step
+        // the new optimization parameter values are pushed to the smpl parameters
+        virtual void PrepareForEvaluation(bool evaluate_jacobians, bool new_evaluation_point);
+
+        SMPLWrapper* getSMPL() const { return smpl_; }
+        ParameterType getParameterType() const { return parameter_type_; }
+        bool isCompressingResiduals() const { return compress_residuals_; }
+        // at the last evaluation point
+        const DistanceResult& getResult() const { return result_; }
+
+    private:
+        EvaluationContext(const EvaluationContext&) = delete;
+        EvaluationContext& operator=(const EvaluationContext&) = delete;
+
+        void updateDistanceCalculations_(bool with_jacobian);
+        void calcSignedDistByVertecies_();
+
+        SMPLWrapper* smpl_;
+        const MeshDistanceQuery* toMeshQuery_;
+        ParameterType parameter_type_;
+        bool compress_residuals_;
+        bool displacement_jac_evaluated_ = false;   // for the DISPLACEMENT only
+
+        DistanceResult result_;
+        SMPLWrapper::Workspace workspace_;
+
+    public:
+        // fixed-size eigen objects in the workspace
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    // the costs evaluated at the same points share the context
+    AbsoluteDistanceBase(std::shared_ptr<const EvaluationContext> context, GeneralMesh *,
+        DistanceType dist_type = BOTH_DIST,
         double pruning_threshold = 100.,
         std::size_t vertex_id = 0);
     ~AbsoluteDistanceBase();
 
-    // Callback to be called before the evaluation of the optimization step
-    // the new optimization parameter values are pushed to the smpl_ parameters 
-    virtual void PrepareForEvaluation(bool evaluate_jacobians, bool new_evaluation_point);
-
     // parameters[0] <-> this->parameter_type_
     // Main idea for point-to-surface distance jacobian: 
     // Gradient for each vertex correspondes to the distance from this vertex to the input mesh.
+    // With compressed residuals: r' = S^-1/2 V^T J^T r, J' = S^1/2 V^T, where J^T J = V S V^T,
+    // and the last residual is sqrt(r^T r - r'^T r') with zero derivatives => 
+    // J'^T J' = J^T J, J'^T r' = J^T r and the cost is the same, so is the Gauss-Newton step (with any loss function). 
+    // Without jacobians, only the last residual is non-zero and carries the cost
     virtual bool Evaluate(double const* const* parameters,
         double* residuals,
         double** jacobians) const;
 
-protected:
-    struct DistanceResult {
-        Eigen::MatrixXd verts;
-        Eigen::MatrixXd verts_normals;
-        std::vector<Eigen::MatrixXd> jacobian;
-        // libigl output
-        Eigen::VectorXd signedDists; 
-        Eigen::VectorXi closest_face_ids; 
-        Eigen::MatrixXd closest_points;
-        Eigen::MatrixXd normals_for_sign;
-    };
+    // SHAPE and POSE: normal equations of the per-vertex residuals at the last evaluated point, 
+    // accumulated without storing the jacobian (see SMPLWrapper::calcPoseNormalEquations())
+    void calcNormalEquations(SMPLWrapper::NormalEquations& out) const;
 
-    void updateDistanceCalculations(bool with_jacobian, DistanceResult& out_distance_result);
-    void calcSignedDistByVertecies(DistanceResult& out_distance_result) const;
+protected:
+    // sizes vertex_residuals_ and residual_grads_, once
+    void allocateNormalEquationsBuffers() const;
+    // VERTICES_NUM residuals
+    void calcVertexResiduals(const DistanceResult& distance_res, double* residuals) const;
+    void calcNormalEquations(const DistanceResult& distance_res, const Eigen::VectorXd& vertex_residuals, 
+        SMPLWrapper::NormalEquations& out) const;
+    // normal equations of the residuals with the given gradients w.r.t. the vertices: streamed through the model jacobian
+    void calcModelNormalEquations(const Eigen::MatrixXd& residual_grads, const Eigen::VectorXd& vertex_residuals,
+        SMPLWrapper::NormalEquations& out) const;
+    void fillCompressed(const SMPLWrapper::NormalEquations& normal_equations, double residuals_squared_norm,
+        double* residuals, double* jacobian) const;
 
     void fillJac(const DistanceResult& distance_res, const double* residuals, double * jacobian) const;
+    void fillPoseJac(const DistanceResult& distance_res, const double* residuals, double * jacobian) const;
     void fillDisplacementJac(const DistanceResult& distance_res, const double* residuals, double * jacobian) const;
     void fillTranslationJac(const DistanceResult& distance_res, const double* residuals, double * jacobian) const;
 
+    // func(v_begin, v_end) over the vertex chunks on the thread pool of the model.
+    // The vertices are independent => the results don't depend on the number of threads
+    template<typename ChunkFunction>
+    void parallelForVertices_(const ChunkFunction& func) const;
+
     // 
     template<typename Row1, typename Row2>
     inline double residual_elem_(const double signed_dist, 
@@ -110,6 +188,21 @@ protected:
         }
     }
 
+    // d residual / d vertex: jac_elem_() of every axis at once
+    inline Eigen::RowVector3d residual_grad_(const DistanceResult& distance_res, int v_id, double abs_dist) const
+    {
+        const double cloth_prob = toMesh_->isClothSegmented() ?
+            toMesh_->getFacesClothProbabilities()[distance_res.closest_face_ids(v_id)] : 1.;
+        Eigen::RowVector3d grad;
+        for (int axis = 0; axis < SMPLWrapper::SPACE_DIM; ++axis)
+            grad(axis) = jac_elem_(distance_res.verts.row(v_id),
+                distance_res.closest_points.row(v_id),
+                abs_dist,
+                Eigen::RowVector3d::Unit(axis),
+                cloth_prob);
+        return grad;
+    }
+
     inline double translation_jac_elem_(const double vert_coord,
         const double input_coord, double abs_dist) const
     {
@@ -119,6 +212,7 @@ protected:
         return jac_entry;
     }
 
+    std::shared_ptr<const EvaluationContext> context_;
     GeneralMesh * toMesh_;
     SMPLWrapper * smpl_;
     double pruning_threshold_;
@@ -126,10 +220,34 @@ protected:
     // instance type
     ParameterType parameter_type_;
     std::size_t vertex_id_for_displacement_ = 0;  // for the DISPLACEMENT only 
-    bool displacement_jac_evaluated = false;      // for the DISPLACEMENT only
     DistanceType dist_evaluation_type_;
+    bool compress_residuals_ = false;
+
+    // own buffers for the compressed evaluation, so the costs sharing the model could be evaluated concurrently
+    mutable SMPLWrapper::Workspace workspace_;
+    mutable SMPLWrapper::NormalEquations normal_equations_;
+    // per-evaluation buffers of the normal equations, sized once (see allocateNormalEquationsBuffers()),
+    // so that the steady-state evaluations don't allocate
+    mutable Eigen::VectorXd vertex_residuals_;
+    mutable Eigen::MatrixXd residual_grads_;
+    // bounded size => the decomposition works in the solver's own storage
+    using NormalMatrix = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor,
+        SMPLWrapper::POSE_SIZE, SMPLWrapper::POSE_SIZE>;
+    mutable Eigen::SelfAdjointEigenSolver<NormalMatrix> eigen_solver_;
+    mutable Eigen::VectorXd projected_Jtr_;
+
+    static constexpr int VERTEX_CHUNK_SIZE = 512;
 
-    // last evaluated result
-    static DistanceResult last_result_;
+public:
+    // fixed-size eigen objects in the workspace
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
+template<typename ChunkFunction>
+inline void AbsoluteDistanceBase::parallelForVertices_(const ChunkFunction & func) const
+{
+    const std::shared_ptr<ThreadPool>& model_pool = smpl_->getThreadPool();
+    const std::shared_ptr<ThreadPool> pool = model_pool != nullptr ? model_pool : ThreadPool::getDefault();
+    pool->parallelFor(0, SMPLWrapper::VERTICES_NUM, VERTEX_CHUNK_SIZE,
+        [&func](int /*chunk*/, int v_begin, int v_end) { func(v_begin, v_end); });
+}
@@ -10,6 +10,7 @@
 #include "PoseShapeExtractor.h"
 #include <GeneralMesh/GeneralMesh.h>
 #include "SMPLWrapper.h"
+#include "SMPLModelBundle.h"
 #include "GeneralUtility.h"
 
 /*
@@ -90,6 +91,13 @@ void generateSMPLoutput()
     logger.saveFinalModel(new_smpl);
 }
 
+// Converts the SMPL resources folder into the binary bundle next to it (run with --pack-smpl-bundle).
+// Use the bundle filename as the model path afterwards for the fast start-up
+void packSMPLModelBundle()
+{
+    SMPLModelBundle::pack(smpl_model_path, std::string(smpl_model_path) + SMPLModelBundle::fileExtension());
+}
+
 std::vector<std::shared_ptr<GeneralMesh>> setInputs(std::string root_path) {
     std::vector<std::shared_ptr<GeneralMesh>> ret;
     std::vector<std::string> leaf_list = mg::getSubFolderDir(root_path);
@@ -110,10 +118,17 @@ std::vector<std::shared_ptr<GeneralMesh>> setInputs(std::string root_path) {
     return ret;
 }
 
-int main()
+int main(int argc, char** argv)
 {
     try
     {
+        if (argc > 1 && std::string(argv[1]) == "--pack-smpl-bundle")
+        {
+            packSMPLModelBundle();
+            std::cout << "SMPL bundle is saved to " << smpl_model_path << SMPLModelBundle::fileExtension() << std::endl;
+            return 0;
+        }
+
         // std::vector<std::shared_ptr<GeneralMesh>> inputs = setInputs("E:/HumanData/OBJ_Gender/");
 
         std::vector<std::shared_ptr<GeneralMesh>> inputs;
@@ -0,0 +1,268 @@
+#include "FusedDistanceCost.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace
+{
+    // residuals below it have zero jacobian, as in AbsoluteDistanceBase::jac_elem_()
+    constexpr double MIN_JAC_RESIDUAL = 1e-5;
+}
+
+FusedDistanceCost::FusedDistanceCost(std::shared_ptr<const EvaluationContext> context, GeneralMesh * toMesh,
+    ceres::LossFunction * in_loss, double pruning_threshold)
+    : AbsoluteDistanceBase(std::move(context), toMesh, BOTH_DIST, pruning_threshold),
+    in_loss_(in_loss)
+{
+    if (parameter_type_ != SHAPE && parameter_type_ != POSE)
+        throw std::invalid_argument("FusedDistanceCost initialization::ERROR:: only available for shape and pose");
+
+    // the compressed residuals are the same as of the base
+    if (compress_residuals_)
+        term_residuals_.resize(SMPLWrapper::VERTICES_NUM, TERMS_NUM);
+    else
+    {
+        this->set_num_residuals(SMPLWrapper::VERTICES_NUM * TERMS_NUM);
+        // the CLOTH_IN jacobian correction works in the base's buffers
+        if (in_loss_ != nullptr)
+        {
+            allocateNormalEquationsBuffers();
+            in_Jtr_.resize(parameter_block_sizes()[0]);
+        }
+    }
+}
+
+FusedDistanceCost::~FusedDistanceCost()
+{
+}
+
+bool FusedDistanceCost::Evaluate(double const * const * parameters, double * residuals, double ** jacobians) const
+{
+    assert(SMPLWrapper::SPACE_DIM == 3 && "Distance evaluation is only implemented in 3D");
+
+    const DistanceResult& distance_res = context_->getResult();
+    const bool with_jacobian = jacobians != NULL && jacobians[0] != NULL;
+
+    // without the compression the ceres residuals have the layout of the term residuals
+    TermResidualsMap term_residuals(compress_residuals_ ? term_residuals_.data() : residuals,
+        SMPLWrapper::VERTICES_NUM, TERMS_NUM);
+    calcTermResiduals_(distance_res, term_residuals);
+    const InLossScaling in_scaling = inLossScaling_(term_residuals.col(IN_TERM).squaredNorm());
+
+    if (!compress_residuals_)
+    {
+        if (with_jacobian)
+            fillTermsJac_(distance_res, term_residuals, in_scaling, jacobians[0]);
+        if (in_loss_ != nullptr)
+            term_residuals.col(IN_TERM) *= in_scaling.residual_scale;
+        return true;
+    }
+
+    const double residuals_squared_norm = term_residuals.col(OUT_TERM).squaredNorm()
+        + term_residuals.col(SKIN_TERM).squaredNorm()
+        + in_scaling.cost;
+    if (with_jacobian)
+    {
+        calcTermsNormalEquations_(term_residuals, distance_res, in_scaling, normal_equations_);
+        fillCompressed(normal_equations_, residuals_squared_norm, residuals, jacobians[0]);
+    }
+    else
+    {
+        std::fill(residuals, residuals + num_residuals(), 0.);
+        residuals[num_residuals() - 1] = sqrt(residuals_squared_norm);
+    }
+    return true;
+}
+
+void FusedDistanceCost::calcTermResiduals_(const DistanceResult & distance_res, TermResidualsMap & term_residuals) const
+{
+    const Eigen::MatrixXd& input_face_normals = toMesh_->getFaceNormals();
+    const bool cloth_segmented = toMesh_->isClothSegmented();
+    parallelForVertices_([&](int v_begin, int v_end)
+    {
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
+        {
+            const int face_id = distance_res.closest_face_ids(v_id);
+            const double signed_dist = distance_res.signedDists(v_id);
+            const double abs_dist = std::abs(signed_dist);
+            // too far or looks the wrong way: the same for all the terms
+            if (abs_dist > pruning_threshold_
+                || distance_res.verts_normals.row(v_id).dot(input_face_normals.row(face_id)) <= 0)
+            {
+                term_residuals.row(v_id).setZero();
+                continue;
+            }
+
+            const double cloth_prob = cloth_segmented ? toMesh_->getFacesClothProbabilities()[face_id] : 1.;
+            const double cloth_residual = sqrt(cloth_prob) * abs_dist;
+            term_residuals(v_id, OUT_TERM) = signed_dist < 0 ? 0. : cloth_residual;    // is inside, want outside
+            term_residuals(v_id, IN_TERM) = signed_dist > 0 ? 0. : cloth_residual;     // is outside, want inside
+            term_residuals(v_id, SKIN_TERM) = sqrt(1. - cloth_prob) * abs_dist;
+        }
+    });
+}
+
+FusedDistanceCost::InLossScaling FusedDistanceCost::inLossScaling_(double in_squared_norm) const
+{
+    InLossScaling scaling;
+    scaling.cost = in_squared_norm;
+    if (in_loss_ == nullptr)
+        return scaling;
+
+    double rho[3];
+    in_loss_->Evaluate(in_squared_norm, rho);
+    scaling.cost = rho[0];
+    scaling.derivative = rho[1];
+    if (in_squared_norm > 1e-12)
+    {
+        // c^2 = rho / s => 2 c' = (rho' s - rho) / (s^2 c)
+        scaling.residual_scale = sqrt(rho[0] / in_squared_norm);
+        scaling.rank_one_scale = (rho[1] * in_squared_norm - rho[0])
+            / (in_squared_norm * in_squared_norm * scaling.residual_scale);
+    }
+    else
+    {
+        // the limit at zero: the linear part of the loss
+        scaling.residual_scale = sqrt(rho[1]);
+    }
+    return scaling;
+}
+
+void FusedDistanceCost::fillTermsJac_(const DistanceResult & distance_res, const TermResidualsMap & term_residuals,
+    const InLossScaling & in_scaling, double * jacobian) const
+{
+    const int params_num = parameter_block_sizes()[0];
+    const int vertex_rows_size = TERMS_NUM * params_num;
+    parallelForVertices_([&](int v_begin, int v_end)
+    {
+        std::fill(jacobian + v_begin * vertex_rows_size, jacobian + v_end * vertex_rows_size, 0.);
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
+        {
+            double* vertex_rows = jacobian + v_id * vertex_rows_size;
+            // the row is written to the first term that needs it and copied to the others
+            const double* filled_row = nullptr;
+            for (int term = 0; term < TERMS_NUM; ++term)
+            {
+                if (term_residuals(v_id, term) < MIN_JAC_RESIDUAL)
+                    continue;
+
+                double* row = vertex_rows + term * params_num;
+                if (filled_row != nullptr)
+                {
+                    std::copy(filled_row, filled_row + params_num, row);
+                    continue;
+                }
+
+                const Eigen::RowVector3d direction = distanceDirection_(distance_res, v_id);
+                if (parameter_type_ == POSE)
+                {
+                    // only the parameters that affect the vertex have non-zero entries
+                    const SMPLWrapper::PoseJacobian& pose_jac = distance_res.pose_jacobian;
+                    for (int entry = pose_jac.offsets[v_id]; entry < pose_jac.offsets[v_id + 1]; ++entry)
+                        row[pose_jac.params[entry]] = direction.dot(pose_jac.values.row(entry));
+                }
+                else
+                {
+                    Eigen::Map<Eigen::RowVectorXd>(row, params_num).noalias() = direction
+                        * distance_res.jacobian.middleRows<SMPLWrapper::SPACE_DIM>(v_id * SMPLWrapper::SPACE_DIM);
+                }
+                filled_row = row;
+            }
+        }
+    });
+
+    if (in_loss_ == nullptr)
+        return;
+
+    // J' = c J + 2 c' r (J^T r)^T for the CLOTH_IN rows
+    Eigen::VectorXd& in_residuals = vertex_residuals_;
+    in_residuals = term_residuals.col(IN_TERM);
+    Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>, 0, Eigen::OuterStride<>>
+        in_jac(jacobian + IN_TERM * params_num, SMPLWrapper::VERTICES_NUM, params_num, Eigen::OuterStride<>(vertex_rows_size));
+    Eigen::VectorXd& in_Jtr = in_Jtr_;
+    in_Jtr.noalias() = in_jac.transpose() * in_residuals;
+
+    parallelForVertices_([&](int v_begin, int v_end)
+    {
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
+        {
+            Eigen::Map<Eigen::RowVectorXd> row(jacobian + v_id * vertex_rows_size + IN_TERM * params_num, params_num);
+            row = in_scaling.residual_scale * row + (in_scaling.rank_one_scale * in_residuals(v_id)) * in_Jtr.transpose();
+        }
+    });
+}
+
+void FusedDistanceCost::calcTermsNormalEquations_(const TermResidualsMap & term_residuals, const DistanceResult & distance_res,
+    const InLossScaling & in_scaling, SMPLWrapper::NormalEquations & out) const
+{
+    // the rows of the vertex's terms are the same model jacobian row u (or zero) =>
+    // sum_k (u^T u, u^T r_k) = (n u^T u, u^T sum_k r_k), which is a single residual with sqrt(n) u gradient.
+    // Without the loss, CLOTH_IN is one of the terms, with the loss it's streamed separately for its own J^T r
+    const bool in_separately = in_loss_ != nullptr;
+    Eigen::MatrixXd& residual_grads = residual_grads_;
+    Eigen::VectorXd& vertex_residuals = vertex_residuals_;
+    parallelForVertices_([&](int v_begin, int v_end)
+    {
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
+        {
+            int active_terms = 0;
+            double residuals_sum = 0.;
+            for (int term = 0; term < TERMS_NUM; ++term)
+            {
+                if ((in_separately && term == IN_TERM) || term_residuals(v_id, term) < MIN_JAC_RESIDUAL)
+                    continue;
+                ++active_terms;
+                residuals_sum += term_residuals(v_id, term);
+            }
+
+            if (active_terms == 0)
+            {
+                residual_grads.row(v_id).setZero();
+                vertex_residuals(v_id) = 0.;
+                continue;
+            }
+            const double weight = sqrt((double)active_terms);
+            residual_grads.row(v_id) = weight * distanceDirection_(distance_res, v_id);
+            vertex_residuals(v_id) = residuals_sum / weight;
+        }
+    });
+    calcModelNormalEquations(residual_grads, vertex_residuals, out);
+
+    if (!in_separately)
+        return;
+
+    parallelForVertices_([&](int v_begin, int v_end)
+    {
+        for (int v_id = v_begin; v_id < v_end; ++v_id)
+        {
+            const double in_residual = term_residuals(v_id, IN_TERM);
+            if (in_residual < MIN_JAC_RESIDUAL)
+                residual_grads.row(v_id).setZero();
+            else
+                residual_grads.row(v_id) = distanceDirection_(distance_res, v_id);
+            vertex_residuals(v_id) = in_residual;
+        }
+    });
+    calcModelNormalEquations(residual_grads, vertex_residuals, in_normal_equations_);
+
+    // J'^T J' = c^2 J^T J + (2 c c2 + c2^2 s) (J^T r)(J^T r)^T and J'^T r' = rho' J^T r, where c2 = 2 c'
+    const double c = in_scaling.residual_scale;
+    const double c2 = in_scaling.rank_one_scale;
+    const double in_squared_norm = term_residuals.col(IN_TERM).squaredNorm();
+    const Eigen::VectorXd& in_Jtr = in_normal_equations_.Jtr;
+    const double rank_one_weight = 2. * c * c2 + c2 * c2 * in_squared_norm;
+    out.JtJ += (c * c) * in_normal_equations_.JtJ;
+    // column by column: no temporary for the outer product
+    for (int col = 0; col < in_Jtr.size(); ++col)
+        out.JtJ.col(col) += (rank_one_weight * in_Jtr(col)) * in_Jtr;
+    out.Jtr += in_scaling.derivative * in_Jtr;
+}
+
+Eigen::RowVector3d FusedDistanceCost::distanceDirection_(const DistanceResult & distance_res, int v_id)
+{
+    const double abs_dist = std::abs(distance_res.signedDists(v_id));
+    if (abs_dist < MIN_JAC_RESIDUAL)
+        return Eigen::RowVector3d::Zero();
+    return (distance_res.verts.row(v_id) - distance_res.closest_points.row(v_id)) / abs_dist;
+}
@@ -0,0 +1,71 @@
+#pragma once
+/*
+The cloth-aware distance terms CLOTH_OUT, CLOTH_IN and SKIN_BOTH of SHAPE or POSE (see AbsoluteDistanceBase) as a single cost.
+The per-vertex values shared by the terms (the cloth probability of the closest face, the pruning and normal agreement tests,
+the distance and its direction) are evaluated once in a single sweep over the vertices,
+and the residuals of all the terms are written together, vertex-major: residual (vertex * TERMS_NUM + term).
+The residual jacobian rows of the vertex are the same for all the terms with non-zero residual, so the row is computed once.
+
+Ceres applies a loss function to the whole residual block, so the loss of the CLOTH_IN term is applied by the cost itself:
+the term's residuals r are scaled by c = sqrt(rho(s) / s), s = |r|^2, and their jacobian is the exact derivative
+c J + 2 c'(s) r r^T J. The cost and its gradient are the same as of the separate costs with the loss,
+while the Gauss-Newton approximation of the Hessian differs from the Ceres' loss correction.
+
+With the compressed residuals (see AbsoluteDistanceBase), the normal equations of all the terms are streamed through
+the model jacobian once, or twice with the CLOTH_IN loss (for the J^T r of the CLOTH_IN term alone).
+*/
+
+#include <memory>
+
+#include "AbsoluteDistanceBase.h"
+
+class FusedDistanceCost : public AbsoluteDistanceBase
+{
+public:
+    enum Term {
+        OUT_TERM,   // CLOTH_OUT
+        IN_TERM,    // CLOTH_IN
+        SKIN_TERM,  // SKIN_BOTH
+        TERMS_NUM
+    };
+
+    // the context is expected to be for SHAPE or POSE. The cost takes the ownership of in_loss, nullptr is for no loss
+    FusedDistanceCost(std::shared_ptr<const EvaluationContext> context, GeneralMesh *,
+        ceres::LossFunction* in_loss = nullptr,
+        double pruning_threshold = 100.);
+    ~FusedDistanceCost();
+
+    virtual bool Evaluate(double const* const* parameters,
+        double* residuals,
+        double** jacobians) const;
+
+private:
+    using TermResiduals = Eigen::Matrix<double, Eigen::Dynamic, TERMS_NUM, Eigen::RowMajor>;
+    using TermResidualsMap = Eigen::Map<TermResiduals>;
+
+    // CLOTH_IN loss at the squared norm of the term's residuals
+    struct InLossScaling {
+        double cost = 0.;               // rho(s)
+        double derivative = 1.;         // rho'(s)
+        double residual_scale = 1.;     // c
+        double rank_one_scale = 0.;     // 2 c'(s)
+    };
+
+    // the residuals of the terms as in residual_elem_()
+    void calcTermResiduals_(const DistanceResult& distance_res, TermResidualsMap& term_residuals) const;
+    InLossScaling inLossScaling_(double in_squared_norm) const;
+    // (VERTICES_NUM * TERMS_NUM) x params jacobian of the scaled residuals. term_residuals are the unscaled ones
+    void fillTermsJac_(const DistanceResult& distance_res, const TermResidualsMap& term_residuals,
+        const InLossScaling& in_scaling, double* jacobian) const;
+    void calcTermsNormalEquations_(const TermResidualsMap& term_residuals, const DistanceResult& distance_res,
+        const InLossScaling& in_scaling, SMPLWrapper::NormalEquations& out) const;
+    // unit direction of the distance growth at the vertex, zero if the vertex is on the surface
+    static Eigen::RowVector3d distanceDirection_(const DistanceResult& distance_res, int v_id);
+
+    std::unique_ptr<ceres::LossFunction> in_loss_;
+
+    // per-evaluation buffers, sized once
+    mutable TermResiduals term_residuals_;              // compressed mode only
+    mutable SMPLWrapper::NormalEquations in_normal_equations_;
+    mutable Eigen::VectorXd in_Jtr_;
+};
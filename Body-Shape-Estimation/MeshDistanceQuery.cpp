@@ -0,0 +1,188 @@
+#include "MeshDistanceQuery.h"
+#include "SignedDistanceField.h"
+#include "ThreadPool.h"
+
+MeshDistanceQuery::MeshDistanceQuery(const GeneralMesh & mesh)
+    : verts_(mesh.getNormalizedVertices()), faces_(mesh.getFaces())
+{
+    tree_.init(verts_, faces_);
+
+    // "Signed Distance Computation Using the Angle Weighted Pseudonormal" [Baerentzen & Aanaes 2005]
+    // same setup as in igl::signed_distance(..)
+    igl::per_face_normals(verts_, faces_, face_normals_);
+    igl::per_vertex_normals(verts_, faces_,
+        igl::PER_VERTEX_NORMALS_WEIGHTING_TYPE_ANGLE, face_normals_, vertex_normals_);
+    igl::per_edge_normals(verts_, faces_,
+        igl::PER_EDGE_NORMALS_WEIGHTING_TYPE_UNIFORM, face_normals_, edge_normals_, edges_, edges_map_);
+
+    // adjacency for the warm-started queries
+    vertex_faces_offsets_ = Eigen::VectorXi::Zero(verts_.rows() + 1);
+    for (int f = 0; f < faces_.rows(); ++f)
+        for (int corner = 0; corner < 3; ++corner)
+            ++vertex_faces_offsets_(faces_(f, corner) + 1);
+    for (int v = 0; v < verts_.rows(); ++v)
+        vertex_faces_offsets_(v + 1) += vertex_faces_offsets_(v);
+    vertex_faces_.resize(faces_.size());
+    Eigen::VectorXi filled = vertex_faces_offsets_.head(verts_.rows());
+    for (int f = 0; f < faces_.rows(); ++f)
+        for (int corner = 0; corner < 3; ++corner)
+            vertex_faces_(filled(faces_(f, corner))++) = f;
+}
+
+MeshDistanceQuery::~MeshDistanceQuery()
+{
+}
+
+void MeshDistanceQuery::buildDistanceField(double voxel_size, double band_width)
+{
+    // the exact queries are used to sample the field
+    distance_field_ = nullptr;
+    distance_field_ = std::make_unique<SignedDistanceField>(*this, voxel_size, band_width);
+}
+
+void MeshDistanceQuery::signedDistance(const Eigen::MatrixXd & points,
+    Eigen::VectorXd & out_signed_dists,
+    Eigen::VectorXi & out_closest_face_ids,
+    Eigen::MatrixXd & out_closest_points,
+    Eigen::MatrixXd & out_normals_for_sign,
+    bool single_precision,
+    bool warm_start) const
+{
+    warm_start = warm_start && out_closest_face_ids.size() == points.rows();
+
+    out_signed_dists.resize(points.rows());
+    out_closest_face_ids.resize(points.rows());
+    out_closest_points.resize(points.rows(), 3);
+    out_normals_for_sign.resize(points.rows(), 3);
+
+    if (single_precision)
+    {
+        const SinglePrecisionData& data = getSinglePrecisionData_();
+        signedDistance_(points, data.verts, data.tree, data.face_normals, data.vertex_normals, data.edge_normals,
+            out_signed_dists, out_closest_face_ids, out_closest_points, out_normals_for_sign, warm_start);
+    }
+    else
+    {
+        signedDistance_(points, verts_, tree_, face_normals_, vertex_normals_, edge_normals_,
+            out_signed_dists, out_closest_face_ids, out_closest_points, out_normals_for_sign, warm_start);
+    }
+}
+
+template<typename Matrix>
+void MeshDistanceQuery::signedDistance_(const Eigen::MatrixXd & points,
+    const Matrix & verts, const igl::AABB<Matrix, 3>& tree,
+    const Matrix & face_normals, const Matrix & vertex_normals, const Matrix & edge_normals,
+    Eigen::VectorXd & out_signed_dists,
+    Eigen::VectorXi & out_closest_face_ids,
+    Eigen::MatrixXd & out_closest_points,
+    Eigen::MatrixXd & out_normals_for_sign,
+    bool warm_start) const
+{
+    using Scalar = typename Matrix::Scalar;
+    using Point = Eigen::Matrix<Scalar, 1, 3>;
+
+    const SignedDistanceField* field = isUsingDistanceField() ? distance_field_.get() : nullptr;
+
+    // point by point, as in the bulk igl query, with the results written to the double outputs directly
+    threadPool_()->parallelFor(0, (int)points.rows(), POINTS_CHUNK_SIZE,
+        [&](int /*chunk*/, int chunk_begin, int chunk_end)
+    {
+        for (int p = chunk_begin; p < chunk_end; ++p)
+        {
+            if (field != nullptr)
+            {
+                double signed_dist;
+                Eigen::RowVector3d closest_point, gradient;
+                if (field->query(points.row(p), signed_dist, out_closest_face_ids(p), closest_point, gradient))
+                {
+                    out_signed_dists(p) = signed_dist;
+                    out_closest_points.row(p) = closest_point;
+                    out_normals_for_sign.row(p) = gradient;
+                    continue;
+                }
+            }
+
+            const Point point = points.row(p).cast<Scalar>();
+            Scalar sign, squared_dist;
+            Point closest_point, normal;
+            int& face_id = out_closest_face_ids(p);
+            if (warm_start && face_id >= 0 && face_id < faces_.rows())
+            {
+                walkToClosestFace_(verts, point, face_id, squared_dist, closest_point);
+                // keeps the walk result unless a strictly closer face is found
+                squared_dist = tree.squared_distance(verts, faces_, point, (Scalar)0., squared_dist, face_id, closest_point);
+                igl::pseudonormal_test(verts, faces_, face_normals, vertex_normals, edge_normals, edges_map_,
+                    point, face_id, closest_point, sign, normal);
+            }
+            else
+            {
+                igl::signed_distance_pseudonormal(tree, verts, faces_,
+                    face_normals, vertex_normals, edge_normals, edges_map_,
+                    point, sign, squared_dist, face_id, closest_point, normal);
+            }
+
+            out_signed_dists(p) = sign * std::sqrt(squared_dist);
+            out_closest_points.row(p) = closest_point.template cast<double>();
+            out_normals_for_sign.row(p) = normal.template cast<double>();
+        }
+    });
+}
+
+template<typename Matrix, typename Point>
+void MeshDistanceQuery::walkToClosestFace_(const Matrix & verts, const Point & point,
+    int & face_id, typename Matrix::Scalar & sqr_dist, Point & closest_point) const
+{
+    using Scalar = typename Matrix::Scalar;
+
+    igl::point_simplex_squared_distance<3>(point, verts, faces_, face_id, sqr_dist, closest_point);
+    for (int step = 0; step < MAX_WALK_STEPS; ++step)
+    {
+        const int current_face_id = face_id;
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            const int v_id = faces_(current_face_id, corner);
+            for (int i = vertex_faces_offsets_(v_id); i < vertex_faces_offsets_(v_id + 1); ++i)
+            {
+                const int neighbour_id = vertex_faces_(i);
+                if (neighbour_id == current_face_id)
+                    continue;
+
+                Scalar neighbour_sqr_dist;
+                Point neighbour_closest_point;
+                igl::point_simplex_squared_distance<3>(point, verts, faces_, neighbour_id,
+                    neighbour_sqr_dist, neighbour_closest_point);
+                if (neighbour_sqr_dist < sqr_dist)
+                {
+                    sqr_dist = neighbour_sqr_dist;
+                    closest_point = neighbour_closest_point;
+                    face_id = neighbour_id;
+                }
+            }
+        }
+        // local minimum
+        if (face_id == current_face_id)
+            break;
+    }
+}
+
+std::shared_ptr<ThreadPool> MeshDistanceQuery::threadPool_() const
+{
+    return thread_pool_ != nullptr ? thread_pool_ : ThreadPool::getDefault();
+}
+
+const MeshDistanceQuery::SinglePrecisionData & MeshDistanceQuery::getSinglePrecisionData_() const
+{
+    std::call_once(single_precision_once_, [this]()
+    {
+        auto data = std::make_unique<SinglePrecisionData>();
+        data->verts = verts_.cast<float>();
+        data->tree.init(data->verts, faces_);
+        // the normals are converted rather than re-computed to keep the same pseudonormals as in double
+        data->face_normals = face_normals_.cast<float>();
+        data->vertex_normals = vertex_normals_.cast<float>();
+        data->edge_normals = edge_normals_.cast<float>();
+        single_precision_data_ = std::move(data);
+    });
+
+    return *single_precision_data_;
+}
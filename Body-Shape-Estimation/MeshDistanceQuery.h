@@ -0,0 +1,128 @@
+#pragma once
+/*
+The class keeps the acceleration structures needed for signed distance queries against a fixed mesh:
+the AABB tree and the face/edge/vertex pseudonormals.
+They only depend on the mesh itself, so they are built once per input and shared
+by every cost function that measures the distance to this input.
+
+The results are the same as the ones of igl::signed_distance(..) with SIGNED_DISTANCE_TYPE_PSEUDONORMAL.
+The queries can also be done in single precision: the float copies of the structures are built on the first such query.
+The points are independent, so they are split over the thread pool (see setThreadPool());
+each point's result doesn't depend on the number of threads.
+
+With warm_start, the closest faces of the previous query of the same points seed the search:
+a short greedy walk over the faces adjacent through the vertices gives an upper bound of the distance,
+and the tree descent bounded by it only visits the few boxes that might still be closer,
+which certifies the result. The results equal the cold query ones up to the ties between equally close faces.
+
+Optionally, the queries are approximated by the narrow-band signed distance field of the mesh (see SignedDistanceField),
+built with buildDistanceField() and switched with setUseDistanceField(). The points out of the band get the exact query.
+*/
+
+#include <memory>
+#include <mutex>
+
+#include <Eigen/Dense>
+#include <igl/AABB.h>
+#include <igl/signed_distance.h>
+#include <igl/per_face_normals.h>
+#include <igl/per_vertex_normals.h>
+#include <igl/per_edge_normals.h>
+#include <igl/point_simplex_squared_distance.h>
+#include <igl/pseudonormal_test.h>
+
+#include <GeneralMesh/GeneralMesh.h>
+
+class SignedDistanceField;
+class ThreadPool;
+
+class MeshDistanceQuery
+{
+public:
+    // the normalized vertices of the mesh are used
+    MeshDistanceQuery(const GeneralMesh& mesh);
+    ~MeshDistanceQuery();
+
+    const Eigen::MatrixXd& getVertices() const { return verts_; }
+    const Eigen::MatrixXi& getFaces() const { return faces_; }
+    // nullptr is for ThreadPool::getDefault() (the default)
+    void setThreadPool(std::shared_ptr<ThreadPool> thread_pool) { thread_pool_ = std::move(thread_pool); }
+    const std::shared_ptr<ThreadPool>& getThreadPool() const { return thread_pool_; }
+
+    // (re-)builds the field with the exact queries; it is not used until setUseDistanceField(true)
+    void buildDistanceField(double voxel_size, double band_width);
+    // nullptr if not built
+    const SignedDistanceField* getDistanceField() const { return distance_field_.get(); }
+    // has no effect without the field
+    void setUseDistanceField(bool use) { use_distance_field_ = use; }
+    bool isUsingDistanceField() const { return use_distance_field_ && distance_field_ != nullptr; }
+
+    // out_* are resized to points.rows(): no allocation if they already have this size
+    // single_precision: the points are rounded to float and the query is done with the float structures
+    // (for the exact queries only: the field lookups are the same in both modes)
+    // warm_start: out_closest_face_ids holds the result of the previous query (of the points close to the current ones)
+    // and is used as the search seeds. Ignored if its size is not points.rows(); any face ids are safe to pass
+    void signedDistance(const Eigen::MatrixXd& points,
+        Eigen::VectorXd& out_signed_dists,
+        Eigen::VectorXi& out_closest_face_ids,
+        Eigen::MatrixXd& out_closest_points,
+        Eigen::MatrixXd& out_normals_for_sign,
+        bool single_precision = false,
+        bool warm_start = false) const;
+
+private:
+    struct SinglePrecisionData {
+        Eigen::MatrixXf verts;
+        igl::AABB<Eigen::MatrixXf, 3> tree;
+        Eigen::MatrixXf face_normals;
+        Eigen::MatrixXf vertex_normals;
+        Eigen::MatrixXf edge_normals;
+    };
+
+    // points per chunk of the thread pool: each query is a tree traversal => small chunks balance well
+    static constexpr int POINTS_CHUNK_SIZE = 64;
+    // the warm start only needs to follow small moves, the bounded tree descent covers the rest
+    static constexpr int MAX_WALK_STEPS = 4;
+
+    // built on the first request (thread-safe)
+    const SinglePrecisionData& getSinglePrecisionData_() const;
+    // the per-point igl queries with the structures of the given precision (or the field lookups); the outputs are allocated
+    template<typename Matrix>
+    void signedDistance_(const Eigen::MatrixXd& points,
+        const Matrix& verts, const igl::AABB<Matrix, 3>& tree,
+        const Matrix& face_normals, const Matrix& vertex_normals, const Matrix& edge_normals,
+        Eigen::VectorXd& out_signed_dists,
+        Eigen::VectorXi& out_closest_face_ids,
+        Eigen::MatrixXd& out_closest_points,
+        Eigen::MatrixXd& out_normals_for_sign,
+        bool warm_start) const;
+    // greedy descent from face_id to the adjacent faces closer to the point: face_id, sqr_dist, closest_point get the last one
+    template<typename Matrix, typename Point>
+    void walkToClosestFace_(const Matrix& verts, const Point& point,
+        int& face_id, typename Matrix::Scalar& sqr_dist, Point& closest_point) const;
+    std::shared_ptr<ThreadPool> threadPool_() const;
+
+    // copies, to be independent from the later modifications of the input
+    Eigen::MatrixXd verts_;
+    Eigen::MatrixXi faces_;
+
+    igl::AABB<Eigen::MatrixXd, 3> tree_;
+    // pseudonormals
+    Eigen::MatrixXd face_normals_;
+    Eigen::MatrixXd vertex_normals_;
+    Eigen::MatrixXd edge_normals_;
+    Eigen::MatrixXi edges_;
+    Eigen::VectorXi edges_map_;
+    // faces around each vertex, CSR-style: the faces of vertex v are vertex_faces_[vertex_faces_offsets_[v]..[v + 1]]
+    Eigen::VectorXi vertex_faces_offsets_;
+    Eigen::VectorXi vertex_faces_;
+
+    mutable std::once_flag single_precision_once_;
+    mutable std::unique_ptr<SinglePrecisionData> single_precision_data_;
+
+    std::unique_ptr<SignedDistanceField> distance_field_;
+    bool use_distance_field_ = false;
+
+    std::shared_ptr<ThreadPool> thread_pool_ = nullptr;
+};
+
@@ -60,6 +60,7 @@ void PoseShapeExtractor::setupNewExperiment(std::shared_ptr<GeneralMesh> input,
     openpose_ = nullptr;
     char input_gender = convertInputGenderToChar_(*input_.get());
 
+    // model data is cached by SMPLModel => only the new state is created for each experiment
     smpl_ = std::make_shared<SMPLWrapper>(input_gender, smpl_model_path_);
 }
 
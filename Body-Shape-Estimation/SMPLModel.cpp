@@ -0,0 +1,508 @@
+#include "SMPLModel.h"
+#include "SMPLModelBundle.h"
+
+#include <sstream>
+
+std::mutex SMPLModel::cache_mutex_;
+std::map<std::string, std::shared_ptr<const SMPLModel>> SMPLModel::models_cache_;
+std::map<std::string, std::shared_ptr<const SMPLModel::SharedData>> SMPLModel::shared_data_cache_;
+
+std::shared_ptr<const SMPLModel> SMPLModel::get(char gender, const std::string& path, bool pose_blendshapes)
+{
+    if (gender != 'f' && gender != 'm')
+    {
+        std::string message("Wrong gender supplied: ");
+        message += gender;
+        throw std::invalid_argument(message.c_str());
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+
+    std::string model_key = path + "/" + gender;
+    auto cached_model = models_cache_.find(model_key);
+    if (cached_model != models_cache_.end()
+        && (!pose_blendshapes || cached_model->second->hasPoseBlendshapes()))
+    {
+        return cached_model->second;
+    }
+
+    auto cached_shared_data = shared_data_cache_.find(path);
+    std::shared_ptr<const SharedData> shared_data =
+        cached_shared_data != shared_data_cache_.end() ? cached_shared_data->second : nullptr;
+
+    // constructor is private => no make_shared
+    std::shared_ptr<const SMPLModel> model(new SMPLModel(gender, path, pose_blendshapes, shared_data));
+
+    models_cache_[model_key] = model;
+    if (shared_data == nullptr)
+        shared_data_cache_[path] = model->shared_;
+
+    return model;
+}
+
+void SMPLModel::clearCache()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    models_cache_.clear();
+    shared_data_cache_.clear();
+}
+
+SMPLModel::SMPLModel(char gender, const std::string& path, bool pose_blendshapes,
+    std::shared_ptr<const SharedData> shared_data)
+    : gender_(gender), shape_basis_(nullptr, 0, 0), pose_basis_(nullptr, 0, 0), jointRegressorMat_(nullptr, 0, 0)
+{
+    if (SMPLModelBundle::isBundleFile(path))
+    {
+        loadFromBundle_(path, pose_blendshapes, std::move(shared_data));
+    }
+    else
+    {
+        // !!!! expects a pre-defined file structure
+        general_path_ = path + "/";
+        gender_path_ = general_path_ + gender + "_smpl/";
+        loadFromResources_(pose_blendshapes, std::move(shared_data));
+    }
+
+    // pre-regress the joints once for the template and every shape blendshape
+    joint_regressor_sparse_ = jointRegressorMat_.sparseView();
+    joint_locations_template_ = joint_regressor_sparse_ * verts_template_normalized_;
+    joint_shape_basis_.resize(JOINTS_NUM, SPACE_DIM * SHAPE_SIZE);
+    for (int i = 0; i < SHAPE_SIZE; i++)
+        joint_shape_basis_.middleCols(i * SPACE_DIM, SPACE_DIM) = joint_regressor_sparse_ * shape_diffs_[i];
+
+    if (hasPoseBlendshapes())
+        fillPoseBlendshapesMasks_();
+}
+
+SMPLModel::~SMPLModel()
+{
+}
+
+void SMPLModel::fillPoseBlendshapesMasks_()
+{
+    pose_blendshapes_masks_.assign(VERTICES_NUM, 0u);
+
+    // no pose blendshapes for root: blendshape_id = (joint - 1) * 9 + row * 3 + col
+    for (int blendshape_id = 0; blendshape_id < POSE_BLENDSHAPES_NUM; blendshape_id++)
+    {
+        const std::uint32_t joint_bit = 1u << (blendshape_id / (SPACE_DIM * SPACE_DIM) + 1);
+        const double* blendshape = pose_basis_.col(blendshape_id).data();
+        for (int i = 0; i < VERTICES_NUM * SPACE_DIM; i++)
+            if (blendshape[i] != 0.)
+                pose_blendshapes_masks_[i % VERTICES_NUM] |= joint_bit;
+    }
+}
+
+const SMPLModel::SinglePrecisionData & SMPLModel::getSinglePrecisionData() const
+{
+    std::call_once(single_precision_once_, [this]()
+    {
+        auto data = std::make_unique<SinglePrecisionData>();
+        data->pose_basis = pose_basis_.cast<float>();
+        data->skinning_weights = skinning_.weights.cast<float>();
+        single_precision_data_ = std::move(data);
+    });
+
+    return *single_precision_data_;
+}
+
+E::MatrixXd SMPLModel::calcShapedJointLocations(const E::VectorXd& shape) const
+{
+    E::MatrixXd joint_locations;
+    calcShapedJointLocations(shape, joint_locations);
+
+    return joint_locations;
+}
+
+void SMPLModel::calcShapedJointLocations(const E::VectorXd& shape, E::MatrixXd& joint_locations) const
+{
+    joint_locations = joint_locations_template_;
+    for (int i = 0; i < SHAPE_SIZE; i++)
+        joint_locations += shape[i] * joint_shape_basis_.middleCols(i * SPACE_DIM, SPACE_DIM);
+}
+
+/// PRIVATE
+
+// throws if the bundle section has unexpected size
+template<typename Matrix>
+static void checkBundleSectionSize(const Matrix& matrix, E::Index rows, E::Index cols, const std::string& name)
+{
+    if (matrix.rows() != rows || matrix.cols() != cols)
+    {
+        std::string message("SMPL bundle section is incompatible with the model: ");
+        message += name;
+        throw std::invalid_argument(message.c_str());
+    }
+}
+
+void SMPLModel::loadFromResources_(bool pose_blendshapes, std::shared_ptr<const SharedData> shared_data)
+{
+    E::MatrixXd verts_template;
+    E::MatrixXi faces;
+    readTemplate_(verts_template, faces);
+    if (shared_data != nullptr
+        && shared_data->faces.rows() == faces.rows() && shared_data->faces.cols() == faces.cols()
+        && shared_data->faces == faces)
+    {
+        shared_ = std::move(shared_data);
+    }
+    else
+    {
+        // first model for the path
+        if (shared_data != nullptr)
+            throw std::invalid_argument("SMPL templates of different genders have different faces");
+
+        auto new_shared_data = std::make_shared<SharedData>();
+        new_shared_data->faces = std::move(faces);
+        readSharedData_(*new_shared_data);
+        shared_ = std::move(new_shared_data);
+    }
+
+    readJointMat_();
+    readShapes_(verts_template);
+    if (pose_blendshapes)
+        readPoseBlendshapes_(verts_template);
+    readWeights_();
+}
+
+void SMPLModel::loadFromBundle_(const std::string& path, bool pose_blendshapes, std::shared_ptr<const SharedData> shared_data)
+{
+    // the other gender might have already opened the bundle
+    std::shared_ptr<const SMPLModelBundle> bundle = 
+        shared_data != nullptr && shared_data->bundle != nullptr ? shared_data->bundle : SMPLModelBundle::open(path);
+    const std::string prefix = std::string(1, gender_) + "/";
+
+    verts_template_normalized_ = bundle->getDoubleMatrix(prefix + "template");
+    checkBundleSectionSize(verts_template_normalized_, VERTICES_NUM, SPACE_DIM, prefix + "template");
+
+    if (shared_data != nullptr)
+    {
+        shared_ = std::move(shared_data);
+    }
+    else
+    {
+        auto new_shared_data = std::make_shared<SharedData>();
+        new_shared_data->bundle = bundle;
+
+        new_shared_data->faces = bundle->getIntMatrix("faces");
+        checkBundleSectionSize(new_shared_data->faces, new_shared_data->faces.rows(), SPACE_DIM, "faces");
+        if ((new_shared_data->faces.array() < 0).any() || (new_shared_data->faces.array() >= VERTICES_NUM).any())
+            throw std::invalid_argument("SMPL bundle section is incompatible with the model: faces");
+
+        new_shared_data->pose_stiffness = bundle->getDoubleMatrix("pose_stiffness");
+        checkBundleSectionSize(new_shared_data->pose_stiffness, POSE_SIZE, POSE_SIZE, "pose_stiffness");
+
+        E::Map<const E::MatrixXi> joints_parents = bundle->getIntMatrix("joints_parents");
+        checkBundleSectionSize(joints_parents, JOINTS_NUM, 1, "joints_parents");
+        for (int joint_id = 0; joint_id < JOINTS_NUM; ++joint_id)
+            new_shared_data->joints_parents[joint_id] = joints_parents(joint_id);
+        fillJointsAncestors_(*new_shared_data);
+
+        std::istringstream joint_names(bundle->getText("joint_names"));
+        std::string joint_name;
+        int joint_id;
+        while (joint_names >> joint_name >> joint_id)
+            new_shared_data->joint_names.insert(DictEntryInt(joint_name, joint_id));
+        if (new_shared_data->joint_names.size() != JOINTS_NUM)
+            throw std::invalid_argument("SMPL bundle section is incompatible with the model: joint_names");
+
+        fillVertsNeighbours_(*new_shared_data);
+        shared_ = std::move(new_shared_data);
+    }
+
+    // large arrays are used from the mapped file directly
+    ConstMatrixMap joint_regressor = bundle->getDoubleMatrix(prefix + "joint_regressor");
+    checkBundleSectionSize(joint_regressor, JOINTS_NUM, VERTICES_NUM, prefix + "joint_regressor");
+    setMap_(jointRegressorMat_, joint_regressor.data(), JOINTS_NUM, VERTICES_NUM);
+
+    ConstMatrixMap shape_basis = bundle->getDoubleMatrix(prefix + "shape_basis");
+    checkBundleSectionSize(shape_basis, VERTICES_NUM, SPACE_DIM * SHAPE_SIZE, prefix + "shape_basis");
+    setShapeDiffs_(shape_basis.data());
+
+    if (pose_blendshapes)
+    {
+        // otherwise the model would be silently different from the one of the resources folder
+        if (!bundle->hasSection(prefix + "pose_basis"))
+            throw std::invalid_argument("SMPL bundle is packed without pose blendshapes, request the model without them");
+        ConstMatrixMap pose_basis = bundle->getDoubleMatrix(prefix + "pose_basis");
+        checkBundleSectionSize(pose_basis, VERTICES_NUM * SPACE_DIM, POSE_BLENDSHAPES_NUM, prefix + "pose_basis");
+        setMap_(pose_basis_, pose_basis.data(), pose_basis.rows(), pose_basis.cols());
+    }
+
+    skinning_.joint_ids = bundle->getIntMatrix(prefix + "skinning_joint_ids");
+    checkBundleSectionSize(skinning_.joint_ids, VERTICES_NUM, WEIGHTS_BY_VERTEX, prefix + "skinning_joint_ids");
+    if ((skinning_.joint_ids.array() < 0).any() || (skinning_.joint_ids.array() >= JOINTS_NUM).any())
+        throw std::invalid_argument("SMPL bundle section is incompatible with the model: skinning_joint_ids");
+    skinning_.weights = bundle->getDoubleMatrix(prefix + "skinning_weights");
+    checkBundleSectionSize(skinning_.weights, VERTICES_NUM, WEIGHTS_BY_VERTEX, prefix + "skinning_weights");
+}
+
+void SMPLModel::setMap_(ConstMatrixMap& map, const double* data, E::Index rows, E::Index cols)
+{
+    // re-assignment of the Map as recommended by Eigen docs
+    new (&map) ConstMatrixMap(data, rows, cols);
+}
+
+void SMPLModel::setShapeDiffs_(const double* shape_basis)
+{
+    shape_diffs_.clear();
+    for (int i = 0; i < SHAPE_SIZE; i++)
+        shape_diffs_.emplace_back(shape_basis + i * VERTICES_NUM * SPACE_DIM, VERTICES_NUM, SPACE_DIM);
+    setMap_(shape_basis_, shape_basis, VERTICES_NUM * SPACE_DIM, SHAPE_SIZE);
+}
+
+void SMPLModel::readTemplate_(E::MatrixXd& verts_template, E::MatrixXi& faces)
+{
+    std::string file_name = gender_path_ + gender_ + "_shapeAv.obj";
+
+    bool success = igl::readOBJ(file_name, verts_template, faces);
+    if (!success)
+    {
+        std::string message("Abort: Could not read SMPL template at ");
+        message += file_name;
+        throw std::invalid_argument(message.c_str());
+    }
+
+    E::VectorXd mean_point = verts_template.colwise().mean();
+    verts_template_normalized_ = verts_template.rowwise() - mean_point.transpose();
+}
+
+void SMPLModel::readJointMat_()
+{
+    std::string file_name(this->gender_path_);
+    file_name += this->gender_;
+    file_name += "_joints_mat.txt";
+
+    // copy from Meekyong code example
+    std::fstream inFile;
+    inFile.open(file_name, std::ios_base::in);
+    int joints_n, verts_n;
+    inFile >> joints_n;
+    inFile >> verts_n;
+    // Sanity check
+    if (joints_n != SMPLModel::JOINTS_NUM || verts_n != SMPLModel::VERTICES_NUM)
+        throw std::invalid_argument("Joint matrix info (number of joints and vertices) is incompatible with the model");
+
+    joint_regressor_storage_.resize(joints_n, verts_n);
+    for (int i = 0; i < joints_n; i++)
+        for (int j = 0; j < verts_n; j++)
+            inFile >> joint_regressor_storage_(i, j);
+
+    inFile.close();
+
+    setMap_(jointRegressorMat_, joint_regressor_storage_.data(), joints_n, verts_n);
+}
+
+void SMPLModel::readShapes_(const E::MatrixXd& verts_template)
+{
+    std::string file_path = gender_path_ + gender_ + "_blendshape/shape";
+
+    Eigen::MatrixXi fakeFaces(SMPLModel::VERTICES_NUM, SMPLModel::SPACE_DIM);
+    E::MatrixXd blendshape;
+
+    shape_basis_storage_.resize(SMPLModel::VERTICES_NUM, SMPLModel::SPACE_DIM * SMPLModel::SHAPE_SIZE);
+    for (int i = 0; i < SMPLModel::SHAPE_SIZE; i++)
+    {
+        std::string file_name(file_path);
+        file_name += std::to_string(i);
+        file_name += ".obj";
+
+        igl::readOBJ(file_name, blendshape, fakeFaces);
+
+        shape_basis_storage_.middleCols(i * SMPLModel::SPACE_DIM, SMPLModel::SPACE_DIM) = blendshape - verts_template;
+    }
+
+    setShapeDiffs_(shape_basis_storage_.data());
+}
+
+void SMPLModel::readPoseBlendshapes_(const E::MatrixXd& verts_template)
+{
+    std::string file_path = gender_path_ + gender_ + "_pose_blendshapes/Pose";
+
+    Eigen::MatrixXi fakeFaces(SMPLModel::VERTICES_NUM, SMPLModel::SPACE_DIM);
+    E::MatrixXd blendshape;
+
+    pose_basis_storage_.resize(SMPLModel::VERTICES_NUM * SMPLModel::SPACE_DIM, SMPLModel::POSE_BLENDSHAPES_NUM);
+    for (int i = 0; i < SMPLModel::POSE_BLENDSHAPES_NUM; i++)
+    {
+        std::string file_name(file_path);
+        std::string id_str = std::to_string(i);
+        file_name += std::string(3 - id_str.size(), '0') + id_str;
+        file_name += ".obj";
+
+        igl::readOBJ(file_name, blendshape, fakeFaces);
+
+        blendshape -= verts_template;
+        pose_basis_storage_.col(i) = E::Map<E::VectorXd>(blendshape.data(), blendshape.size());
+    }
+
+    setMap_(pose_basis_, pose_basis_storage_.data(), pose_basis_storage_.rows(), pose_basis_storage_.cols());
+}
+
+void SMPLModel::readWeights_()
+{
+    std::string file_name(this->gender_path_);
+    file_name += this->gender_;
+    file_name += "_weight.txt";
+
+    std::fstream inFile;
+    inFile.open(file_name, std::ios_base::in);
+    int joints_n, verts_n;
+    inFile >> joints_n;
+    inFile >> verts_n;
+    // Sanity check
+    if (joints_n != SMPLModel::JOINTS_NUM || verts_n != SMPLModel::VERTICES_NUM)
+        throw std::invalid_argument("Weights info (number of joints and vertices) is incompatible with the model");
+
+    // unused slots point to the root with zero weight
+    skinning_.joint_ids.setZero(verts_n, SMPLModel::WEIGHTS_BY_VERTEX);
+    skinning_.weights.setZero(verts_n, SMPLModel::WEIGHTS_BY_VERTEX);
+    double tmp;
+    for (int i = 0; i < verts_n; i++)
+    {
+        int slot = 0;
+        for (int j = 0; j < joints_n; j++)
+        {
+            inFile >> tmp;
+            if (tmp > 0.00001)  // non-zero weight
+            {
+                if (slot >= SMPLModel::WEIGHTS_BY_VERTEX)
+                    throw std::invalid_argument("Weights info: vertex depends on more joints than the model allows");
+                skinning_.joint_ids(i, slot) = j;
+                skinning_.weights(i, slot) = tmp;
+                ++slot;
+            }
+        }
+    }
+
+    inFile.close();
+}
+
+void SMPLModel::readSharedData_(SharedData& shared_data)
+{
+    readPoseStiffnessMat_(shared_data);
+    readJointNames_(shared_data);
+    readHierarchy_(shared_data);
+    fillJointsAncestors_(shared_data);
+    fillVertsNeighbours_(shared_data);
+}
+
+void SMPLModel::readPoseStiffnessMat_(SharedData& shared_data)
+{
+    std::string stiffness_filename = general_path_ + "stiffness.txt";
+
+    std::fstream inFile;
+    inFile.open(stiffness_filename, std::ios_base::in);
+    int rows, cols;
+    inFile >> rows;
+    inFile >> cols;
+    // Sanity check
+    if (rows != cols)
+        throw std::invalid_argument("Striffness matrix is not a square matrix");
+    if (rows != SMPLModel::POSE_SIZE - SMPLModel::SPACE_DIM)
+        throw std::invalid_argument("Striffness matrix size doesn't match the number of non-root pose parameters");
+
+    // To make matrix applicable to full pose vector
+    E::MatrixXd& pose_stiffness = shared_data.pose_stiffness;
+    pose_stiffness.resize(SMPLModel::POSE_SIZE, SMPLModel::POSE_SIZE);
+    for (int i = 0; i < SMPLModel::SPACE_DIM; i++)
+        for (int j = 0; j < SMPLModel::POSE_SIZE; j++)
+            pose_stiffness(i, j) = pose_stiffness(j, i) = 0.;
+
+    // Now read from file
+    for (int i = SMPLModel::SPACE_DIM; i < SMPLModel::POSE_SIZE; i++)
+        for (int j = SMPLModel::SPACE_DIM; j < SMPLModel::POSE_SIZE; j++)
+            inFile >> pose_stiffness(i, j);
+
+    inFile.close();
+}
+
+void SMPLModel::readJointNames_(SharedData& shared_data)
+{
+    std::string file_name(this->general_path_);
+    file_name += "joint_names.txt";
+
+    std::fstream inFile;
+    inFile.open(file_name, std::ios_base::in);
+    int joints_n;
+    inFile >> joints_n;
+    // Sanity check
+    if (joints_n != JOINTS_NUM)
+    {
+        throw std::invalid_argument("Number of joint names specified doesn't match current SMPLModel settings");
+    }
+
+    std::string joint_name;
+    int jointId;
+    for (int i = 0; i < joints_n; i++)
+    {
+        inFile >> joint_name;
+        inFile >> jointId;
+        shared_data.joint_names.insert(DictEntryInt(joint_name, jointId));
+    }
+
+    inFile.close();
+}
+
+void SMPLModel::readHierarchy_(SharedData& shared_data)
+{
+    std::string file_name(this->general_path_);
+    file_name += "jointsHierarchy.txt";
+
+    std::fstream inFile;
+    inFile.open(file_name, std::ios_base::in);
+    int joints_n;
+    inFile >> joints_n;
+    // Sanity check
+    if (joints_n != SMPLModel::JOINTS_NUM)
+    {
+        throw std::invalid_argument("Number of joints in joints hierarchy info is incompatible with the model");
+    }
+
+    int tmpId;
+    for (int j = 0; j < joints_n; j++)
+    {
+        inFile >> tmpId;
+        inFile >> shared_data.joints_parents[tmpId];
+    }
+
+    inFile.close();
+}
+
+void SMPLModel::fillJointsAncestors_(SharedData& shared_data)
+{
+    static_assert(JOINTS_NUM <= 32, "Joints ancestors masks only fit 32 joints");
+
+    shared_data.joints_ancestors[0] = 1u;
+    for (int joint_id = 1; joint_id < JOINTS_NUM; joint_id++)
+    {
+        const int parent_id = shared_data.joints_parents[joint_id];
+        if (parent_id < 0 || parent_id >= joint_id)
+            throw std::invalid_argument("Joints hierarchy is expected to list the parents before their children");
+
+        shared_data.joints_ancestors[joint_id] = shared_data.joints_ancestors[parent_id] | (1u << joint_id);
+    }
+}
+
+void SMPLModel::fillVertsNeighbours_(SharedData& shared_data)
+{
+    const E::MatrixXi& faces = shared_data.faces;
+    auto& verts_neighbours = shared_data.verts_neighbours;
+    for (int face_id = 0; face_id < faces.rows(); face_id++)
+    {
+        for (int corner_id = 0; corner_id < faces.cols(); corner_id++)
+        {
+            int vert_id = faces(face_id, corner_id);
+            for (int shift = 1; shift < faces.cols(); shift++)
+            {
+                int neighbour_vert_id = faces(face_id, (corner_id + shift) % faces.cols());
+                // add if new
+                if (std::find(verts_neighbours[vert_id].begin(), verts_neighbours[vert_id].end(), neighbour_vert_id)
+                    == verts_neighbours[vert_id].end())
+                {
+                    verts_neighbours[vert_id].push_back(neighbour_vert_id);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,187 @@
+#pragma once
+/*
+The class keeps the read-only data of the SMPL model: template, blendshapes, joint regressor, skinning weights,
+joints hierarchy, etc. It is loaded from the model folder once per gender and path and then shared
+(immutable and ref-counted) between all the SMPLWrapper objects that use this model.
+The gender-independent data (faces, vertex adjacency, joints hierarchy and names, pose stiffness)
+is additionally shared between the models of both genders.
+
+The models are obtained through SMPLModel::get(), which returns the cached object if the model was already loaded.
+The model is either read from the resources folder or from the binary bundle (see SMPLModelBundle).
+With the bundle, the large arrays (blendshapes, joint regressor) are used directly from the memory-mapped file.
+
+Limitations:
+    - The cache keeps the models alive until clearCache() is called, even if no wrapper uses them anymore
+    - The loading is done under the cache lock, so concurrent requests for different models are loaded one by one
+*/
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <Eigen/SparseCore>
+#include <igl/readOBJ.h>
+
+class SMPLModelBundle;
+
+namespace E = Eigen;
+class SMPLModel
+{
+public:
+    static constexpr std::size_t SHAPE_SIZE = 10;
+    static constexpr std::size_t SPACE_DIM = 3; // needs to be 3 for most of the routines to work
+    static constexpr std::size_t HOMO_SIZE = SMPLModel::SPACE_DIM + 1;
+    static constexpr std::size_t POSE_SIZE = 72;
+    static constexpr std::size_t JOINTS_NUM = POSE_SIZE / SPACE_DIM;
+    static constexpr std::size_t POSE_BLENDSHAPES_NUM = (JOINTS_NUM - 1) * SPACE_DIM * SPACE_DIM;
+    static constexpr std::size_t VERTICES_NUM = 6890;
+    static constexpr std::size_t WEIGHTS_BY_VERTEX = 4;     // number of joints each vertex depend on
+
+    using NeighboursList = std::vector<int>;
+    using DictionaryInt = std::map<std::string, int>;
+    using DictEntryInt = std::pair<std::string, int>;
+    using ConstMatrixMap = E::Map<const E::MatrixXd>;
+    using SparseRegressor = E::SparseMatrix<double, E::RowMajor>;
+
+    // Single-precision copies of the arrays streamed by the forward model on every evaluation
+    struct SinglePrecisionData {
+        E::MatrixXf pose_basis;     // empty without pose blendshapes
+        E::Matrix<float, E::Dynamic, WEIGHTS_BY_VERTEX> skinning_weights;
+    };
+
+    // Skinning weights packed into the fixed per-vertex layout: WEIGHTS_BY_VERTEX (joint, weight) pairs for each vertex.
+    // Column-major, so each influence slot is stored contiguously (SoA). Unused slots have zero weight
+    struct SkinningTable {
+        E::Matrix<int, E::Dynamic, WEIGHTS_BY_VERTEX> joint_ids;
+        E::Matrix<double, E::Dynamic, WEIGHTS_BY_VERTEX> weights;
+    };
+
+    /*
+    Returns the model for the gender ("f" or "m") from the model folder at path,
+    which contains the files in a pre-defined structure, or from the bundle file if path has the bundle extension.
+    The model is loaded from disk only on the first request, the following requests get the cached object.
+    Pose blendshapes are memory exensive, so they are only loaded if requested.
+    A cached model without pose blendshapes is re-loaded if they are requested later.
+    Throws std::invalid_argument if pose blendshapes are requested from a bundle packed without them.
+    */
+    static std::shared_ptr<const SMPLModel> get(char gender, const std::string& path, bool pose_blendshapes = true);
+    // the models currently in use stay alive with their users
+    static void clearCache();
+
+    ~SMPLModel();
+
+    // getters
+    char getGender() const                              { return gender_; };
+    bool hasPoseBlendshapes() const                     { return pose_basis_.size() > 0; };
+    const E::MatrixXi& getFaces() const                 { return shared_->faces; };
+    const NeighboursList& getVertNeighbours(int vert_id) const { return shared_->verts_neighbours[vert_id]; }
+    const E::MatrixXd& getPoseStiffness() const         { return shared_->pose_stiffness; };
+    const DictionaryInt& getJointNames() const          { return shared_->joint_names; };
+    int getJointParent(int joint_id) const              { return shared_->joints_parents[joint_id]; };
+    // bit i is set if joint i is on the path from the root to the joint, including the joint itself
+    std::uint32_t getJointAncestorsMask(int joint_id) const { return shared_->joints_ancestors[joint_id]; };
+    // centered at the origin
+    const E::MatrixXd& getTemplateVertices() const      { return verts_template_normalized_; };
+    const E::MatrixXd& getTemplateJointLocations() const { return joint_locations_template_; };
+    // the differences between the blendshapes and the template
+    const ConstMatrixMap& getShapeDiff(int shape_id) const { return shape_diffs_[shape_id]; };
+    // (VERTICES_NUM * SPACE_DIM) x SHAPE_SIZE: all the differences as the columns, flattened column-major as the vertex matrices
+    const ConstMatrixMap& getShapeBasis() const         { return shape_basis_; };
+    // (VERTICES_NUM * SPACE_DIM) x POSE_BLENDSHAPES_NUM: a column per blendshape, flattened column-major as the vertex matrices
+    // empty if the model was loaded without pose blendshapes
+    const ConstMatrixMap& getPoseBasis() const          { return pose_basis_; };
+    // bit i is set if the pose blendshapes of joint i move the vertex. Only available with pose blendshapes
+    std::uint32_t getVertexPoseBlendshapesMask(int vert_id) const { return pose_blendshapes_masks_[vert_id]; };
+    const ConstMatrixMap& getJointRegressor() const     { return jointRegressorMat_; };
+    // only the non-zero weights of the regressor: each joint depends on a small number of vertices
+    const SparseRegressor& getJointRegressorSparse() const { return joint_regressor_sparse_; };
+    // JOINTS_NUM x (SPACE_DIM * SHAPE_SIZE): regressed shape blendshapes side-by-side, 
+    // i.e. the joint locations shift per unit of each shape parameter
+    const E::MatrixXd& getJointShapeBasis() const       { return joint_shape_basis_; };
+    // Joints are linear in shape parameters => closed form without the shaped mesh
+    E::MatrixXd calcShapedJointLocations(const E::VectorXd& shape) const;
+    // the same into the given matrix: no allocation if it's already JOINTS_NUM x SPACE_DIM
+    void calcShapedJointLocations(const E::VectorXd& shape, E::MatrixXd& joint_locations) const;
+    const SkinningTable& getSkinningTable() const       { return skinning_; };
+    // converted on the first request (thread-safe)
+    const SinglePrecisionData& getSinglePrecisionData() const;
+
+private:
+    // Model data that doesn't depend on the gender. Loaded with the first model for the path
+    struct SharedData {
+        E::MatrixXi faces;
+        std::array<NeighboursList, VERTICES_NUM> verts_neighbours;
+        E::MatrixXd pose_stiffness;
+        DictionaryInt joint_names;
+        // The joints hierarchy is expectes to be so that the parent's id is always less than the child's
+        int joints_parents[JOINTS_NUM];
+        std::uint32_t joints_ancestors[JOINTS_NUM];
+        // the bundle the data was loaded from, if any
+        std::shared_ptr<const SMPLModelBundle> bundle;
+    };
+
+    // shared_data is nullptr for the first model of the path, otherwise the template faces have to match it
+    SMPLModel(char gender, const std::string& path, bool pose_blendshapes,
+        std::shared_ptr<const SharedData> shared_data);
+    SMPLModel(const SMPLModel&) = delete;
+    SMPLModel& operator=(const SMPLModel&) = delete;
+
+    void loadFromResources_(bool pose_blendshapes, std::shared_ptr<const SharedData> shared_data);
+    void loadFromBundle_(const std::string& path, bool pose_blendshapes, std::shared_ptr<const SharedData> shared_data);
+    // points the views to the new storage
+    static void setMap_(ConstMatrixMap& map, const double* data, E::Index rows, E::Index cols);
+    void setShapeDiffs_(const double* shape_basis);
+    void fillPoseBlendshapesMasks_();
+
+    // text resources
+    void readTemplate_(E::MatrixXd& verts_template, E::MatrixXi& faces);
+    void readJointMat_();
+    void readShapes_(const E::MatrixXd& verts_template);
+    void readPoseBlendshapes_(const E::MatrixXd& verts_template);
+    void readWeights_();
+    void readSharedData_(SharedData& shared_data);
+    void readPoseStiffnessMat_(SharedData& shared_data);
+    void readJointNames_(SharedData& shared_data);
+    void readHierarchy_(SharedData& shared_data);
+    // to be called after the faces are collected
+    void fillVertsNeighbours_(SharedData& shared_data);
+    // to be called after the hierarchy is collected. Throws if the hierarchy doesn't have the expected order
+    static void fillJointsAncestors_(SharedData& shared_data);
+
+    // ---------------- VARS -------------
+    // initial info
+    char gender_;
+    std::string gender_path_;
+    std::string general_path_;
+
+    // constant model info
+    std::shared_ptr<const SharedData> shared_;
+    E::MatrixXd verts_template_normalized_;
+    E::MatrixXd joint_locations_template_;
+    E::MatrixXd joint_shape_basis_;
+    SparseRegressor joint_regressor_sparse_;
+    SkinningTable skinning_;
+    // views to either the own storage or the memory-mapped bundle
+    std::vector<ConstMatrixMap> shape_diffs_;  // store only differences between blendshapes and template
+    ConstMatrixMap shape_basis_;  // the same, as a single matrix
+    ConstMatrixMap pose_basis_;  // store only differences between blendshapes and template
+    std::vector<std::uint32_t> pose_blendshapes_masks_;
+    ConstMatrixMap jointRegressorMat_;
+    // own storage, empty when the model is loaded from the bundle
+    // VERTICES_NUM x (SPACE_DIM * SHAPE_SIZE): shape blendshapes side-by-side
+    E::MatrixXd shape_basis_storage_;
+    E::MatrixXd pose_basis_storage_;
+    E::MatrixXd joint_regressor_storage_;
+    mutable std::once_flag single_precision_once_;
+    mutable std::unique_ptr<SinglePrecisionData> single_precision_data_;
+
+    // cache: models by gender path, gender-independent data by general path
+    static std::mutex cache_mutex_;
+    static std::map<std::string, std::shared_ptr<const SMPLModel>> models_cache_;
+    static std::map<std::string, std::shared_ptr<const SharedData>> shared_data_cache_;
+};
@@ -0,0 +1,334 @@
+#include "SMPLModelBundle.h"
+#include "SMPLModel.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static constexpr char BUNDLE_MAGIC[8] = { 'S', 'M', 'P', 'L', 'B', 'N', 'D', 'L' };
+static_assert(sizeof(int) == 4, "SMPL bundle stores integer matrices as 32-bit values");
+
+void SMPLModelBundle::pack(const std::string & resources_path, const std::string & bundle_filename, bool pose_blendshapes)
+{
+    std::shared_ptr<const SMPLModel> models[2] = {
+        SMPLModel::get('f', resources_path, pose_blendshapes),
+        SMPLModel::get('m', resources_path, pose_blendshapes) };
+
+    std::vector<SectionData> sections;
+
+    // gender-independent data is shared by the models
+    const SMPLModel& model = *models[0];
+    sections.push_back({ "faces", INT32,
+        (std::uint64_t)model.getFaces().rows(), (std::uint64_t)model.getFaces().cols(), model.getFaces().data() });
+    sections.push_back({ "pose_stiffness", DOUBLE,
+        SMPLModel::POSE_SIZE, SMPLModel::POSE_SIZE, model.getPoseStiffness().data() });
+
+    Eigen::VectorXi joints_parents(SMPLModel::JOINTS_NUM);
+    for (int joint_id = 0; joint_id < SMPLModel::JOINTS_NUM; ++joint_id)
+        joints_parents(joint_id) = model.getJointParent(joint_id);
+    sections.push_back({ "joints_parents", INT32, SMPLModel::JOINTS_NUM, 1, joints_parents.data() });
+
+    // "name id" lines, the same format as in joint_names.txt
+    std::string joint_names;
+    for (const auto& joint : model.getJointNames())
+        joint_names += joint.first + " " + std::to_string(joint.second) + "\n";
+    sections.push_back({ "joint_names", CHAR, joint_names.size(), 1, joint_names.data() });
+
+    // per-gender data
+    Eigen::MatrixXd shape_bases[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        const SMPLModel& gender_model = *models[i];
+        const std::string prefix = std::string(1, gender_model.getGender()) + "/";
+
+        sections.push_back({ prefix + "template", DOUBLE,
+            SMPLModel::VERTICES_NUM, SMPLModel::SPACE_DIM, gender_model.getTemplateVertices().data() });
+        sections.push_back({ prefix + "joint_regressor", DOUBLE,
+            SMPLModel::JOINTS_NUM, SMPLModel::VERTICES_NUM, gender_model.getJointRegressor().data() });
+
+        // shape blendshapes side-by-side
+        shape_bases[i].resize(SMPLModel::VERTICES_NUM, SMPLModel::SPACE_DIM * SMPLModel::SHAPE_SIZE);
+        for (int shape_id = 0; shape_id < SMPLModel::SHAPE_SIZE; ++shape_id)
+            shape_bases[i].middleCols(shape_id * SMPLModel::SPACE_DIM, SMPLModel::SPACE_DIM) = gender_model.getShapeDiff(shape_id);
+        sections.push_back({ prefix + "shape_basis", DOUBLE,
+            (std::uint64_t)shape_bases[i].rows(), (std::uint64_t)shape_bases[i].cols(), shape_bases[i].data() });
+
+        if (pose_blendshapes && gender_model.hasPoseBlendshapes())
+        {
+            sections.push_back({ prefix + "pose_basis", DOUBLE,
+                (std::uint64_t)gender_model.getPoseBasis().rows(), (std::uint64_t)gender_model.getPoseBasis().cols(),
+                gender_model.getPoseBasis().data() });
+        }
+
+        const SMPLModel::SkinningTable& skinning = gender_model.getSkinningTable();
+        sections.push_back({ prefix + "skinning_joint_ids", INT32,
+            (std::uint64_t)skinning.joint_ids.rows(), SMPLModel::WEIGHTS_BY_VERTEX, skinning.joint_ids.data() });
+        sections.push_back({ prefix + "skinning_weights", DOUBLE,
+            (std::uint64_t)skinning.weights.rows(), SMPLModel::WEIGHTS_BY_VERTEX, skinning.weights.data() });
+    }
+
+    write_(bundle_filename, sections);
+    // the models are opened without the checksum verification, so check the written file once here
+    open(bundle_filename, true);
+}
+
+std::shared_ptr<const SMPLModelBundle> SMPLModelBundle::open(const std::string & filename, bool verify_checksum)
+{
+    // constructor is private => no make_shared
+    std::shared_ptr<SMPLModelBundle> bundle(new SMPLModelBundle(filename));
+    bundle->validate_(verify_checksum);
+
+    return bundle;
+}
+
+bool SMPLModelBundle::isBundleFile(const std::string & path)
+{
+    const std::string extension = fileExtension();
+    return path.size() > extension.size()
+        && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+SMPLModelBundle::~SMPLModelBundle()
+{
+    if (data_ != nullptr)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(data_);
+#else
+        munmap(const_cast<unsigned char*>(data_), size_);
+#endif
+    }
+}
+
+Eigen::Map<const Eigen::MatrixXd> SMPLModelBundle::getDoubleMatrix(const std::string & name) const
+{
+    const SectionEntry& section = findSection_(name, DOUBLE);
+    return Eigen::Map<const Eigen::MatrixXd>(
+        reinterpret_cast<const double*>(data_ + section.offset), section.rows, section.cols);
+}
+
+Eigen::Map<const Eigen::MatrixXi> SMPLModelBundle::getIntMatrix(const std::string & name) const
+{
+    const SectionEntry& section = findSection_(name, INT32);
+    return Eigen::Map<const Eigen::MatrixXi>(
+        reinterpret_cast<const int*>(data_ + section.offset), section.rows, section.cols);
+}
+
+std::string SMPLModelBundle::getText(const std::string & name) const
+{
+    const SectionEntry& section = findSection_(name, CHAR);
+    return std::string(reinterpret_cast<const char*>(data_ + section.offset), section.rows * section.cols);
+}
+
+/// PRIVATE
+
+SMPLModelBundle::SMPLModelBundle(const std::string & filename)
+    : filename_(filename)
+{
+    std::string message("SMPLModelBundle::ERROR::Could not map the file ");
+    message += filename;
+
+    // The handles can be closed right away: the mapped view keeps the file open
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::invalid_argument(message.c_str());
+
+    LARGE_INTEGER file_size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+        throw std::invalid_argument(message.c_str());
+
+    data_ = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);
+    if (data_ == nullptr)
+        throw std::invalid_argument(message.c_str());
+    size_ = (std::size_t)file_size.QuadPart;
+#else
+    int file_descriptor = ::open(filename.c_str(), O_RDONLY);
+    if (file_descriptor < 0)
+        throw std::invalid_argument(message.c_str());
+
+    struct stat file_stat;
+    void* mapped = MAP_FAILED;
+    if (fstat(file_descriptor, &file_stat) == 0 && file_stat.st_size > 0)
+        mapped = mmap(nullptr, (std::size_t)file_stat.st_size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+    ::close(file_descriptor);
+    if (mapped == MAP_FAILED)
+        throw std::invalid_argument(message.c_str());
+
+    data_ = static_cast<const unsigned char*>(mapped);
+    size_ = (std::size_t)file_stat.st_size;
+#endif
+}
+
+void SMPLModelBundle::validate_(bool verify_checksum)
+{
+    std::string message("SMPLModelBundle::ERROR::Corrupted or incompatible bundle ");
+    message += filename_ + ": ";
+
+    if (size_ < sizeof(FileHeader))
+        throw std::invalid_argument((message + "file is too small").c_str());
+
+    const FileHeader& header = *reinterpret_cast<const FileHeader*>(data_);
+    if (std::memcmp(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0)
+        throw std::invalid_argument((message + "not an SMPL bundle").c_str());
+    if (header.version != VERSION)
+        throw std::invalid_argument((message + "unsupported version " + std::to_string(header.version)).c_str());
+    if (header.file_size != size_ || size_ % ALIGNMENT != 0)
+        throw std::invalid_argument((message + "unexpected file size").c_str());
+
+    const std::size_t table_end = sizeof(FileHeader) + (std::size_t)header.sections_num * sizeof(SectionEntry);
+    if (header.sections_num > size_ / sizeof(SectionEntry) || table_end > size_)
+        throw std::invalid_argument((message + "section table is out of the file").c_str());
+
+    if (verify_checksum
+        && hashWords_(data_ + sizeof(FileHeader), size_ - sizeof(FileHeader), HASH_SEED) != header.checksum)
+    {
+        throw std::invalid_argument((message + "checksum mismatch").c_str());
+    }
+
+    const SectionEntry* table = reinterpret_cast<const SectionEntry*>(data_ + sizeof(FileHeader));
+    for (std::uint32_t i = 0; i < header.sections_num; ++i)
+    {
+        const SectionEntry& section = table[i];
+        if (section.name[SECTION_NAME_SIZE - 1] != '\0' || section.type > CHAR)
+            throw std::invalid_argument((message + "invalid section header").c_str());
+
+        const std::string name(section.name);
+        // overflow-safe bounds check
+        const std::size_t scalar_size = scalarSize_(section.type);
+        if (section.offset % ALIGNMENT != 0 || section.offset < table_end || section.offset > size_
+            || (section.cols > 0 && section.rows > (size_ - section.offset) / scalar_size / section.cols))
+        {
+            throw std::invalid_argument((message + "section " + name + " is out of the file").c_str());
+        }
+        sections_[name] = &section;
+    }
+}
+
+const SMPLModelBundle::SectionEntry & SMPLModelBundle::findSection_(const std::string & name, ScalarType type) const
+{
+    auto section = sections_.find(name);
+    if (section == sections_.end())
+        throw std::out_of_range(("SMPLModelBundle::ERROR::No section " + name + " in " + filename_).c_str());
+    if (section->second->type != type)
+        throw std::invalid_argument(("SMPLModelBundle::ERROR::Section " + name + " has unexpected type").c_str());
+
+    return *section->second;
+}
+
+void SMPLModelBundle::write_(const std::string & filename, const std::vector<SectionData>& sections)
+{
+    // layout
+    std::vector<SectionEntry> table(sections.size());
+    std::size_t offset = alignedSize_(sizeof(FileHeader) + sections.size() * sizeof(SectionEntry));
+    for (std::size_t i = 0; i < sections.size(); ++i)
+    {
+        if (sections[i].name.size() >= SECTION_NAME_SIZE)
+            throw std::invalid_argument(("SMPLModelBundle::ERROR::Section name is too long: " + sections[i].name).c_str());
+
+        std::memset(&table[i], 0, sizeof(SectionEntry));
+        std::memcpy(table[i].name, sections[i].name.c_str(), sections[i].name.size());
+        table[i].type = sections[i].type;
+        table[i].rows = sections[i].rows;
+        table[i].cols = sections[i].cols;
+        table[i].offset = offset;
+
+        offset += alignedSize_(sections[i].rows * sections[i].cols * scalarSize_(sections[i].type));
+    }
+
+    FileHeader header;
+    std::memset(&header, 0, sizeof(FileHeader));
+    std::memcpy(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    header.version = VERSION;
+    header.sections_num = (std::uint32_t)sections.size();
+    header.file_size = offset;
+
+    std::ofstream out(filename, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!out.is_open())
+        throw std::invalid_argument(("SMPLModelBundle::ERROR::Could not open file for writing " + filename).c_str());
+
+    // the checksum is computed on the way and the header is re-written at the end
+    const unsigned char zeros[ALIGNMENT] = {};
+    std::uint64_t hash = HASH_SEED;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+
+    const std::size_t table_size = table.size() * sizeof(SectionEntry);
+    const std::size_t table_padding = alignedSize_(sizeof(FileHeader) + table_size) - sizeof(FileHeader) - table_size;
+    out.write(reinterpret_cast<const char*>(table.data()), table_size);
+    out.write(reinterpret_cast<const char*>(zeros), table_padding);
+    hash = hashWords_(reinterpret_cast<const unsigned char*>(table.data()), table_size, hash);
+    hash = hashWords_(zeros, table_padding, hash);
+
+    for (const SectionData& section : sections)
+    {
+        const unsigned char* data = static_cast<const unsigned char*>(section.data);
+        const std::size_t size = section.rows * section.cols * scalarSize_(section.type);
+        const std::size_t padding = alignedSize_(size) - size;
+        out.write(reinterpret_cast<const char*>(data), size);
+        out.write(reinterpret_cast<const char*>(zeros), padding);
+
+        // the last partial word is completed with the padding zeros
+        const std::size_t full_words_size = size / sizeof(std::uint64_t) * sizeof(std::uint64_t);
+        hash = hashWords_(data, full_words_size, hash);
+        if (size > full_words_size)
+        {
+            unsigned char last_word[sizeof(std::uint64_t)] = {};
+            std::memcpy(last_word, data + full_words_size, size - full_words_size);
+            hash = hashWords_(last_word, sizeof(std::uint64_t), hash);
+        }
+        const std::size_t hashed_size = (size + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t) * sizeof(std::uint64_t);
+        hash = hashWords_(zeros, alignedSize_(size) - hashed_size, hash);
+    }
+
+    header.checksum = hash;
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+
+    if (!out.good())
+        throw std::runtime_error(("SMPLModelBundle::ERROR::Could not write the bundle " + filename).c_str());
+    out.close();
+}
+
+std::size_t SMPLModelBundle::scalarSize_(std::uint32_t type)
+{
+    switch (type)
+    {
+    case DOUBLE:
+        return sizeof(double);
+    case INT32:
+        return sizeof(std::int32_t);
+    default:
+        return sizeof(char);
+    }
+}
+
+std::uint64_t SMPLModelBundle::hashWords_(const unsigned char * data, std::size_t size, std::uint64_t hash)
+{
+    constexpr std::uint64_t FNV_PRIME = 1099511628211ull;
+
+    std::uint64_t word;
+    for (std::size_t i = 0; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t))
+    {
+        std::memcpy(&word, data + i, sizeof(std::uint64_t));
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+
+    return hash;
+}
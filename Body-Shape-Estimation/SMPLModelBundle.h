@@ -0,0 +1,106 @@
+#pragma once
+/*
+The class packs the SMPL model resources folder into a single binary file (bundle) and reads it back
+through the memory mapping, so that the model arrays are used directly from the file (zero-copy)
+and the processes using the same bundle share the physical memory through the OS page cache.
+
+File layout (native byte order, little-endian on all the supported platforms):
+    FileHeader
+    SectionEntry[sections_num]
+    section data, each section starts at the ALIGNMENT boundary; matrices are stored column-major
+The checksum covers everything after the FileHeader, including the padding.
+
+SMPLModel::get() loads the model from the bundle if the path points to the file with fileExtension().
+Limitations:
+    - The bundle is not portable between the platforms with different byte order
+*/
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+
+class SMPLModelBundle
+{
+public:
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::size_t ALIGNMENT = 64;
+    static constexpr std::size_t SECTION_NAME_SIZE = 48;
+
+    enum ScalarType : std::uint32_t {
+        DOUBLE,
+        INT32,
+        CHAR
+    };
+
+    // Converter: reads the models of both genders from the resources folder (see SMPLModel) and writes them to bundle_filename
+    // Pose blendshapes are only packed if requested
+    static void pack(const std::string& resources_path, const std::string& bundle_filename, bool pose_blendshapes = true);
+    // Maps the file to memory and checks its consistency. Throws std::invalid_argument if the file is not a valid bundle
+    // The header and the section bounds are always checked. The checksum verification touches every page of the file
+    // and defeats the lazy loading, so it is off by default: pack() verifies the written file instead
+    static std::shared_ptr<const SMPLModelBundle> open(const std::string& filename, bool verify_checksum = false);
+    // based on the file extension
+    static bool isBundleFile(const std::string& path);
+    static std::string fileExtension() { return ".smplb"; }
+
+    ~SMPLModelBundle();
+
+    // section access. Views are valid while the bundle object is alive
+    // throw std::out_of_range if the section is absent and std::invalid_argument if the section has other type
+    bool hasSection(const std::string& name) const { return sections_.count(name) > 0; }
+    Eigen::Map<const Eigen::MatrixXd> getDoubleMatrix(const std::string& name) const;
+    Eigen::Map<const Eigen::MatrixXi> getIntMatrix(const std::string& name) const;
+    std::string getText(const std::string& name) const;
+
+private:
+    struct FileHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t sections_num;
+        std::uint64_t file_size;
+        std::uint64_t checksum;
+    };
+
+    struct SectionEntry {
+        char name[SECTION_NAME_SIZE];
+        std::uint32_t type;     // ScalarType
+        std::uint32_t reserved;
+        std::uint64_t rows;
+        std::uint64_t cols;
+        std::uint64_t offset;   // from the start of the file
+    };
+
+    // to be filled by the converter
+    struct SectionData {
+        std::string name;
+        ScalarType type;
+        std::uint64_t rows;
+        std::uint64_t cols;
+        const void* data;
+    };
+
+    explicit SMPLModelBundle(const std::string& filename);
+    SMPLModelBundle(const SMPLModelBundle&) = delete;
+    SMPLModelBundle& operator=(const SMPLModelBundle&) = delete;
+
+    void validate_(bool verify_checksum);
+    const SectionEntry& findSection_(const std::string& name, ScalarType type) const;
+
+    static void write_(const std::string& filename, const std::vector<SectionData>& sections);
+    static std::size_t scalarSize_(std::uint32_t type);
+    static std::size_t alignedSize_(std::size_t size) { return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+    // FNV-1a over 64-bit words. size is expected to be a multiple of 8
+    static std::uint64_t hashWords_(const unsigned char* data, std::size_t size, std::uint64_t hash);
+    static constexpr std::uint64_t HASH_SEED = 14695981039346656037ull;
+
+    // ---------------- VARS -------------
+    std::string filename_;
+    // read-only view of the whole file
+    const unsigned char* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::map<std::string, const SectionEntry*> sections_;
+};
@@ -1,35 +1,129 @@
 #include "SMPLWrapper.h"
+#include "ThreadPool.h"
 
-int SMPLWrapper::joints_parents_[JOINTS_NUM];
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
-SMPLWrapper::SMPLWrapper(char gender, const std::string path, const bool pose_blendshapes)
-    : use_pose_blendshapes_(pose_blendshapes)
+namespace {
+// the double matrices are used as is, the float ones are converted into the buffer
+inline const E::MatrixXd& asDouble(const E::MatrixXd & verts, E::MatrixXd &) { return verts; }
+inline const E::MatrixXd& asDouble(const E::MatrixXf & verts, E::MatrixXd & buffer)
+{
+    buffer = verts.cast<double>();
+    return buffer;
+}
+
+// Skinning kernel of a single point: posed = (sum_k weights[k] * transforms[k]) * point.
+// transforms are column-major 4x4: the columns (x, y, z, translation) of the influencing joints are blended,
+// then the blended transform is applied to the point
+template<typename Scalar>
+inline void blendAndApplyGeneric(const Scalar* const (&transforms)[SMPLModel::WEIGHTS_BY_VERTEX],
+    const Scalar (&weights)[SMPLModel::WEIGHTS_BY_VERTEX],
+    const Scalar (&point)[SMPLModel::HOMO_SIZE], Scalar (&posed)[SMPLModel::HOMO_SIZE])
+{
+    using Transform = E::Matrix<Scalar, SMPLModel::HOMO_SIZE, SMPLModel::HOMO_SIZE>;
+    using Point = E::Matrix<Scalar, SMPLModel::HOMO_SIZE, 1>;
+    Transform blended = Transform::Zero();
+    for (int k = 0; k < SMPLModel::WEIGHTS_BY_VERTEX; ++k)
+        blended += weights[k] * E::Map<const Transform>(transforms[k]);
+    E::Map<Point> posed_point(posed);
+    posed_point.noalias() = blended * E::Map<const Point>(point);
+}
+
+#if defined(__AVX2__)
+// a * b + c. AVX2 does not imply FMA: GCC and Clang need -mfma, MSVC emits it with /arch:AVX2
+inline __m256d multiplyAdd(__m256d a, __m256d b, __m256d c)
 {
-    // set the info
-    if (gender != 'f' && gender != 'm') 
+#if defined(__FMA__) || defined(_MSC_VER)
+    return _mm256_fmadd_pd(a, b, c);
+#else
+    return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+#endif
+}
+#endif
+
+inline void blendAndApply(const double* const (&transforms)[SMPLModel::WEIGHTS_BY_VERTEX],
+    const double (&weights)[SMPLModel::WEIGHTS_BY_VERTEX],
+    const double (&point)[SMPLModel::HOMO_SIZE], double (&posed)[SMPLModel::HOMO_SIZE])
+{
+    constexpr int HOMO_SIZE = SMPLModel::HOMO_SIZE;
+#if defined(__AVX2__)
+    __m256d columns[HOMO_SIZE] = { _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd() };
+    for (int k = 0; k < SMPLModel::WEIGHTS_BY_VERTEX; ++k)
+    {
+        __m256d weight = _mm256_broadcast_sd(weights + k);
+        for (int col = 0; col < HOMO_SIZE; ++col)
+            columns[col] = multiplyAdd(weight, _mm256_loadu_pd(transforms[k] + col * HOMO_SIZE), columns[col]);
+    }
+    __m256d result = _mm256_mul_pd(columns[3], _mm256_set1_pd(point[3]));
+    result = multiplyAdd(columns[0], _mm256_set1_pd(point[0]), result);
+    result = multiplyAdd(columns[1], _mm256_set1_pd(point[1]), result);
+    result = multiplyAdd(columns[2], _mm256_set1_pd(point[2]), result);
+    _mm256_storeu_pd(posed, result);
+#elif defined(__SSE2__) || defined(_M_X64)
+    // each column is processed as (x, y) and (z, homo) halves
+    __m128d columns[HOMO_SIZE][2];
+    for (int col = 0; col < HOMO_SIZE; ++col)
+        columns[col][0] = columns[col][1] = _mm_setzero_pd();
+    for (int k = 0; k < SMPLModel::WEIGHTS_BY_VERTEX; ++k)
+    {
+        __m128d weight = _mm_set1_pd(weights[k]);
+        for (int col = 0; col < HOMO_SIZE; ++col)
+        {
+            columns[col][0] = _mm_add_pd(columns[col][0], _mm_mul_pd(weight, _mm_loadu_pd(transforms[k] + col * HOMO_SIZE)));
+            columns[col][1] = _mm_add_pd(columns[col][1], _mm_mul_pd(weight, _mm_loadu_pd(transforms[k] + col * HOMO_SIZE + 2)));
+        }
+    }
+    __m128d result[2] = { _mm_setzero_pd(), _mm_setzero_pd() };
+    for (int col = 0; col < HOMO_SIZE; ++col)
     {
-        std::string message("Wrong gender supplied: ");
-        message += gender;
-        throw std::invalid_argument(message.c_str());
+        const __m128d coord = _mm_set1_pd(point[col]);
+        result[0] = _mm_add_pd(result[0], _mm_mul_pd(columns[col][0], coord));
+        result[1] = _mm_add_pd(result[1], _mm_mul_pd(columns[col][1], coord));
     }
-    this->gender_ = gender;
+    _mm_storeu_pd(posed, result[0]);
+    _mm_storeu_pd(posed + 2, result[1]);
+#else
+    blendAndApplyGeneric(transforms, weights, point, posed);
+#endif
+}
 
-    // !!!! expects a pre-defined file structure
-    general_path_ = path + "/";
-    gender_path_ = general_path_ + gender + "_smpl/";
+inline void blendAndApply(const float* const (&transforms)[SMPLModel::WEIGHTS_BY_VERTEX],
+    const float (&weights)[SMPLModel::WEIGHTS_BY_VERTEX],
+    const float (&point)[SMPLModel::HOMO_SIZE], float (&posed)[SMPLModel::HOMO_SIZE])
+{
+    constexpr int HOMO_SIZE = SMPLModel::HOMO_SIZE;
+#if defined(__SSE2__) || defined(_M_X64)
+    // a whole column fits into the register
+    __m128 columns[HOMO_SIZE] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    for (int k = 0; k < SMPLModel::WEIGHTS_BY_VERTEX; ++k)
+    {
+        __m128 weight = _mm_set1_ps(weights[k]);
+        for (int col = 0; col < HOMO_SIZE; ++col)
+            columns[col] = _mm_add_ps(columns[col], _mm_mul_ps(weight, _mm_loadu_ps(transforms[k] + col * HOMO_SIZE)));
+    }
+    __m128 result = _mm_mul_ps(columns[3], _mm_set1_ps(point[3]));
+    for (int col = 0; col < SMPLModel::SPACE_DIM; ++col)
+        result = _mm_add_ps(result, _mm_mul_ps(columns[col], _mm_set1_ps(point[col])));
+    _mm_storeu_ps(posed, result);
+#else
+    blendAndApplyGeneric(transforms, weights, point, posed);
+#endif
+}
+}
 
-    readTemplate_();
-    readJointMat_();
-    readPoseStiffnessMat_();
-    readJointNames_();
-    readShapes_();
-    if (use_pose_blendshapes_)
-        readPoseBlendshapes_();
-    readWeights_();
-    readHierarchy_();
+SMPLWrapper::SMPLWrapper(char gender, const std::string path, const bool pose_blendshapes)
+    : SMPLWrapper(SMPLModel::get(gender, path, pose_blendshapes), pose_blendshapes)
+{
+}
 
-    joint_locations_template_ = calcJointLocations();
-    fillVertsNeighbours_();
+SMPLWrapper::SMPLWrapper(std::shared_ptr<const SMPLModel> model, const bool pose_blendshapes)
+    : model_(std::move(model))
+{
+    if (model_ == nullptr)
+        throw std::invalid_argument("SMPLWrapper::ERROR::SMPL model is not provided");
+    use_pose_blendshapes_ = pose_blendshapes && model_->hasPoseBlendshapes();
 
     // initilize the model intermediate values
     calcModel();
@@ -48,7 +142,7 @@ void SMPLWrapper::rotateLimbToDirection(const std::string joint_name, const E::V
     
     int joint_id;
     try { 
-        joint_id = joint_names_.at(joint_name); 
+        joint_id = model_->getJointNames().at(joint_name); 
         if (joint_id == 0) // root
             throw std::out_of_range("SMPLWrapper::ERROR::use specialized method to set up root");
         if (joint_name == "LowBack" || joint_name == "MiddleBack" || joint_name == "TopBack")
@@ -63,7 +157,7 @@ void SMPLWrapper::rotateLimbToDirection(const std::string joint_name, const E::V
     int child_id;
     for (int i = 0; i < JOINTS_NUM; i++)
     {
-        if (joints_parents_[i] == joint_id)
+        if (model_->getJointParent(i) == joint_id)
         {
             child_id = i;
             break;
@@ -73,7 +167,7 @@ void SMPLWrapper::rotateLimbToDirection(const std::string joint_name, const E::V
     std::cout << "SMPL Joint pair " << joint_id << " -> " << child_id << std::endl;
 
     // get default bone direction; it also updates joint_global_transform_
-    E::MatrixXd joint_locations = calcJointLocations_(nullptr, nullptr, &state_.pose);
+    E::MatrixXd joint_locations = calcJointLocations_(workspace_, nullptr, nullptr, &state_.pose);
     E::Vector3d default_dir =
         (joint_locations.row(child_id) - joint_locations.row(joint_id)).transpose();
 
@@ -83,12 +177,12 @@ void SMPLWrapper::rotateLimbToDirection(const std::string joint_name, const E::V
     if (direction.norm() * default_dir.norm() > 0.0)
     {
         E::Vector3d axis = angle_axis_(default_dir, direction);
-        assignJointGlobalRotation_(joint_id, axis, fk_transforms_);
+        assignJointGlobalRotation_(joint_id, axis, workspace_.fk_transforms);
     }
 
     // sanity check
     // TODO add efficiency flag
-    E::MatrixXd new_joint_locations = calcJointLocations_(nullptr, nullptr, &state_.pose);
+    E::MatrixXd new_joint_locations = calcJointLocations_(workspace_, nullptr, nullptr, &state_.pose);
     E::Vector3d new_dir = (new_joint_locations.row(child_id) - new_joint_locations.row(joint_id)).transpose();
     std::cout << "Difference with the target " << std::endl
         << new_dir.normalized() - direction.normalized() << std::endl;
@@ -133,7 +227,7 @@ void SMPLWrapper::rotateRoot(const E::Vector3d& body_up, const E::Vector3d& body
     std::cout << "Combined rotation with angle " << combined_rotation.norm() * 180 / 3.1415
         << "\n" << combined_rotation << std::endl;
 
-    assignJointGlobalRotation_(0, combined_rotation, fk_transforms_);
+    assignJointGlobalRotation_(0, combined_rotation, workspace_.fk_transforms);
 
     // recalculate model with updated parameters
     calcModel();
@@ -147,10 +241,10 @@ void SMPLWrapper::twistBack(const E::Vector3d& shoulder_dir)
         << "To direction \n" << shoulder_dir << std::endl;
 
     // get default bone direction; it also updates joint_global_transform_
-    E::MatrixXd joint_locations = calcJointLocations_(nullptr, nullptr, &state_.pose);
+    E::MatrixXd joint_locations = calcJointLocations_(workspace_, nullptr, nullptr, &state_.pose);
 
-    int Rshoulder_id = joint_names_.at("RShoulder");
-    int Lshoulder_id = joint_names_.at("LShoulder");
+    int Rshoulder_id = model_->getJointNames().at("RShoulder");
+    int Lshoulder_id = model_->getJointNames().at("LShoulder");
 
     E::Vector3d default_dir =
         (joint_locations.row(Lshoulder_id) - joint_locations.row(Rshoulder_id)).transpose();
@@ -165,13 +259,13 @@ void SMPLWrapper::twistBack(const E::Vector3d& shoulder_dir)
         << "\n" << rotation << std::endl;
 
     // divide between the back joints
-    assignJointGlobalRotation_(joint_names_.at("LowBack"), axis * angle / 3, fk_transforms_);
+    assignJointGlobalRotation_(model_->getJointNames().at("LowBack"), axis * angle / 3, workspace_.fk_transforms);
 
-    updateJointsFKTransforms_(state_.pose, joint_locations_template_);
-    assignJointGlobalRotation_(joint_names_.at("MiddleBack"), axis * angle / 3, fk_transforms_);
+    updateJointsFKTransforms_(state_.pose, model_->getTemplateJointLocations(), workspace_);
+    assignJointGlobalRotation_(model_->getJointNames().at("MiddleBack"), axis * angle / 3, workspace_.fk_transforms);
 
-    updateJointsFKTransforms_(state_.pose, joint_locations_template_);
-    assignJointGlobalRotation_(joint_names_.at("TopBack"), axis * angle / 3, fk_transforms_);
+    updateJointsFKTransforms_(state_.pose, model_->getTemplateJointLocations(), workspace_);
+    assignJointGlobalRotation_(model_->getJointNames().at("TopBack"), axis * angle / 3, workspace_.fk_transforms);
 
     // recalculate model with updated parameters
     calcModel();
@@ -224,342 +318,372 @@ void SMPLWrapper::loadParametersFromFile(const std::string filename)
     calcModel();
 }
 
-E::MatrixXd SMPLWrapper::calcModel(
-    const E::VectorXd * translation, 
-    const ERMatrixXd * pose,
-    const E::VectorXd * shape,
-    const ERMatrixXd * displacement,
-    E::MatrixXd * pose_jac, E::MatrixXd * shape_jac, E::MatrixXd * displacement_jac)
+template<>
+const SMPLWrapper::EMatrixX<double>& SMPLWrapper::shapedRest_<double>(Workspace & workspace)
 {
-    // assignment won't work without cast
-    E::MatrixXd verts = verts_template_normalized_;
-
-    if (shape != nullptr)
-        shapeSMPL_(*shape, verts, shape_jac);
+    return workspace.shaped_verts;
+}
 
-    if (pose != nullptr)
-    {
-        // will be displaced inside poseSMPL_ method
-        poseSMPL_(*pose, verts, displacement, pose_jac);
-
-        // should be updated for the given pose
-        // TODO: add the use of pre-computed LBS Matrices 
-        if (shape_jac != nullptr)
-            for (int i = 0; i < SMPLWrapper::SHAPE_SIZE; ++i)
-                poseSMPL_(*pose, shape_jac[i], displacement);  // Pose needs recalculation because joint positions at T are new
-        if (displacement_jac != nullptr)
-            for (int axis = 0; axis < SPACE_DIM; axis++)
-            {
-                displacement_jac[axis] = E::MatrixXd::Zero(VERTICES_NUM, SPACE_DIM);
-                displacement_jac[axis].col(axis).setOnes();
-                poseSMPL_(*pose, displacement_jac[axis], nullptr, nullptr, true); // no pose recalculation
-            }
-        // verts are displaced and posed
-    }
-    else if (displacement != nullptr)
+template<>
+const SMPLWrapper::EMatrixX<float>& SMPLWrapper::shapedRest_<float>(Workspace & workspace)
+{
+    if (workspace.shaped_single_version != workspace.shape_version)
     {
-        verts = verts + *displacement;
+        workspace.shaped_verts_single = workspace.shaped_verts.cast<float>();
+        workspace.shaped_single_version = workspace.shape_version;
     }
+    return workspace.shaped_verts_single;
+}
 
-    if (translation != nullptr)
-        translate_(*translation, verts);
-
+template<>
+SMPLWrapper::EMatrixX<double>& SMPLWrapper::workingVerts_<double>(Workspace &, E::MatrixXd & verts)
+{
     return verts;
 }
 
-E::MatrixXd SMPLWrapper::calcVertexNormals(const E::MatrixXd * verts)
+template<>
+SMPLWrapper::EMatrixX<float>& SMPLWrapper::workingVerts_<float>(Workspace & workspace, E::MatrixXd &)
 {
-    E::MatrixXd normals;
-    igl::per_vertex_normals(*verts, faces_, normals);
+    return workspace.verts_single;
+}
 
-    return normals;
+template<>
+const SMPLWrapper::EHomoTransform<double>* SMPLWrapper::lbsTransforms_<double>(const Workspace & workspace)
+{
+    return workspace.lbs_transforms;
 }
 
-E::MatrixXd SMPLWrapper::calcModel()
+template<>
+const SMPLWrapper::EHomoTransform<float>* SMPLWrapper::lbsTransforms_<float>(const Workspace & workspace)
 {
-    return calcModel(&state_.translation, &state_.pose, &state_.shape, &state_.displacements);
+    return workspace.lbs_transforms_single;
 }
 
-E::MatrixXd SMPLWrapper::calcJointLocations()
+template<>
+E::Map<const SMPLWrapper::EMatrixX<double>> SMPLWrapper::poseBasis_<double>() const
 {
-    return calcJointLocations_(&state_.translation, &state_.shape, &state_.pose);
+    return model_->getPoseBasis();
 }
 
-void SMPLWrapper::saveToObj(const std::string filename) 
+template<>
+E::Map<const SMPLWrapper::EMatrixX<float>> SMPLWrapper::poseBasis_<float>() const
 {
-    saveToObj_(&state_.translation, &state_.pose, &state_.shape, nullptr, filename);
+    const E::MatrixXf& pose_basis = model_->getSinglePrecisionData().pose_basis;
+    return E::Map<const E::MatrixXf>(pose_basis.data(), pose_basis.rows(), pose_basis.cols());
 }
 
-void SMPLWrapper::saveWithDisplacementToObj(const std::string filename)
+template<>
+const E::Matrix<double, E::Dynamic, SMPLWrapper::WEIGHTS_BY_VERTEX>& SMPLWrapper::skinningWeights_<double>() const
 {
-    saveToObj_(&state_.translation, &state_.pose, &state_.shape, &state_.displacements, filename);
+    return model_->getSkinningTable().weights;
 }
 
-void SMPLWrapper::savePosedOnlyToObj(const std::string filename) 
+template<>
+const E::Matrix<float, E::Dynamic, SMPLWrapper::WEIGHTS_BY_VERTEX>& SMPLWrapper::skinningWeights_<float>() const
 {
-    saveToObj_(&state_.translation, &state_.pose, nullptr, nullptr, filename);
+    return model_->getSinglePrecisionData().skinning_weights;
 }
 
-void SMPLWrapper::saveShapedOnlyToObj(const std::string filename) 
+E::MatrixXd SMPLWrapper::calcModel(
+    const E::VectorXd * translation, 
+    const ERMatrixXd * pose,
+    const E::VectorXd * shape,
+    const ERMatrixXd * displacement,
+    PoseJacobian * pose_jac, ERMatrixXd * shape_jac, ERMatrixXd * displacement_jac)
 {
-    saveToObj_(&state_.translation, nullptr, &state_.shape, nullptr, filename);
+    return calcModel(translation, pose, shape, displacement, workspace_, pose_jac, shape_jac, displacement_jac);
 }
 
-void SMPLWrapper::saveShapedWithDisplacementToObj(const std::string filename)
+E::MatrixXd SMPLWrapper::calcModel(
+    const E::VectorXd * translation,
+    const ERMatrixXd * pose,
+    const E::VectorXd * shape,
+    const ERMatrixXd * displacement,
+    Workspace & workspace,
+    PoseJacobian * pose_jac, ERMatrixXd * shape_jac, ERMatrixXd * displacement_jac) const
 {
-    saveToObj_(&state_.translation, nullptr, &state_.shape, &state_.displacements, filename);
+    E::MatrixXd verts;
+    calcModel(translation, pose, shape, displacement, workspace, verts, pose_jac, shape_jac, displacement_jac);
+    return verts;
 }
 
-void SMPLWrapper::logParameters(const std::string filename)
+void SMPLWrapper::calcModel(
+    const E::VectorXd * translation,
+    const ERMatrixXd * pose,
+    const E::VectorXd * shape,
+    const ERMatrixXd * displacement,
+    Workspace & workspace,
+    E::MatrixXd & verts,
+    PoseJacobian * pose_jac, ERMatrixXd * shape_jac, ERMatrixXd * displacement_jac) const
 {
-    std::ofstream out(filename);
+    // pose jacobian is only defined for the posed model, shape jacobian -- for the shaped one
+    unsigned path = 0;
+    if (pose != nullptr && pose_jac != nullptr)
+        path |= PATH_POSE_JAC;
+    if (shape != nullptr && shape_jac != nullptr)
+        path |= PATH_SHAPE_JAC;
+    if (displacement_jac != nullptr)
+        path |= PATH_DISPLACEMENT_JAC;
+    if (use_pose_blendshapes_)
+        path |= PATH_POSE_BLENDSHAPES;
+    if (use_single_precision_)
+        path |= PATH_SINGLE_PRECISION;
 
-    out << "Translation [ " << std::endl;
-    for (int i = 0; i < SMPLWrapper::SPACE_DIM; i++)
-        out << state_.translation[i] << " , ";
-    out << std::endl << "]" << std::endl;
+    (this->*model_paths_[path])(translation, pose, shape, displacement, workspace, verts,
+        pose_jac, shape_jac, displacement_jac);
+}
 
-    out << "Pose params [ \n";
-    for (int i = 0; i < SMPLWrapper::JOINTS_NUM; i++)
+template<unsigned Path>
+void SMPLWrapper::calcModel_(
+    const E::VectorXd * translation,
+    const ERMatrixXd * pose,
+    const E::VectorXd * shape,
+    const ERMatrixXd * displacement,
+    Workspace & workspace, E::MatrixXd & out,
+    PoseJacobian * pose_jac, ERMatrixXd * shape_jac, ERMatrixXd * displacement_jac) const
+{
+    using Scalar = typename std::conditional<(Path & PATH_SINGLE_PRECISION) != 0, float, double>::type;
+    constexpr bool with_pose_jac = (Path & PATH_POSE_JAC) != 0;
+    constexpr bool with_shape_jac = (Path & PATH_SHAPE_JAC) != 0;
+    constexpr bool with_displacement_jac = (Path & PATH_DISPLACEMENT_JAC) != 0;
+    constexpr bool pose_blendshapes = (Path & PATH_POSE_BLENDSHAPES) != 0;
+
+    // the shaped rest mesh is only re-calculated when the shape changes
+    updateShapedRest_(shape, workspace);
+    EMatrixX<Scalar>& verts = workingVerts_<Scalar>(workspace, out);
+    verts = shapedRest_<Scalar>(workspace);
+
+    if (with_shape_jac && pose == nullptr)
     {
-        for (int j = 0; j < SMPLWrapper::SPACE_DIM; j++)
+        // the shape basis is flattened axis by axis => re-ordered into the vertex-major layout
+        const SMPLModel::ConstMatrixMap& shape_basis = model_->getShapeBasis();
+        shape_jac->resize(VERTICES_NUM * SPACE_DIM, SHAPE_SIZE);
+        parallelForVertices_(VERTICES_NUM, [&](int chunk_begin, int chunk_end)
         {
-            out << state_.pose(i, j) << " , ";
-        }
-        out << std::endl;
+            for (int v = chunk_begin; v < chunk_end; ++v)
+                for (int axis = 0; axis < SPACE_DIM; ++axis)
+                    shape_jac->row(v * SPACE_DIM + axis) = shape_basis.row(axis * VERTICES_NUM + v);
+        });
     }
-    out << "]" << std::endl;
 
-    out << "Shape (betas) params [ " << std::endl;
-    for (int i = 0; i < SMPLWrapper::SHAPE_SIZE; i++)
-        out << state_.shape[i] << " , ";
-    out << std::endl << "]" << std::endl;
+    if (pose != nullptr)
+    {
+        // the same for the transforms: re-calculated on pose or shape change
+        updatePoseTransforms_(*pose, workspace, with_pose_jac);
+        // will be displaced inside poseSMPL_ method
+        poseSMPL_<Scalar, pose_blendshapes, with_pose_jac>(verts, displacement, workspace, pose_jac);
 
-    out << "Joints locations for posed and shaped model [" << std::endl;
-    out << calcJointLocations() << std::endl;
-    out << "]" << std::endl;
+        if (with_shape_jac)
+            calcShapeJac_(workspace, shape_jac);
+        if (with_displacement_jac)
+            calcDisplacementJac_(workspace, displacement_jac);
+        // verts are displaced and posed
+    }
+    else
+    {
+        if (displacement != nullptr)
+            verts += displacement->cast<Scalar>();
+        if (with_displacement_jac)
+        {
+            displacement_jac->resize(VERTICES_NUM * SPACE_DIM, SPACE_DIM);
+            for (int v = 0; v < VERTICES_NUM; ++v)
+                displacement_jac->middleRows<SPACE_DIM>(v * SPACE_DIM).setIdentity();
+        }
+    }
 
-    out.close();
-}
+    if (translation != nullptr)
+        translate_(*translation, verts);
 
-/// PRIVATE
+    // the float result is converted into the output, the double one is already there
+    asDouble(verts, out);
+}
 
-void SMPLWrapper::readTemplate_()
+template<std::size_t... Paths>
+constexpr std::array<SMPLWrapper::ModelPath, sizeof...(Paths)> SMPLWrapper::makeModelPaths_(std::index_sequence<Paths...>)
 {
-    std::string file_name = gender_path_ + gender_ + "_shapeAv.obj";
-
-    bool success = igl::readOBJ(file_name, verts_template_, faces_);
-    if (!success)
-    {
-        std::string message("Abort: Could not read SMPL template at ");
-        message += file_name;
-        throw std::invalid_argument(message.c_str());
-    }
-
-    E::VectorXd mean_point = verts_template_.colwise().mean();
-    verts_template_normalized_ = verts_template_.rowwise() - mean_point.transpose();
+    return {{ &SMPLWrapper::calcModel_<Paths>... }};
 }
 
-void SMPLWrapper::readJointMat_()
+// constant-initialized: available to the static objects as well
+const std::array<SMPLWrapper::ModelPath, SMPLWrapper::PATHS_NUM> SMPLWrapper::model_paths_ = 
+    SMPLWrapper::makeModelPaths_(std::make_index_sequence<SMPLWrapper::PATHS_NUM>());
+
+void SMPLWrapper::calcPoseNormalEquations(const ERMatrixXd & pose,
+    const E::VectorXd * shape,
+    const ERMatrixXd * displacement,
+    const E::MatrixXd & residual_grads, const E::VectorXd & residuals,
+    Workspace & workspace, NormalEquations & out) const
 {
-    std::string file_name(this->gender_path_);
-    file_name += this->gender_;
-    file_name += "_joints_mat.txt";
+    updateShapedRest_(shape, workspace);
+    updatePoseTransforms_(pose, workspace, true);
 
-    // copy from Meekyong code example
-    std::fstream inFile;
-    inFile.open(file_name, std::ios_base::in);
-    int joints_n, verts_n;
-    inFile >> joints_n;
-    inFile >> verts_n;
-    // Sanity check
-    if (joints_n != SMPLWrapper::JOINTS_NUM || verts_n != SMPLWrapper::VERTICES_NUM)
-        throw std::invalid_argument("Joint matrix info (number of joints and vertices) is incompatible with the model");
+    // rest pose with the pose blendshapes, as in poseSMPL_()
+    E::MatrixXd& rest_verts = workspace.rest_verts;
+    rest_verts = workspace.shaped_verts;
+    if (use_pose_blendshapes_)
+        addPoseBlendshapes_(workspace.local_rotations, rest_verts);
 
-    this->jointRegressorMat_.resize(joints_n, verts_n);
-    for (int i = 0; i < joints_n; i++)
-        for (int j = 0; j < verts_n; j++)
-            inFile >> this->jointRegressorMat_(i, j);
+    E::Matrix3d rotation_jacs[POSE_SIZE];
+    calcRotationJacs_(workspace, rotation_jacs);
 
-    inFile.close();
+    // the pose blendshapes option is resolved once for the pass
+    const auto accumulate = [&](auto pose_blendshapes)
+    {
+        accumulateNormalEquations_(POSE_SIZE, residual_grads, residuals,
+            [&](int v, int * params, double * values)
+        {
+            E::Vector3d rest_point = rest_verts.row(v).transpose();
+            if (displacement != nullptr)
+                rest_point += displacement->row(v).transpose();
+            return calcVertexPoseJac_<decltype(pose_blendshapes)::value>(v, rest_point, rotation_jacs, workspace, params, values);
+        }, workspace, out);
+    };
+    if (use_pose_blendshapes_)
+        accumulate(std::true_type());
+    else
+        accumulate(std::false_type());
 }
 
-void SMPLWrapper::readPoseStiffnessMat_()
+void SMPLWrapper::calcShapeNormalEquations(const ERMatrixXd * pose,
+    const E::VectorXd & shape,
+    const E::MatrixXd & residual_grads, const E::VectorXd & residuals,
+    Workspace & workspace, NormalEquations & out) const
 {
-    std::string stiffness_filename = general_path_ + "stiffness.txt";
-
-    std::fstream inFile;
-    inFile.open(stiffness_filename, std::ios_base::in);
-    constexpr int NON_ROOT_POSE_SIZE = POSE_SIZE - SPACE_DIM;
-    int rows, cols;
-    inFile >> rows;
-    inFile >> cols;
-    // Sanity check
-    if (rows != cols)
-        throw std::invalid_argument("Striffness matrix is not a square matrix");
-    if (rows != SMPLWrapper::POSE_SIZE - SMPLWrapper::SPACE_DIM)
-        throw std::invalid_argument("Striffness matrix size doesn't match the number of non-root pose parameters");
+    updateShapedRest_(&shape, workspace);
 
-    // To make matrix applicable to full pose vector
-    pose_stiffness_.resize(SMPLWrapper::POSE_SIZE, SMPLWrapper::POSE_SIZE);
-    for (int i = 0; i < SMPLWrapper::SPACE_DIM; i++)
-        for (int j = 0; j < SMPLWrapper::POSE_SIZE; j++)
-            pose_stiffness_(i, j) = pose_stiffness_(j, i) = 0.;
+    E::Vector3d lbs_translations_jac[JOINTS_NUM][SHAPE_SIZE];
+    if (pose != nullptr)
+    {
+        updatePoseTransforms_(*pose, workspace, false);
+        calcLBSTranslationsShapeJac_(workspace, lbs_translations_jac);
+    }
 
-    // Now read from file
-    for (int i = SMPLWrapper::SPACE_DIM; i < SMPLWrapper::POSE_SIZE; i++)
-        for (int j = SMPLWrapper::SPACE_DIM; j < SMPLWrapper::POSE_SIZE; j++)
-            inFile >> pose_stiffness_(i, j);
+    accumulateNormalEquations_(SHAPE_SIZE, residual_grads, residuals,
+        [&](int v, int * params, double * values)
+    {
+        // the vertex depends on every shape parameter
+        for (int i = 0; i < SHAPE_SIZE; ++i)
+            params[i] = i;
 
-    inFile.close();
+        E::Map<E::Matrix<double, SPACE_DIM, SHAPE_SIZE>> vertex_jac(values);
+        if (pose != nullptr)
+        {
+            E::Matrix<double, SPACE_DIM, SHAPE_SIZE> posed_vertex_jac;
+            calcVertexShapeJac_(v, lbs_translations_jac, workspace, posed_vertex_jac);
+            vertex_jac = posed_vertex_jac;
+        }
+        else
+            for (int i = 0; i < SHAPE_SIZE; ++i)
+                vertex_jac.col(i) = model_->getShapeDiff(i).row(v).transpose();
+        return (int)SHAPE_SIZE;
+    }, workspace, out);
 }
 
-void SMPLWrapper::readJointNames_()
+std::vector<E::MatrixXd> SMPLWrapper::calcModelBatch(const std::vector<State> & states) const
 {
-    std::string file_name(this->general_path_);
-    file_name += "joint_names.txt";
-
-    std::fstream inFile;
-    inFile.open(file_name, std::ios_base::in);
-    int joints_n;
-    inFile >> joints_n;
-    // Sanity check
-    if (joints_n != JOINTS_NUM)
+    for (const State& state : states)
     {
-        throw std::invalid_argument("Number of joint names specified doesn't match current SMPLWrapper settings");
+        if (state.pose.rows() != JOINTS_NUM || state.pose.cols() != SPACE_DIM
+            || state.shape.size() != SHAPE_SIZE || state.translation.size() != SPACE_DIM
+            || (state.displacements.size() != 0
+                && (state.displacements.rows() != VERTICES_NUM || state.displacements.cols() != SPACE_DIM)))
+            throw std::invalid_argument("SMPLWrapper::ERROR::the state of the batch has wrong parameter sizes");
     }
 
-    std::string joint_name;
-    int jointId;
-    for (int i = 0; i < joints_n; i++)
+    std::vector<E::MatrixXd> out(states.size());
+    for (int batch_begin = 0; batch_begin < (int)states.size(); batch_begin += MODEL_BATCH_SIZE)
     {
-        inFile >> joint_name;
-        inFile >> jointId;
-        joint_names_.insert(DictEntryInt(joint_name, jointId));
+        const int batch_size = std::min((int)states.size() - batch_begin, MODEL_BATCH_SIZE);
+        calcModelSubBatch_(states.data() + batch_begin, batch_size, out.data() + batch_begin);
     }
 
-    inFile.close();
+    return out;
 }
 
-void SMPLWrapper::readShapes_()
+E::MatrixXd SMPLWrapper::calcVertexNormals(const E::MatrixXd * verts) const
 {
-    std::string file_path = gender_path_ + gender_ + "_blendshape/shape";
+    E::MatrixXd normals;
+    calcVertexNormals(*verts, normals);
 
-    Eigen::MatrixXi fakeFaces(SMPLWrapper::VERTICES_NUM, SMPLWrapper::SPACE_DIM);
+    return normals;
+}
 
-    for (int i = 0; i < SMPLWrapper::SHAPE_SIZE; i++)
-    {
-        std::string file_name(file_path);
-        file_name += std::to_string(i);
-        file_name += ".obj";
+void SMPLWrapper::calcVertexNormals(const E::MatrixXd & verts, E::MatrixXd & normals) const
+{
+    if (use_single_precision_)
+        calcVertexNormals_<float>(verts, normals);
+    else
+        calcVertexNormals_<double>(verts, normals);
+}
 
-        igl::readOBJ(file_name, shape_diffs_[i], fakeFaces);
+E::MatrixXd SMPLWrapper::calcModel()
+{
+    return calcModel(&state_.translation, &state_.pose, &state_.shape, &state_.displacements);
+}
 
-        shape_diffs_[i] -= verts_template_;
-    }
+E::MatrixXd SMPLWrapper::calcJointLocations()
+{
+    return calcJointLocations_(workspace_, &state_.translation, &state_.shape, &state_.pose);
 }
 
-void SMPLWrapper::readPoseBlendshapes_()
+void SMPLWrapper::saveToObj(const std::string filename) 
 {
-    std::string file_path = gender_path_ + gender_ + "_pose_blendshapes/Pose";
+    saveToObj_(&state_.translation, &state_.pose, &state_.shape, nullptr, filename);
+}
 
-    Eigen::MatrixXi fakeFaces(SMPLWrapper::VERTICES_NUM, SMPLWrapper::SPACE_DIM);
+void SMPLWrapper::saveWithDisplacementToObj(const std::string filename)
+{
+    saveToObj_(&state_.translation, &state_.pose, &state_.shape, &state_.displacements, filename);
+}
 
-    for (int i = 0; i < SMPLWrapper::POSE_BLENDSHAPES_NUM; i++)
-    {
-        std::string file_name(file_path);
-        std::string id_str = std::to_string(i);
-        file_name += std::string(3 - id_str.size(), '0') + id_str;
-        file_name += ".obj";
+void SMPLWrapper::savePosedOnlyToObj(const std::string filename) 
+{
+    saveToObj_(&state_.translation, &state_.pose, nullptr, nullptr, filename);
+}
 
-        igl::readOBJ(file_name, pose_diffs_[i], fakeFaces);
+void SMPLWrapper::saveShapedOnlyToObj(const std::string filename) 
+{
+    saveToObj_(&state_.translation, nullptr, &state_.shape, nullptr, filename);
+}
 
-        pose_diffs_[i] -= verts_template_;
-    }
+void SMPLWrapper::saveShapedWithDisplacementToObj(const std::string filename)
+{
+    saveToObj_(&state_.translation, nullptr, &state_.shape, &state_.displacements, filename);
 }
 
-void SMPLWrapper::readWeights_()
+void SMPLWrapper::logParameters(const std::string filename)
 {
-    std::string file_name(this->gender_path_);
-    file_name += this->gender_;
-    file_name += "_weight.txt";
+    std::ofstream out(filename);
 
-    std::fstream inFile;
-    inFile.open(file_name, std::ios_base::in);
-    int joints_n, verts_n;
-    inFile >> joints_n;
-    inFile >> verts_n;
-    // Sanity check
-    if (joints_n != SMPLWrapper::JOINTS_NUM || verts_n != SMPLWrapper::VERTICES_NUM)
-        throw std::invalid_argument("Weights info (number of joints and vertices) is incompatible with the model");
+    out << "Translation [ " << std::endl;
+    for (int i = 0; i < SMPLWrapper::SPACE_DIM; i++)
+        out << state_.translation[i] << " , ";
+    out << std::endl << "]" << std::endl;
 
-    std::vector<E::Triplet<double>> tripletList;
-    tripletList.reserve(verts_n * SMPLWrapper::WEIGHTS_BY_VERTEX);     // for faster filling performance
-    double tmp;
-    for (int i = 0; i < verts_n; i++)
+    out << "Pose params [ \n";
+    for (int i = 0; i < SMPLWrapper::JOINTS_NUM; i++)
     {
-        for (int j = 0; j < joints_n; j++)
+        for (int j = 0; j < SMPLWrapper::SPACE_DIM; j++)
         {
-            inFile >> tmp;
-            if (tmp > 0.00001)  // non-zero weight
-                tripletList.push_back(E::Triplet<double>(i, j, tmp));
+            out << state_.pose(i, j) << " , ";
         }
+        out << std::endl;
     }
-    this->weights_.resize(verts_n, joints_n);
-    this->weights_.setFromTriplets(tripletList.begin(), tripletList.end());
-
-#ifdef DEBUG
-    std::cout << "Weight sizes " << this->weights_.outerSize() << " " << this->weights_.innerSize() << std::endl;
-#endif // DEBUG
-
-    inFile.close();
-}
+    out << "]" << std::endl;
 
-void SMPLWrapper::readHierarchy_()
-{
-    std::string file_name(this->general_path_);
-    file_name += "jointsHierarchy.txt";
+    out << "Shape (betas) params [ " << std::endl;
+    for (int i = 0; i < SMPLWrapper::SHAPE_SIZE; i++)
+        out << state_.shape[i] << " , ";
+    out << std::endl << "]" << std::endl;
 
-    std::fstream inFile;
-    inFile.open(file_name, std::ios_base::in);
-    int joints_n;
-    inFile >> joints_n;
-    // Sanity check
-    if (joints_n != SMPLWrapper::JOINTS_NUM)
-    {
-        throw std::invalid_argument("Number of joints in joints hierarchy info is incompatible with the model");
-    }
-    
-    int tmpId;
-    for (int j = 0; j < joints_n; j++)
-    {
-        inFile >> tmpId;
-        inFile >> joints_parents_[tmpId];
-    }
+    out << "Joints locations for posed and shaped model [" << std::endl;
+    out << calcJointLocations() << std::endl;
+    out << "]" << std::endl;
 
-    inFile.close();
+    out.close();
 }
 
-void SMPLWrapper::fillVertsNeighbours_()
-{
-    for (int face_id = 0; face_id < faces_.rows(); face_id++)
-    {
-        for (int corner_id = 0; corner_id < faces_.cols(); corner_id++)
-        {
-            int vert_id = faces_(face_id, corner_id);
-            for (int shift = 1; shift < faces_.cols(); shift++)
-            {
-                int neighbour_vert_id = faces_(face_id, (corner_id + shift) % faces_.cols());
-                // add if new
-                if (std::find(verts_neighbours_[vert_id].begin(), verts_neighbours_[vert_id].end(), neighbour_vert_id)
-                    == verts_neighbours_[vert_id].end())
-                {
-                    verts_neighbours_[vert_id].push_back(neighbour_vert_id);
-                }
-            }
-        }
-    }
-}
+/// PRIVATE
 
 void SMPLWrapper::saveToObj_(const E::VectorXd* translation, const ERMatrixXd * pose,
  const E::VectorXd* shape,
@@ -567,7 +691,7 @@ void SMPLWrapper::saveToObj_(const E::VectorXd* translation, const ERMatrixXd *
 {
     E::MatrixXd verts = calcModel(translation, pose, shape, displacements);
 
-    igl::writeOBJ(filename, verts, faces_);
+    igl::writeOBJ(filename, verts, model_->getFaces());
 }
 
 E::Vector3d SMPLWrapper::angle_axis_(const E::Vector3d& from, const E::Vector3d& to)
@@ -630,13 +754,13 @@ E::Vector3d SMPLWrapper::combine_two_angle_axis_(const E::Vector3d& first, const
 }
 
 void SMPLWrapper::assignJointGlobalRotation_(int joint_id, E::VectorXd rotation, 
-    const EHomoCoordMatrix(&fk_transform)[SMPLWrapper::JOINTS_NUM])
+    const ERigidTransform(&fk_transform)[SMPLWrapper::JOINTS_NUM])
 {
     Eigen::Vector3d rotation_local;
     if (joint_id > 0)
     {
-        Eigen::MatrixXd joint_inverse_rotation =
-            fk_transform[joint_id].block(0, 0, SPACE_DIM, SPACE_DIM).transpose();
+        Eigen::Matrix3d joint_inverse_rotation =
+            fk_transform[joint_id].leftCols<SPACE_DIM>().transpose();
 
         rotation_local = joint_inverse_rotation * rotation;
     }
@@ -648,165 +772,497 @@ void SMPLWrapper::assignJointGlobalRotation_(int joint_id, E::VectorXd rotation,
     state_.pose.row(joint_id) = rotation_local;
 }
 
-void SMPLWrapper::shapeSMPL_(const E::VectorXd& shape, E::MatrixXd &verts, E::MatrixXd* shape_jac)
+void SMPLWrapper::shapeSMPL_(const E::VectorXd& shape, E::MatrixXd &verts) const
 {
 #ifdef DEBUG
     std::cout << "shape (analytic)" << std::endl;
 #endif // DEBUG
-    for (int i = 0; i < SHAPE_SIZE; i++)
+    parallelForVertices_((int)verts.rows(), [&](int chunk_begin, int chunk_end)
     {
-        verts += shape[i] * shape_diffs_[i];
-    }
+        const int chunk_verts = chunk_end - chunk_begin;
+        for (int i = 0; i < SHAPE_SIZE; i++)
+            verts.middleRows(chunk_begin, chunk_verts) += shape[i] * model_->getShapeDiff(i).middleRows(chunk_begin, chunk_verts);
+    });
+}
 
-    if (shape_jac != nullptr)
+void SMPLWrapper::updateShapedRest_(const E::VectorXd* shape, Workspace & workspace) const
+{
+    // template + 0 * shape_diff is exactly the template, so nullptr and zero shape share the memoized stage
+    const bool is_fresh = workspace.shaped_for.size() == SHAPE_SIZE
+        && (shape != nullptr ? workspace.shaped_for == *shape : (workspace.shaped_for.array() == 0.).all());
+    if (is_fresh)
+        return;
+
+    workspace.shaped_verts = model_->getTemplateVertices();
+    if (shape != nullptr)
     {
-        for (int i = 0; i < SHAPE_SIZE; i++)
-        {
-            shape_jac[i] = shape_diffs_[i];
-        }
+        shapeSMPL_(*shape, workspace.shaped_verts);
+        model_->calcShapedJointLocations(*shape, workspace.shaped_joints);
+        workspace.shaped_for = *shape;
     }
+    else
+    {
+        workspace.shaped_joints = model_->getTemplateJointLocations();
+        workspace.shaped_for.setZero(SHAPE_SIZE);
+    }
+    ++workspace.shape_version;
 }
 
-void SMPLWrapper::poseSMPL_(const ERMatrixXd& pose, E::MatrixXd & verts,
-    const ERMatrixXd *displacement, E::MatrixXd * pose_jac, bool use_previous_pose_matrix)
+void SMPLWrapper::updatePoseTransforms_(const ERMatrixXd& pose, Workspace & workspace, bool calc_derivatives) const
 {
-    // TODO make sure we don't end up with empty pose jac when reusing pose
-    if (!use_previous_pose_matrix)
+    const bool is_fresh = workspace.transforms_valid
+        && workspace.transforms_for_shape_version == workspace.shape_version
+        && (workspace.transforms_with_jac || !calc_derivatives)
+        && workspace.transforms_for_pose.rows() == pose.rows() && workspace.transforms_for_pose.cols() == pose.cols()
+        && workspace.transforms_for_pose == pose;
+    if (is_fresh)
+        return;
+
+    workspace.joint_locations = workspace.shaped_joints;
+    updateJointsFKTransforms_(pose, workspace.joint_locations, workspace, calc_derivatives);
+    updateLBSTransforms_(workspace.joint_locations, workspace, calc_derivatives);
+
+    workspace.transforms_for_pose = pose;
+    workspace.transforms_for_shape_version = workspace.shape_version;
+    workspace.transforms_with_jac = calc_derivatives;
+    workspace.transforms_valid = true;
+}
+
+void SMPLWrapper::updateLBSTransforms_(const E::MatrixXd & t_pose_joints_locations, Workspace & workspace, 
+    bool calc_derivatives) const
+{
+    extractLBSJointTransformFromFKTransform_(workspace.fk_transforms, t_pose_joints_locations, workspace.lbs_transforms);
+    for (int j = 0; j < JOINTS_NUM; j++)
+        workspace.lbs_transforms_single[j] = workspace.lbs_transforms[j].cast<float>();
+
+    // get blendshape deritatives w.r.t. every pose parameter
+    if (use_pose_blendshapes_ && calc_derivatives)
+        calcPoseBlendshapesJac_(workspace.local_rotations_jac, workspace.blendshapes_derivatives);
+}
+
+template<typename Scalar, bool PoseBlendshapes, bool WithPoseJac>
+void SMPLWrapper::poseSMPL_(EMatrixX<Scalar> & verts,
+    const ERMatrixXd *displacement, Workspace & workspace, PoseJacobian * pose_jac) const
+{
+    assert((!WithPoseJac || workspace.transforms_with_jac)
+        && "Pose matrices were calculated without derivatives");
+
+    // Apply pose blendshapes
+    if (PoseBlendshapes)
+        addPoseBlendshapes_(workspace.local_rotations, verts);
+
+    // jacobian needs the vertices in the rest pose => before verts are posed
+    if (WithPoseJac)
+        calcPoseJac_<PoseBlendshapes>(asDouble(verts, workspace.rest_verts), displacement, workspace, *pose_jac);
+
+    // displaced and posed
+    skinVertices_<Scalar>(lbsTransforms_<Scalar>(workspace), verts, displacement, Scalar(1), verts);
+}
+
+template<bool PoseBlendshapes>
+void SMPLWrapper::calcPoseJac_(const E::MatrixXd & verts, const ERMatrixXd * displacement,
+    const Workspace & workspace, PoseJacobian & pose_jac) const
+{
+    const int n_verts = (int)verts.rows();
+
+    // structure
+    pose_jac.offsets.resize(n_verts + 1);
+    pose_jac.offsets[0] = 0;
+    for (int v = 0; v < n_verts; ++v)
     {
-        // ! Impostant: don't use displacements to obtain joint_locations. 
-        // jointRegressor was only trained on the model data
-        joint_locations_ = jointRegressorMat_ * verts;
-        updateJointsFKTransforms_(pose, joint_locations_, pose_jac != nullptr);
+        int active_joints = 0;
+        for (std::uint32_t mask = vertexPoseMask_<PoseBlendshapes>(v); mask != 0; mask &= mask - 1)
+            ++active_joints;
+        pose_jac.offsets[v + 1] = pose_jac.offsets[v] + active_joints * SPACE_DIM;
     }
+    pose_jac.params.resize(pose_jac.offsets[n_verts]);
+    pose_jac.values.resize(pose_jac.offsets[n_verts], SPACE_DIM);
 
-    E::MatrixXd joints_global_transform = extractLBSJointTransformFromFKTransform_(
-        fk_transforms_, joint_locations_,
-        &fk_derivatives_, pose_jac);
+    E::Matrix3d rotation_jacs[POSE_SIZE];
+    calcRotationJacs_(workspace, rotation_jacs);
 
-    // Apply pose blendshapes
-    if (use_pose_blendshapes_)
+    parallelForVertices_(n_verts, [&](int chunk_begin, int chunk_end)
     {
-        addPoseBlendshapes_(local_rotations_, verts);
-        // get blendshape deritatives w.r.t. every pose parameter
-        if (pose_jac != nullptr && !use_previous_pose_matrix)   // if the pose is reused, we can use previous derivatives
+        for (int v = chunk_begin; v < chunk_end; ++v)
         {
-            calcPoseBlendshapesJac_(local_rotations_jac_, blendshapes_derivatives_);
+            E::Vector3d rest_point = verts.row(v).transpose();
+            if (displacement != nullptr)
+                rest_point += displacement->row(v).transpose();
+
+            // values are row-major => the entries of the vertex are contiguous
+            const int entry = pose_jac.offsets[v];
+            calcVertexPoseJac_<PoseBlendshapes>(v, rest_point, rotation_jacs, workspace,
+                pose_jac.params.data() + entry, pose_jac.values.data() + entry * SPACE_DIM);
         }
+    });
+}
 
+void SMPLWrapper::calcRotationJacs_(const Workspace & workspace, E::Matrix3d (&rotation_jacs)[POSE_SIZE])
+{
+    for (int joint = 0; joint < JOINTS_NUM; ++joint)
+    {
+        const E::Matrix3d inverse_rotation = workspace.fk_transforms[joint].leftCols<SPACE_DIM>().inverse();
+        for (int dim = 0; dim < SPACE_DIM; ++dim)
+        {
+            const int pose_param = joint * SPACE_DIM + dim;
+            rotation_jacs[pose_param].noalias() = 
+                workspace.fk_derivatives[joint * POSE_SIZE + pose_param].leftCols<SPACE_DIM>() * inverse_rotation;
+        }
     }
+}
 
-    // LBS Matrix
-    E::SparseMatrix<double> LBSMat;
-    if (displacement != nullptr)
-        LBSMat = getLBSMatrix_(verts + *displacement);
-    else
-        LBSMat = getLBSMatrix_(verts);
+template<bool PoseBlendshapes>
+int SMPLWrapper::calcVertexPoseJac_(int vert_id, const E::Vector3d & rest_point, 
+    const E::Matrix3d (&rotation_jacs)[POSE_SIZE], const Workspace & workspace, int * params, double * values) const
+{
+    const SkinningTable& skinning = model_->getSkinningTable();
+    const E::Vector4d point(rest_point(0), rest_point(1), rest_point(2), 1.);
+
+    // The rotation of the joint a moves every point q skinned by a's descendant as 
+    // d(q) / d(pose_a_dim) = d(fk_a) * fk_a^-1 * (q - a_location) = rotation_jacs[a_dim] * (q - a_location)
+    // => the contribution of all the influences is one product with their partial blend (the arm)
+    E::Vector3d posed[WEIGHTS_BY_VERTEX];
+    std::uint32_t influence_ancestors[WEIGHTS_BY_VERTEX];
+    for (int k = 0; k < WEIGHTS_BY_VERTEX; ++k)
+    {
+        const int joint_id = skinning.joint_ids(vert_id, k);
+        posed[k].noalias() = workspace.lbs_transforms[joint_id].topRows<SPACE_DIM>() * point;
+        influence_ancestors[k] = skinning.weights(vert_id, k) != 0. ? model_->getJointAncestorsMask(joint_id) : 0u;
+    }
 
-    // displaced and posed
-    verts = LBSMat * joints_global_transform;
+    // Pose blendshapes offsets are directions => only rotated by the blended transform
+    const E::Matrix3d blended_rotation = PoseBlendshapes ? blendedRotation_(vert_id, workspace) : E::Matrix3d::Zero();
+    const E::MatrixXd& blendshapes_derivatives = workspace.blendshapes_derivatives;
 
-    if (pose_jac != nullptr)
+    int entry = 0;
+    std::uint32_t mask = vertexPoseMask_<PoseBlendshapes>(vert_id);
+    for (int joint = 0; mask != 0; ++joint, mask >>= 1)
     {
-        // pose_jac[pose_component] at this point has the same structure as jointsTransformation
-        for (int pose_component = 0; pose_component < SMPLWrapper::POSE_SIZE; ++pose_component)
-        {
-            // Rotational component
-            pose_jac[pose_component].applyOnTheLeft(LBSMat);
+        if (!(mask & 1u))
+            continue;
 
-            // Pose blendshapes component
-            if (use_pose_blendshapes_)
+        // Rotational component: only the influences that are the descendants of the rotated joint
+        E::Vector3d arm = E::Vector3d::Zero();
+        double arm_weight = 0.;
+        for (int k = 0; k < WEIGHTS_BY_VERTEX; ++k)
+        {
+            if (influence_ancestors[k] & (1u << joint))
             {
-                E::SparseMatrix<double> blendshape_LBSMat = getLBSMatrix_(blendshapes_derivatives_[pose_component]);
-                pose_jac[pose_component] += blendshape_LBSMat * joints_global_transform;
+                arm += skinning.weights(vert_id, k) * posed[k];
+                arm_weight += skinning.weights(vert_id, k);
             }
         }
+        arm -= arm_weight * workspace.fk_transforms[joint].col(SPACE_DIM);
+
+        for (int dim = 0; dim < SPACE_DIM; ++dim, ++entry)
+        {
+            const int pose_param = joint * SPACE_DIM + dim;
+            E::Map<E::Vector3d> derivative(values + entry * SPACE_DIM);
+            derivative.noalias() = rotation_jacs[pose_param] * arm;
+
+            // Pose blendshapes component
+            if (PoseBlendshapes)
+                derivative += blended_rotation * E::Vector3d(
+                    blendshapes_derivatives(vert_id, pose_param),
+                    blendshapes_derivatives(VERTICES_NUM + vert_id, pose_param),
+                    blendshapes_derivatives(2 * VERTICES_NUM + vert_id, pose_param));
+
+            params[entry] = pose_param;
+        }
     }
+
+    return entry;
 }
 
-void SMPLWrapper::translate_(const E::VectorXd& translation, E::MatrixXd & verts)
+void SMPLWrapper::calcShapeJac_(const Workspace & workspace, ERMatrixXd * shape_jac) const
 {
-    verts.rowwise() += translation.transpose();
+    E::Vector3d lbs_translations_jac[JOINTS_NUM][SHAPE_SIZE];
+    calcLBSTranslationsShapeJac_(workspace, lbs_translations_jac);
 
-    // Jac w.r.t. translation is identity: dv_i / d_tj == 1 
+    shape_jac->resize(VERTICES_NUM * SPACE_DIM, SHAPE_SIZE);
+
+    parallelForVertices_(VERTICES_NUM, [&](int chunk_begin, int chunk_end)
+    {
+        E::Matrix<double, SPACE_DIM, SHAPE_SIZE> vertex_jac;
+        for (int v = chunk_begin; v < chunk_end; ++v)
+        {
+            calcVertexShapeJac_(v, lbs_translations_jac, workspace, vertex_jac);
+            shape_jac->middleRows<SPACE_DIM>(v * SPACE_DIM) = vertex_jac;
+        }
+    });
 }
 
-void SMPLWrapper::addJointPoseBlendshape_(const int blendshape_id_offset, const E::MatrixXd & coeff, E::MatrixXd & verts)
+void SMPLWrapper::calcLBSTranslationsShapeJac_(const Workspace & workspace,
+    E::Vector3d (&lbs_translations_jac)[JOINTS_NUM][SHAPE_SIZE]) const
 {
-    for (int col = 0; col < coeff.cols(); col++)
+    const E::MatrixXd& joint_shape_basis = model_->getJointShapeBasis();
+    const ERigidTransform (&fk_transforms)[JOINTS_NUM] = workspace.fk_transforms;
+
+    // The shape moves the t-pose joints => the translations of the lbs transforms change:
+    // d(lbs_j translation) = d(posed joint location) - R_j * d(t-pose joint location), 
+    // where the posed location follows the FK formula: d(t_j) = R_parent * (d(J_j) - d(J_parent)) + d(t_parent)
+    E::Vector3d posed_joints_jac[JOINTS_NUM][SHAPE_SIZE];
+    for (int joint_id = 0; joint_id < JOINTS_NUM; ++joint_id)
     {
-        for (int row = 0; row < coeff.rows(); row++)
+        const int parent_id = model_->getJointParent(joint_id);
+        for (int i = 0; i < SHAPE_SIZE; ++i)
         {
-            int blendshape_id = blendshape_id_offset + row * coeff.cols() + col;
-            if (blendshape_id >= POSE_BLENDSHAPES_NUM)
-                throw std::out_of_range("Error::applyPoseBlendshapes::requested non-existing blendshape id");
-            verts += coeff(row, col) * pose_diffs_[blendshape_id];
+            const E::Vector3d t_pose_joint_jac = joint_shape_basis.block<1, SPACE_DIM>(joint_id, i * SPACE_DIM).transpose();
+            if (joint_id == 0)
+                posed_joints_jac[joint_id][i] = t_pose_joint_jac;
+            else
+                posed_joints_jac[joint_id][i] = posed_joints_jac[parent_id][i] + fk_transforms[parent_id].leftCols<SPACE_DIM>() 
+                    * (t_pose_joint_jac - joint_shape_basis.block<1, SPACE_DIM>(parent_id, i * SPACE_DIM).transpose());
+
+            lbs_translations_jac[joint_id][i] = posed_joints_jac[joint_id][i] 
+                - fk_transforms[joint_id].leftCols<SPACE_DIM>() * t_pose_joint_jac;
         }
     }
 }
 
-void SMPLWrapper::addPoseBlendshapes_(const E::MatrixXd local_rotations[SMPLWrapper::JOINTS_NUM], E::MatrixXd & verts)
+void SMPLWrapper::calcVertexShapeJac_(int vert_id, const E::Vector3d (&lbs_translations_jac)[JOINTS_NUM][SHAPE_SIZE],
+    const Workspace & workspace, E::Matrix<double, SPACE_DIM, SHAPE_SIZE> & vertex_jac) const
 {
-    // no pose blendshapes for root
-    for (int joint = 1; joint < JOINTS_NUM; joint++)
+    // blendshapes are directions => only rotated by the blended transform
+    const SkinningTable& skinning = model_->getSkinningTable();
+    const E::Matrix3d blended_rotation = blendedRotation_(vert_id, workspace);
+    for (int i = 0; i < SHAPE_SIZE; ++i)
     {
-        // substact T-pose rotation
-        E::MatrixXd coeff = local_rotations[joint] - E::MatrixXd::Identity(SPACE_DIM, SPACE_DIM);
-
-        addJointPoseBlendshape_((joint - 1) * SPACE_DIM * SPACE_DIM, coeff, verts);
+        const SMPLModel::ConstMatrixMap& shape_diff = model_->getShapeDiff(i);
+        vertex_jac.col(i).noalias() = blended_rotation 
+            * E::Vector3d(shape_diff(vert_id, 0), shape_diff(vert_id, 1), shape_diff(vert_id, 2));
+        for (int k = 0; k < WEIGHTS_BY_VERTEX; ++k)
+            vertex_jac.col(i) += skinning.weights(vert_id, k) * lbs_translations_jac[skinning.joint_ids(vert_id, k)][i];
     }
 }
 
-void SMPLWrapper::calcPoseBlendshapesJac_(const E::MatrixXd local_rotations_jac[SMPLWrapper::POSE_SIZE],
-    E::MatrixXd * blendshapes_jac)
+template<typename VertexJacobian>
+void SMPLWrapper::accumulateNormalEquations_(int params_num, const E::MatrixXd & residual_grads, 
+    const E::VectorXd & residuals, const VertexJacobian & vertex_jac, Workspace & workspace, NormalEquations & out) const
 {
-    // initialize jac w.r.t. root to zero 
-    for (int dim = 0; dim < SPACE_DIM; dim++)
+    if (residual_grads.rows() != VERTICES_NUM || residual_grads.cols() != SPACE_DIM || residuals.size() != VERTICES_NUM)
+        throw std::invalid_argument("SMPLWrapper::ERROR::residuals and their gradients should be given for every vertex");
+
+    // the chunks don't depend on the number of threads => the same sums for any thread count
+    // small enough for the product blocking of the rank update to stay on the stack (no heap allocation)
+    const int chunk_size = 128;
+    const int chunks_num = ThreadPool::chunksNum(0, VERTICES_NUM, chunk_size);
+    // sized for the largest parameter set, so that the pose and shape passes share the buffers without re-allocation
+    std::vector<NormalEquations>& chunk_sums = workspace.chunk_sums;
+    if ((int)chunk_sums.size() != chunks_num)
     {
-        blendshapes_jac[0 + dim].setZero(VERTICES_NUM, SPACE_DIM);
+        chunk_sums.resize(chunks_num);
+        workspace.chunk_jacs.resize(chunks_num);
+        workspace.chunk_residuals.resize(chunks_num);
+        for (int chunk = 0; chunk < chunks_num; ++chunk)
+        {
+            chunk_sums[chunk].JtJ.resize(POSE_SIZE, POSE_SIZE);
+            chunk_sums[chunk].Jtr.resize(POSE_SIZE);
+            workspace.chunk_jacs[chunk].resize(chunk_size, POSE_SIZE);
+            workspace.chunk_residuals[chunk].resize(chunk_size);
+        }
     }
 
-    // the rest of the joints
-    for (int joint = 1; joint < JOINTS_NUM; joint++)
+    threadPool_()->parallelFor(0, VERTICES_NUM, chunk_size,
+        [&](int chunk, int chunk_begin, int chunk_end)
     {
-        int blendshape_id_offset = (joint - 1) * SPACE_DIM * SPACE_DIM;
-        for (int dim = 0; dim < SPACE_DIM; dim++)
+        // residual jacobian rows of the chunk are gathered densely => one rank update per chunk
+        auto chunk_jac = workspace.chunk_jacs[chunk].leftCols(params_num);
+        E::VectorXd& chunk_residuals = workspace.chunk_residuals[chunk];
+        chunk_jac.setZero();
+        int rows = 0;
+
+        int params[POSE_SIZE];
+        double values[POSE_SIZE * SPACE_DIM];
+        for (int v = chunk_begin; v < chunk_end; ++v)
         {
-            int param_id = joint * SPACE_DIM + dim;
-            blendshapes_jac[param_id].setZero(VERTICES_NUM, SPACE_DIM);
+            const E::Vector3d residual_grad = residual_grads.row(v).transpose();
+            if (residual_grad.isZero(0.))
+                continue;
+
+            // d residual_v / d params: only the entries of the vertex are non-zero
+            const int entries = vertex_jac(v, params, values);
+            for (int e = 0; e < entries; ++e)
+                chunk_jac(rows, params[e]) = residual_grad.dot(E::Map<const E::Vector3d>(values + e * SPACE_DIM));
+            chunk_residuals(rows) = residuals(v);
+            ++rows;
+        }
 
-            // apply pose blendshapes with rotations
-            addJointPoseBlendshape_(blendshape_id_offset,
-                local_rotations_jac[param_id],         // 
-                blendshapes_jac[param_id]);
+        auto JtJ = chunk_sums[chunk].JtJ.topLeftCorner(params_num, params_num);
+        auto Jtr = chunk_sums[chunk].Jtr.head(params_num);
+        JtJ.setZero();
+        Jtr.setZero();
+        if (rows > 0)
+        {
+            JtJ.selfadjointView<E::Upper>().rankUpdate(chunk_jac.topRows(rows).transpose());
+            Jtr.noalias() = chunk_jac.topRows(rows).transpose() * chunk_residuals.head(rows);
         }
+    });
+
+    out.JtJ.setZero(params_num, params_num);
+    out.Jtr.setZero(params_num);
+    for (const NormalEquations& chunk_sum : chunk_sums)
+    {
+        out.JtJ += chunk_sum.JtJ.topLeftCorner(params_num, params_num);
+        out.Jtr += chunk_sum.Jtr.head(params_num);
     }
+    out.JtJ.triangularView<E::StrictlyLower>() = out.JtJ.transpose();
 }
 
-E::MatrixXd SMPLWrapper::calcJointLocations_(const E::VectorXd* translation,
-    const E::VectorXd* shape, const ERMatrixXd * pose)
+void SMPLWrapper::calcDisplacementJac_(const Workspace & workspace, ERMatrixXd * displacement_jac) const
 {
-    E::MatrixXd joint_locations;
+    displacement_jac->resize(VERTICES_NUM * SPACE_DIM, SPACE_DIM);
 
-    if (joint_locations_template_.size() > 0)
+    // displacement is added in the rest pose => only rotated by the blended transform
+    parallelForVertices_(VERTICES_NUM, [&](int chunk_begin, int chunk_end)
     {
-        joint_locations = joint_locations_template_;
+        for (int v = chunk_begin; v < chunk_end; ++v)
+            displacement_jac->middleRows<SPACE_DIM>(v * SPACE_DIM) = blendedRotation_(v, workspace);
+    });
+}
+
+E::Matrix3d SMPLWrapper::blendedRotation_(int vert_id, const Workspace & workspace) const
+{
+    const SkinningTable& skinning = model_->getSkinningTable();
+    E::Matrix3d blended_rotation = E::Matrix3d::Zero();
+    for (int k = 0; k < WEIGHTS_BY_VERTEX; ++k)
+        blended_rotation += skinning.weights(vert_id, k)
+            * workspace.lbs_transforms[skinning.joint_ids(vert_id, k)].topLeftCorner<SPACE_DIM, SPACE_DIM>();
+
+    return blended_rotation;
+}
+
+template<bool PoseBlendshapes>
+std::uint32_t SMPLWrapper::vertexPoseMask_(int vert_id) const
+{
+    const SkinningTable& skinning = model_->getSkinningTable();
+    std::uint32_t mask = 0;
+    for (int k = 0; k < WEIGHTS_BY_VERTEX; ++k)
+        if (skinning.weights(vert_id, k) != 0.)
+            mask |= model_->getJointAncestorsMask(skinning.joint_ids(vert_id, k));
+    if (PoseBlendshapes)
+        mask |= model_->getVertexPoseBlendshapesMask(vert_id);
+
+    return mask;
+}
+
+template<typename Scalar>
+void SMPLWrapper::calcVertexNormals_(const E::MatrixXd & verts, E::MatrixXd & normals) const
+{
+    // The face cross product is the unit normal scaled by the double area =>
+    // the sum over the adjacent faces is the area-weighted normal of igl::per_vertex_normals()
+    using Point = E::Matrix<Scalar, 1, SPACE_DIM>;
+    const E::MatrixXi& faces = model_->getFaces();
+    normals.setZero(verts.rows(), SPACE_DIM);
+    for (int f = 0; f < faces.rows(); ++f)
+    {
+        const Point v0 = verts.row(faces(f, 0)).cast<Scalar>();
+        const Point edge_1 = verts.row(faces(f, 1)).cast<Scalar>() - v0;
+        const Point edge_2 = verts.row(faces(f, 2)).cast<Scalar>() - v0;
+        const E::RowVector3d face_normal = edge_1.cross(edge_2).template cast<double>();
+        for (int corner = 0; corner < 3; ++corner)
+            normals.row(faces(f, corner)) += face_normal;
     }
-    else
+    for (int v = 0; v < normals.rows(); ++v)
+        normals.row(v).normalize();
+}
+
+template<typename Scalar>
+void SMPLWrapper::translate_(const E::VectorXd& translation, EMatrixX<Scalar> & verts) const
+{
+    const E::Matrix<Scalar, 1, SPACE_DIM> shift = translation.transpose().cast<Scalar>();
+    parallelForVertices_((int)verts.rows(), [&](int chunk_begin, int chunk_end)
     {
-        joint_locations = jointRegressorMat_ * verts_template_normalized_;
+        verts.middleRows(chunk_begin, chunk_end - chunk_begin).rowwise() += shift;
+    });
+
+    // Jac w.r.t. translation is identity: dv_i / d_tj == 1 
+}
+
+template<typename Scalar>
+void SMPLWrapper::addPoseBlendshapes_(const E::Matrix3d local_rotations[SMPLWrapper::JOINTS_NUM], EMatrixX<Scalar> & verts) const
+{
+    // blendshape_id = (joint - 1) * 9 + row * 3 + col
+    E::Matrix<Scalar, POSE_BLENDSHAPES_NUM, 1> coeffs;
+
+    // no pose blendshapes for root
+    for (int joint = 1; joint < JOINTS_NUM; joint++)
+    {
+        const int blendshape_id_offset = (joint - 1) * SPACE_DIM * SPACE_DIM;
+        for (int row = 0; row < SPACE_DIM; row++)
+        {
+            for (int col = 0; col < SPACE_DIM; col++)
+            {
+                // substact T-pose rotation
+                coeffs(blendshape_id_offset + row * SPACE_DIM + col) = 
+                    Scalar(local_rotations[joint](row, col) - (row == col ? 1. : 0.));
+            }
+        }
     }
 
-    if (shape != nullptr)
+    // matrix-vector product over the whole basis, split by the vertex chunks: 
+    // the basis rows are flattened as the vertex matrix => a row block per coordinate
+    const E::Map<const EMatrixX<Scalar>> pose_basis = poseBasis_<Scalar>();
+    parallelForVertices_(VERTICES_NUM, [&](int chunk_begin, int chunk_end)
+    {
+        const int chunk_verts = chunk_end - chunk_begin;
+        for (int axis = 0; axis < SPACE_DIM; axis++)
+            verts.col(axis).segment(chunk_begin, chunk_verts).noalias() += 
+                pose_basis.middleRows(axis * VERTICES_NUM + chunk_begin, chunk_verts) * coeffs;
+    });
+}
+
+void SMPLWrapper::calcPoseBlendshapesJac_(const E::Matrix3d local_rotations_jac[SMPLWrapper::POSE_SIZE],
+    E::MatrixXd & blendshapes_jac) const
+{
+    // root rotation doesn't affect pose blendshapes
+    blendshapes_jac.resize(VERTICES_NUM * SPACE_DIM, POSE_SIZE);
+
+    // Each joint's rotation only affects its own 9 blendshapes => 
+    // block of jac columns for the joint = (joint's part of the basis) x (rotation derivatives as coefficients)
+    E::Matrix<double, SPACE_DIM * SPACE_DIM, SPACE_DIM> coeffs[JOINTS_NUM];
+    for (int joint = 1; joint < JOINTS_NUM; joint++)
     {
-        E::MatrixXd verts = verts_template_normalized_;
-        shapeSMPL_(*shape, verts);
-        joint_locations = jointRegressorMat_ * verts;
+        for (int dim = 0; dim < SPACE_DIM; dim++)
+        {
+            const E::Matrix3d& rotation_jac = local_rotations_jac[joint * SPACE_DIM + dim];
+            for (int row = 0; row < SPACE_DIM; row++)
+                for (int col = 0; col < SPACE_DIM; col++)
+                    coeffs[joint](row * SPACE_DIM + col, dim) = rotation_jac(row, col);
+        }
     }
 
+    const SMPLModel::ConstMatrixMap& pose_basis = model_->getPoseBasis();
+    parallelForVertices_(VERTICES_NUM, [&](int chunk_begin, int chunk_end)
+    {
+        const int chunk_verts = chunk_end - chunk_begin;
+        for (int axis = 0; axis < SPACE_DIM; axis++)
+        {
+            const int first_row = axis * VERTICES_NUM + chunk_begin;
+            blendshapes_jac.block(first_row, 0, chunk_verts, SPACE_DIM).setZero();
+            for (int joint = 1; joint < JOINTS_NUM; joint++)
+                blendshapes_jac.block(first_row, joint * SPACE_DIM, chunk_verts, SPACE_DIM).noalias() =
+                    pose_basis.block(first_row, (joint - 1) * SPACE_DIM * SPACE_DIM, chunk_verts, SPACE_DIM * SPACE_DIM) 
+                    * coeffs[joint];
+        }
+    });
+}
+
+E::MatrixXd SMPLWrapper::calcJointLocations_(Workspace & workspace, const E::VectorXd* translation,
+    const E::VectorXd* shape, const ERMatrixXd * pose) const
+{
+    E::MatrixXd joint_locations;
+
+    joint_locations = model_->getTemplateJointLocations();
+
+    // no need for the shaped mesh
+    if (shape != nullptr)
+        joint_locations = model_->calcShapedJointLocations(*shape);
+
     if (pose != nullptr)
     {
-        updateJointsFKTransforms_(*pose, joint_locations);
-        joint_locations = extractJointLocationFromFKTransform_(fk_transforms_);
+        updateJointsFKTransforms_(*pose, joint_locations, workspace);
+        joint_locations = extractJointLocationFromFKTransform_(workspace.fk_transforms);
     }
 
     if (translation != nullptr)
@@ -817,78 +1273,135 @@ E::MatrixXd SMPLWrapper::calcJointLocations_(const E::VectorXd* translation,
     return joint_locations;
 }
 
+void SMPLWrapper::calcModelSubBatch_(const State * states, int batch_size, E::MatrixXd * out) const
+{
+    assert(SMPLWrapper::SPACE_DIM == 3 && "Batched evaluation is only implemented in 3D");
+    const int flat_size = VERTICES_NUM * SPACE_DIM;
+
+    E::MatrixXd shapes(SHAPE_SIZE, batch_size);
+    for (int n = 0; n < batch_size; ++n)
+        shapes.col(n) = states[n].shape;
+
+    // Shaped joints of all the skeletons: joints are flattened column-major as the joint shape basis blocks
+    const E::MatrixXd& template_joints = model_->getTemplateJointLocations();
+    const E::MatrixXd& joint_shape_basis = model_->getJointShapeBasis();
+    E::MatrixXd joints = E::Map<const E::VectorXd>(template_joints.data(), JOINTS_NUM * SPACE_DIM).replicate(1, batch_size);
+    joints.noalias() += E::Map<const E::MatrixXd>(joint_shape_basis.data(), JOINTS_NUM * SPACE_DIM, SHAPE_SIZE) * shapes;
+
+    // FK joint by joint for the whole batch: the parents of all the skeletons are ready at each step
+    std::vector<ERigidTransform, E::aligned_allocator<ERigidTransform>> fk_transforms(batch_size * JOINTS_NUM);
+    std::vector<EHomoCoordMatrix, E::aligned_allocator<EHomoCoordMatrix>> lbs_transforms(batch_size * JOINTS_NUM);
+    E::MatrixXd pose_coeffs(POSE_BLENDSHAPES_NUM, use_pose_blendshapes_ ? batch_size : 0);
+    for (int joint_id = 0; joint_id < JOINTS_NUM; ++joint_id)
+    {
+        const int parent_id = model_->getJointParent(joint_id);
+        for (int n = 0; n < batch_size; ++n)
+        {
+            E::Map<const E::MatrixXd> joint_locations(joints.col(n).data(), JOINTS_NUM, SPACE_DIM);
+            const E::Vector3d joint_location = joint_locations.row(joint_id).transpose();
+            const E::Matrix3d local_rotation = get3DLocalRotation_(states[n].pose.row(joint_id));
+
+            ERigidTransform& fk_transform = fk_transforms[n * JOINTS_NUM + joint_id];
+            if (joint_id == 0)
+                fk_transform << local_rotation, joint_location;
+            else
+                fk_transform = composeRigid_(fk_transforms[n * JOINTS_NUM + parent_id], local_rotation, 
+                    joint_location - joint_locations.row(parent_id).transpose());
+
+            EHomoCoordMatrix& lbs_transform = lbs_transforms[n * JOINTS_NUM + joint_id];
+            lbs_transform.topLeftCorner<SPACE_DIM, SPACE_DIM>() = fk_transform.leftCols<SPACE_DIM>();
+            lbs_transform.topRightCorner<SPACE_DIM, 1>() = 
+                fk_transform.col(SPACE_DIM) - fk_transform.leftCols<SPACE_DIM>() * joint_location;
+            lbs_transform.row(SPACE_DIM) << 0., 0., 0., 1.;
+
+            // as in addPoseBlendshapes_(): no pose blendshapes for root
+            if (use_pose_blendshapes_ && joint_id > 0)
+            {
+                const int blendshape_id_offset = (joint_id - 1) * SPACE_DIM * SPACE_DIM;
+                for (int row = 0; row < SPACE_DIM; row++)
+                    for (int col = 0; col < SPACE_DIM; col++)
+                        pose_coeffs(blendshape_id_offset + row * SPACE_DIM + col, n) = 
+                            local_rotation(row, col) - (row == col ? 1. : 0.);
+            }
+        }
+    }
+
+    // rest pose vertices of the batch, flattened column-major as the vertex matrices
+    E::MatrixXd rest_verts(flat_size, batch_size);
+    for (int n = 0; n < batch_size; ++n)
+        out[n].resize(VERTICES_NUM, SPACE_DIM);
+
+    const E::MatrixXd& template_verts = model_->getTemplateVertices();
+    const SMPLModel::ConstMatrixMap& shape_basis = model_->getShapeBasis();
+    const SMPLModel::ConstMatrixMap& pose_basis = model_->getPoseBasis();
+    parallelForVertices_(VERTICES_NUM, [&](int chunk_begin, int chunk_end)
+    {
+        const int chunk_verts = chunk_end - chunk_begin;
+        // the rows of the chunk are a row block per coordinate
+        for (int axis = 0; axis < SPACE_DIM; axis++)
+        {
+            const int first_row = axis * VERTICES_NUM + chunk_begin;
+            auto rest_block = rest_verts.middleRows(first_row, chunk_verts);
+            rest_block = template_verts.col(axis).segment(chunk_begin, chunk_verts).replicate(1, batch_size);
+            rest_block.noalias() += shape_basis.middleRows(first_row, chunk_verts) * shapes;
+            if (use_pose_blendshapes_)
+                rest_block.noalias() += pose_basis.middleRows(first_row, chunk_verts) * pose_coeffs;
+        }
+
+        for (int n = 0; n < batch_size; ++n)
+        {
+            E::Map<const E::MatrixXd> verts(rest_verts.col(n).data(), VERTICES_NUM, SPACE_DIM);
+            if (states[n].displacements.size() != 0)
+                skinVertexRange_<double, true>(&lbs_transforms[n * JOINTS_NUM], verts, 
+                    &states[n].displacements, 1., out[n], chunk_begin, chunk_end);
+            else
+                skinVertexRange_<double, false>(&lbs_transforms[n * JOINTS_NUM], verts, 
+                    nullptr, 1., out[n], chunk_begin, chunk_end);
+            out[n].middleRows(chunk_begin, chunk_verts).rowwise() += states[n].translation.transpose();
+        }
+    });
+}
+
 E::MatrixXd SMPLWrapper::extractJointLocationFromFKTransform_(
-    const EHomoCoordMatrix(&fk_transform)[SMPLWrapper::JOINTS_NUM])
+    const ERigidTransform(&fk_transform)[SMPLWrapper::JOINTS_NUM])
 {
     // Go over the fk_transform and gather joint locations
     E::MatrixXd joints_locations(JOINTS_NUM, SPACE_DIM);
     for (int j = 0; j < JOINTS_NUM; j++)
     {
         // translation info is in the last column
-        joints_locations.row(j) = fk_transform[j].block(0, SPACE_DIM, SPACE_DIM, 1).transpose();
+        joints_locations.row(j) = fk_transform[j].col(SPACE_DIM).transpose();
     }
 
     return joints_locations;
 }
 
-E::MatrixXd SMPLWrapper::extractLBSJointTransformFromFKTransform_(
-    const EHomoCoordMatrix(&fk_transform)[SMPLWrapper::JOINTS_NUM], 
+void SMPLWrapper::extractLBSJointTransformFromFKTransform_(
+    const ERigidTransform(&fk_transform)[SMPLWrapper::JOINTS_NUM], 
     const E::MatrixXd & t_pose_joints_locations,
-    const E::MatrixXd(*FKDerivatives)[SMPLWrapper::JOINTS_NUM][SMPLWrapper::POSE_SIZE],
-    E::MatrixXd * jacsTotal)
+    EHomoCoordMatrix(&lbs_transforms)[SMPLWrapper::JOINTS_NUM])
 {
-    E::MatrixXd joints_transform(HOMO_SIZE * SMPLWrapper::JOINTS_NUM, SMPLWrapper::SPACE_DIM);
-
-    // utils vars: not to recreate them on each loop iteration
-    E::MatrixXd inverse_t_pose_translate;
-    E::MatrixXd tmpPointGlobalTransform;
-    E::MatrixXd tmpPointGlobalJac;
-
-    if (jacsTotal != nullptr)
-        for (int i = 0; i < SMPLWrapper::POSE_SIZE; ++i)
-            jacsTotal[i].setZero(HOMO_SIZE * SMPLWrapper::JOINTS_NUM, SMPLWrapper::SPACE_DIM);
-
     // Go over the fk_transform_ matrix and create LBS-compatible matrix
     for (int j = 0; j < JOINTS_NUM; j++)
     {
-        // inverse is needed to transform verts coordinates to local coordinate system
-        inverse_t_pose_translate = get3DTranslationMat_(-t_pose_joints_locations.row(j));
-        tmpPointGlobalTransform = fk_transform[j] * inverse_t_pose_translate;
-
-        joints_transform.block(HOMO_SIZE * j, 0, HOMO_SIZE, SMPLWrapper::SPACE_DIM)
-            = tmpPointGlobalTransform.transpose().leftCols(SMPLWrapper::SPACE_DIM);
-
-        // and fill corresponding jac format
-        if (jacsTotal != nullptr && FKDerivatives != nullptr)
-        {
-            // jac w.r.t current joint rotation coordinates
-            for (int dim = 0; dim < SMPLWrapper::SPACE_DIM; ++dim)
-            {
-                tmpPointGlobalJac = 
-                    (*FKDerivatives)[j][j * SMPLWrapper::SPACE_DIM + dim] * inverse_t_pose_translate;
-                jacsTotal[j * SMPLWrapper::SPACE_DIM + dim].block(j * HOMO_SIZE, 0, HOMO_SIZE, SMPLWrapper::SPACE_DIM)
-                    = tmpPointGlobalJac.transpose().leftCols(SMPLWrapper::SPACE_DIM);
-            }
-
-            // jac w.r.t. ancessors rotation coordinates         
-            for (int parent_dim = 0; parent_dim < (joints_parents_[j] + 1) * SMPLWrapper::SPACE_DIM; ++parent_dim)
-            {
-                if ((*FKDerivatives)[joints_parents_[j]][parent_dim].size() > 0)
-                {
-                    tmpPointGlobalJac = (*FKDerivatives)[j][parent_dim] * inverse_t_pose_translate;
-                    jacsTotal[parent_dim].block(j * HOMO_SIZE, 0, HOMO_SIZE, SMPLWrapper::SPACE_DIM)
-                        = tmpPointGlobalJac.transpose().leftCols(SMPLWrapper::SPACE_DIM);
-                }
-            }
-        }
+        // inverse translation is needed to transform verts coordinates to local coordinate system
+        const E::Vector3d t_pose_location = t_pose_joints_locations.row(j).transpose();
+        lbs_transforms[j].topLeftCorner<SPACE_DIM, SPACE_DIM>() = fk_transform[j].leftCols<SPACE_DIM>();
+        lbs_transforms[j].topRightCorner<SPACE_DIM, 1>() = 
+            fk_transform[j].col(SPACE_DIM) - fk_transform[j].leftCols<SPACE_DIM>() * t_pose_location;
+        lbs_transforms[j].row(SPACE_DIM) << 0., 0., 0., 1.;
     }
-
-    return joints_transform;
 }
 
 void SMPLWrapper::updateJointsFKTransforms_(
-    const ERMatrixXd & pose, const E::MatrixXd & t_pose_joints_locations, bool calc_derivatives)
+    const ERMatrixXd & pose, const E::MatrixXd & t_pose_joints_locations, Workspace & workspace, bool calc_derivatives) const
 {
+    ERigidTransform (&fk_transforms)[JOINTS_NUM] = workspace.fk_transforms;
+    // the transforms might be calculated for other joints than the memoized shaped ones
+    workspace.transforms_valid = false;
+    if (calc_derivatives && workspace.fk_derivatives.size() != JOINTS_NUM * POSE_SIZE)
+        workspace.fk_derivatives.resize(JOINTS_NUM * POSE_SIZE);
+
 #ifdef DEBUG
     std::cout << "global transform (analytic)" << std::endl;
 #endif // DEBUG
@@ -896,63 +1409,64 @@ void SMPLWrapper::updateJointsFKTransforms_(
     // uses functions that assume input in 3D (see below)
     assert(SMPLWrapper::SPACE_DIM == 3 && "The function can only be used in 3D world");
 
-    // TODO make more elegant local rotation and local jacobian assertions
-
-    // root as special case
-    fk_transforms_[0] = get3DLocalTransformMat_(pose.row(0), t_pose_joints_locations.row(0));
-    local_rotations_[0] = fk_transforms_[0].block(0, 0, SPACE_DIM, SPACE_DIM); // remember for pose blendshapes
-    if (calc_derivatives)
-    {
-        get3DLocalTransformJac_(pose.row(0), fk_transforms_[0], fk_derivatives_[0]);
-        for (int dim = 0; dim < SPACE_DIM; dim++)
-            local_rotations_jac_[dim] = fk_derivatives_[0][dim].block(0, 0, SPACE_DIM, SPACE_DIM);
-    }
-
-    E::MatrixXd localTransform, localTransformJac[SMPLWrapper::SPACE_DIM];
-    for (int joint_id = 1; joint_id < SMPLWrapper::JOINTS_NUM; joint_id++)
+    E::Matrix3d rotation_jac[SPACE_DIM];
+    for (int joint_id = 0; joint_id < SMPLWrapper::JOINTS_NUM; joint_id++)
     {
-        localTransform = get3DLocalTransformMat_(pose.row(joint_id),
-            t_pose_joints_locations.row(joint_id) - t_pose_joints_locations.row(joints_parents_[joint_id]));
-        local_rotations_[joint_id] = localTransform.block(0, 0, SPACE_DIM, SPACE_DIM);
+        // root as special case: its parent is the world origin
+        const int parent_id = model_->getJointParent(joint_id);
+        const E::Vector3d joint_to_parent = joint_id == 0 
+            ? E::Vector3d(t_pose_joints_locations.row(0).transpose())
+            : E::Vector3d((t_pose_joints_locations.row(joint_id) - t_pose_joints_locations.row(parent_id)).transpose());
+        
+        E::Matrix3d& local_rotation = workspace.local_rotations[joint_id]; // remember for pose blendshapes
+        local_rotation = get3DLocalRotation_(pose.row(joint_id));
 
         // Forward Kinematics Formula
-        fk_transforms_[joint_id] = fk_transforms_[joints_parents_[joint_id]] * localTransform;
+        if (joint_id == 0)
+            fk_transforms[0] << local_rotation, joint_to_parent;
+        else
+            fk_transforms[joint_id] = composeRigid_(fk_transforms[parent_id], local_rotation, joint_to_parent);
 
         if (calc_derivatives)
         {
-            get3DLocalTransformJac_(pose.row(joint_id), localTransform, localTransformJac);
+            ERigidTransform* joint_derivatives = &workspace.fk_derivatives[joint_id * POSE_SIZE];
+            get3DLocalRotationJac_(pose.row(joint_id), local_rotation, rotation_jac);
 
-            // jac w.r.t current joint rot coordinates
+            // jac w.r.t current joint rot coordinates: only the rotation part of the local transform depends on them
             for (int dim = 0; dim < SMPLWrapper::SPACE_DIM; ++dim)
             {
-                fk_derivatives_[joint_id][joint_id * SMPLWrapper::SPACE_DIM + dim] = 
-                    fk_transforms_[joints_parents_[joint_id]] * localTransformJac[dim];
-                local_rotations_jac_[joint_id * SMPLWrapper::SPACE_DIM + dim] =
-                    localTransformJac[dim].block(0, 0, SPACE_DIM, SPACE_DIM);
+                ERigidTransform& derivative = joint_derivatives[joint_id * SMPLWrapper::SPACE_DIM + dim];
+                if (joint_id == 0)
+                    derivative.leftCols<SPACE_DIM>() = rotation_jac[dim];
+                else
+                    derivative.leftCols<SPACE_DIM>().noalias() = fk_transforms[parent_id].leftCols<SPACE_DIM>() * rotation_jac[dim];
+                derivative.col(SPACE_DIM).setZero();
+
+                workspace.local_rotations_jac[joint_id * SMPLWrapper::SPACE_DIM + dim] = rotation_jac[dim];
             }
 
-            // jac w.r.t. ancessors rotation coordinates         
-            for (int j = 0; j < (joints_parents_[joint_id] + 1) * SMPLWrapper::SPACE_DIM; ++j)
+            // jac w.r.t. ancessors rotation coordinates
+            if (joint_id > 0)
             {
-                if (fk_derivatives_[joints_parents_[joint_id]][j].size() > 0)
+                const ERigidTransform* parent_derivatives = &workspace.fk_derivatives[parent_id * POSE_SIZE];
+                std::uint32_t ancestors = model_->getJointAncestorsMask(parent_id);
+                for (int ancestor = 0; ancestors != 0; ++ancestor, ancestors >>= 1)
                 {
-                    fk_derivatives_[joint_id][j] = 
-                        fk_derivatives_[joints_parents_[joint_id]][j] * localTransform;
+                    if (!(ancestors & 1u))
+                        continue;
+                    for (int j = ancestor * SPACE_DIM; j < (ancestor + 1) * SPACE_DIM; ++j)
+                        joint_derivatives[j] = composeRigid_(parent_derivatives[j], local_rotation, joint_to_parent);
                 }
             }
         }
-
     }
 
     // now the fk_* are updated
 }
 
-E::MatrixXd SMPLWrapper::get3DLocalTransformMat_(const E::Vector3d & jointAxisAngleRotation, const E::Vector3d & jointToParentDist)
+E::Matrix3d SMPLWrapper::get3DLocalRotation_(const E::Vector3d & jointAxisAngleRotation)
 {
-    // init
-    E::MatrixXd localTransform;
-    localTransform.setIdentity(4, 4);   // in homogenious coordinates
-    localTransform.block(0, 3, 3, 1) = jointToParentDist; // g(0)
+    E::Matrix3d rotation = E::Matrix3d::Identity();
 
     // prepare the info
     const E::Vector3d& w = jointAxisAngleRotation;
@@ -962,31 +1476,25 @@ E::MatrixXd SMPLWrapper::get3DLocalTransformMat_(const E::Vector3d & jointAxisAn
         0, -w[2], w[1],
         w[2], 0, -w[0],
         -w[1], w[0], 0;
-    w_skew /= norm;
-    E::Matrix3d exponent = E::Matrix3d::Identity();
 
-    if (norm > 0.0001)  // don't waste computations on zero joint movement
+    if (norm > 0.0001)
     {
+        w_skew /= norm;
         // apply Rodrigues formula
-        exponent += w_skew * sin(norm) + w_skew * w_skew * (1. - cos(norm));
-        localTransform.block(0, 0, 3, 3) = exponent;
+        rotation += w_skew * sin(norm) + w_skew * w_skew * (1. - cos(norm));
+    }
+    else
+    {
+        // first order near zero: consistent with the derivatives used in get3DLocalRotationJac_()
+        rotation += w_skew;
     }
 
-    return localTransform;
+    return rotation;
 }
 
-void SMPLWrapper::get3DLocalTransformJac_(const E::Vector3d & jointAxisAngleRotation,
-    const E::MatrixXd & transform_mat, E::MatrixXd* local_transform_jac_out)
+void SMPLWrapper::get3DLocalRotationJac_(const E::Vector3d & jointAxisAngleRotation,
+    const E::Matrix3d & rotation, E::Matrix3d (&rotation_jac_out)[SMPLWrapper::SPACE_DIM])
 {
-    for (int i = 0; i < SPACE_DIM; ++i)
-    {
-        local_transform_jac_out[i].setZero(4, 4);
-        // For the default pose transformation g(0)
-        local_transform_jac_out[i].col(SPACE_DIM) = transform_mat.col(SPACE_DIM);   
-        // local_transform_jac_out[i](3, 3) = 0;   
-        // (3, 3) should be 1 to account for the positions of the previous and subsequent joints in jac calculation
-    }
-
     const E::Vector3d& w = jointAxisAngleRotation;
     double norm = w.norm();
 
@@ -999,13 +1507,11 @@ void SMPLWrapper::get3DLocalTransformJac_(const E::Vector3d & jointAxisAngleRota
             -w[1], w[0], 0;
         w_skew /= norm;
 
-        E::MatrixXd rot_mat = transform_mat.block(0, 0, SPACE_DIM, SPACE_DIM);
-
         for (int i = 0; i < SPACE_DIM; ++i)
         {
             // compact formula from https://arxiv.org/pdf/1312.0788.pdf
             E::Vector3d cross = 
-                w.cross((E::Matrix3d::Identity() - rot_mat).col(i))
+                w.cross((E::Matrix3d::Identity() - rotation).col(i))
                 / (norm * norm);
             E::Matrix3d cross_skew;
             cross_skew <<
@@ -1013,67 +1519,109 @@ void SMPLWrapper::get3DLocalTransformJac_(const E::Vector3d & jointAxisAngleRota
                 cross[2], 0, -cross[0],
                 -cross[1], cross[0], 0;
 
-            local_transform_jac_out[i].block(0, 0, 3, 3) =
-                (w_skew * w[i] / norm + cross_skew) * rot_mat;
+            rotation_jac_out[i] = (w_skew * w[i] / norm + cross_skew) * rotation;
         }
     }
-    else // zero case 
+    else // zero case: generators of the rotations
     {
-        local_transform_jac_out[0].block(0, 0, 3, 3) <<
+        rotation_jac_out[0] <<
             0, 0, 0,
             0, 0, -1,
             0, 1, 0;
-        local_transform_jac_out[1].block(0, 0, 3, 3) <<
+        rotation_jac_out[1] <<
             0, 0, 1,
             0, 0, 0,
             -1, 0, 0;
-        local_transform_jac_out[2].block(0, 0, 3, 3) <<
+        rotation_jac_out[2] <<
             0, -1, 0,
             1, 0, 0,
             0, 0, 0;
     }
-
 }
 
-E::MatrixXd SMPLWrapper::get3DTranslationMat_(const E::Vector3d & translationVector)
+SMPLWrapper::ERigidTransform SMPLWrapper::composeRigid_(const ERigidTransform & parent,
+    const E::Matrix3d & rotation, const E::Vector3d & translation)
 {
-    E::MatrixXd translation;
-    translation.setIdentity(4, 4);  // in homogenious coordinates
-    translation.block(0, 3, 3, 1) = translationVector;
+    // the last row of the parent doesn't contribute to the first three rows of the product
+    ERigidTransform result;
+    result.leftCols<SPACE_DIM>().noalias() = parent.leftCols<SPACE_DIM>() * rotation;
+    result.col(SPACE_DIM).noalias() = parent.leftCols<SPACE_DIM>() * translation;
+    result.col(SPACE_DIM) += parent.col(SPACE_DIM);
 
-    return translation;
+    return result;
 }
 
-E::SparseMatrix<double> SMPLWrapper::getLBSMatrix_(const E::MatrixXd & verts) const
+template<typename Scalar>
+void SMPLWrapper::skinVertices_(const EHomoTransform<Scalar> * transforms, const E::Ref<const EMatrixX<Scalar>> & verts,
+    const ERMatrixXd * displacement, Scalar homo_coord,
+    EMatrixX<Scalar> & out) const
 {
-    const int dim = SMPLWrapper::SPACE_DIM;
-    const int nVerts = SMPLWrapper::VERTICES_NUM;
-    const int nJoints = SMPLWrapper::JOINTS_NUM;  // Number of joints
+    assert(SMPLWrapper::SPACE_DIM == 3 && "Skinning kernel is only implemented in 3D");
 #ifdef DEBUG
-    std::cout << "LBSMat: start (analytic)" << std::endl;
+    std::cout << "LBS: start (analytic)" << std::endl;
 #endif // DEBUG
-    // +1 goes for homogenious coordinates
-    E::SparseMatrix<double> LBSMat(nVerts, (dim + 1) * nJoints);
-    std::vector<E::Triplet<double>> LBSTripletList;
-    LBSTripletList.reserve(nVerts * (dim + 1) * SMPLWrapper::WEIGHTS_BY_VERTEX);     // for faster filling performance
 
-    // go over non-zero weight elements
-    for (int k = 0; k < this->weights_.outerSize(); ++k)
+    const int n_verts = (int)verts.rows();
+    out.resize(n_verts, SMPLWrapper::SPACE_DIM);   // no-op if out is verts
+
+    parallelForVertices_(n_verts, [&](int chunk_begin, int chunk_end)
     {
-        for (E::SparseMatrix<double>::InnerIterator it(this->weights_, k); it; ++it)
+        if (displacement != nullptr)
+            skinVertexRange_<Scalar, true>(transforms, verts, displacement, homo_coord, out, chunk_begin, chunk_end);
+        else
+            skinVertexRange_<Scalar, false>(transforms, verts, displacement, homo_coord, out, chunk_begin, chunk_end);
+    });
+}
+
+template<typename Scalar, bool Displaced>
+void SMPLWrapper::skinVertexRange_(const EHomoTransform<Scalar> * transforms, const E::Ref<const EMatrixX<Scalar>> & verts,
+    const ERMatrixXd * displacement, Scalar homo_coord,
+    EMatrixX<Scalar> & out, int range_begin, int range_end) const
+{
+    const SkinningTable& skinning = model_->getSkinningTable();
+    const E::Matrix<Scalar, E::Dynamic, WEIGHTS_BY_VERTEX>& skinning_weights = skinningWeights_<Scalar>();
+    const int* joint_ids[WEIGHTS_BY_VERTEX];
+    const Scalar* weights[WEIGHTS_BY_VERTEX];
+    for (int k = 0; k < WEIGHTS_BY_VERTEX; ++k)
+    {
+        joint_ids[k] = skinning.joint_ids.col(k).data();
+        weights[k] = skinning_weights.col(k).data();
+    }
+
+    for (int v = range_begin; v < range_end; ++v)
+    {
+        Scalar point[HOMO_SIZE] = { verts(v, 0), verts(v, 1), verts(v, 2), homo_coord };
+        if (Displaced)
+            for (int axis = 0; axis < SPACE_DIM; ++axis)
+                point[axis] += Scalar((*displacement)(v, axis));
+
+        const Scalar* vertex_transforms[WEIGHTS_BY_VERTEX];
+        Scalar vertex_weights[WEIGHTS_BY_VERTEX];
+        for (int k = 0; k < WEIGHTS_BY_VERTEX; ++k)
         {
-            double weight = it.value();
-            int idx_vert = it.row();
-            int idx_joint = it.col();
-            // premultiply weigths by vertex homogenious coordinates
-            for (int idx_dim = 0; idx_dim < dim; idx_dim++)
-                LBSTripletList.push_back(E::Triplet<double>(idx_vert, idx_joint * (dim + 1) + idx_dim, weight * verts(idx_vert, idx_dim)));
-            LBSTripletList.push_back(E::Triplet<double>(idx_vert, idx_joint * (dim + 1) + dim, weight));
+            vertex_transforms[k] = transforms[joint_ids[k][v]].data();
+            vertex_weights[k] = weights[k][v];
         }
+
+        alignas(32) Scalar posed[HOMO_SIZE];
+        blendAndApply(vertex_transforms, vertex_weights, point, posed);
+
+        out(v, 0) = posed[0];
+        out(v, 1) = posed[1];
+        out(v, 2) = posed[2];
     }
-    LBSMat.setFromTriplets(LBSTripletList.begin(), LBSTripletList.end());
+}
+
+std::shared_ptr<ThreadPool> SMPLWrapper::threadPool_() const
+{
+    return thread_pool_ != nullptr ? thread_pool_ : ThreadPool::getDefault();
+}
 
-    return LBSMat;
+template<typename ChunkFunction>
+void SMPLWrapper::parallelForVertices_(int n_verts, const ChunkFunction & func) const
+{
+    threadPool_()->parallelFor(0, n_verts, VERTEX_CHUNK_SIZE, 
+        [&func](int /*chunk*/, int chunk_begin, int chunk_end) { func(chunk_begin, chunk_end); });
 }
 
 SMPLWrapper::State::State()
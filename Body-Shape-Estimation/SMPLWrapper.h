@@ -1,17 +1,32 @@
 #pragma once
 /*
 The class is a wrapper around SMPL model. It is able to calculate the SMPL model output based on pose and shape parameters.
+The read-only model data is kept in SMPLModel shared by all the wrappers of the same gender and path,
+the wrapper itself only owns the state and the buffers for the model calculation.
 
 Limitations:
+    - The state-based methods (calcModel(), rotateRoot(), etc.) use the wrapper's own workspace,
+    so they are not thread-safe. To evaluate the model concurrently, use the const calcModel() overload
+    with a separate Workspace for each thread.
     - Wrapper does not keep the tranformed vertices and joint locations corresponding to the current
     wrapper state_. Since the state is allowed to be modified from the outside, there is no way to know
     "the freshness" of the atrefacts, if saved.
+    Only the intermediate stages (shaped rest mesh and joints, pose transforms) are memoized in the workspace.
+    Their freshness is checked by comparing the stage inputs by value, which is cheap compared to the stages themselves.
+    - The vertex loops of the model calculation (shaping, blendshapes, skinning, jacobians) are split into fixed-size chunks
+    over the thread pool of the wrapper (see setThreadPool()). The chunks don't depend on the number of threads,
+    so the output is the same for any pool. Concurrent calculations with the same pool are served one after another.
+    - In the single-precision mode (see setSinglePrecision()) the rest mesh is still shaped in double and converted once 
+    per shape; the parameters, jacobians and outputs stay double. calcModelBatch() is always evaluated in double.
 */
 
 //#define DEBUG
 
 #include <assert.h>
+#include <array>
 #include <map>
+#include <memory>
+#include <utility>
 
 #include <Eigen/Dense>
 #include <Eigen/SparseCore>
@@ -19,18 +34,22 @@ Limitations:
 #include <igl/writeOBJ.h>
 #include <igl/per_vertex_normals.h>
 
+#include "SMPLModel.h"
+
+class ThreadPool;
+
 namespace E = Eigen;
 class SMPLWrapper
 {
 public:
-    static constexpr std::size_t SHAPE_SIZE = 10;
-    static constexpr std::size_t SPACE_DIM = 3; // needs to be 3 for most of the routines to work
-    static constexpr std::size_t HOMO_SIZE = SMPLWrapper::SPACE_DIM + 1;
-    static constexpr std::size_t POSE_SIZE = 72;
-    static constexpr std::size_t JOINTS_NUM = POSE_SIZE / SPACE_DIM;
-    static constexpr std::size_t POSE_BLENDSHAPES_NUM = (JOINTS_NUM - 1) * SPACE_DIM * SPACE_DIM;
-    static constexpr std::size_t VERTICES_NUM = 6890;
-    static constexpr std::size_t WEIGHTS_BY_VERTEX = 4;     // number of joints each vertex depend on
+    static constexpr std::size_t SHAPE_SIZE = SMPLModel::SHAPE_SIZE;
+    static constexpr std::size_t SPACE_DIM = SMPLModel::SPACE_DIM;
+    static constexpr std::size_t HOMO_SIZE = SMPLModel::HOMO_SIZE;
+    static constexpr std::size_t POSE_SIZE = SMPLModel::POSE_SIZE;
+    static constexpr std::size_t JOINTS_NUM = SMPLModel::JOINTS_NUM;
+    static constexpr std::size_t POSE_BLENDSHAPES_NUM = SMPLModel::POSE_BLENDSHAPES_NUM;
+    static constexpr std::size_t VERTICES_NUM = SMPLModel::VERTICES_NUM;
+    static constexpr std::size_t WEIGHTS_BY_VERTEX = SMPLModel::WEIGHTS_BY_VERTEX;
 
     using ERMatrixXd = E::Matrix<double, -1, -1, E::RowMajor>;
     struct State {
@@ -43,30 +62,108 @@ public:
         ~State() {};
     };
 
-    using NeighboursList = std::vector<int>;
-    using DictionaryInt = std::map<std::string, int>;
-    using DictEntryInt = std::pair<std::string, int>;
+    using NeighboursList = SMPLModel::NeighboursList;
+    using DictionaryInt = SMPLModel::DictionaryInt;
+    using DictEntryInt = SMPLModel::DictEntryInt;
+    using SkinningTable = SMPLModel::SkinningTable;
     using EHomoCoordMatrix = E::Matrix<double, HOMO_SIZE, HOMO_SIZE>;
+    // [R | t] of the homogeneous transform, the last row (0, 0, 0, 1) is implicit
+    using ERigidTransform = E::Matrix<double, SPACE_DIM, HOMO_SIZE>;
+    // the model kernels are templated on the scalar type (see setSinglePrecision())
+    template<typename Scalar> using EMatrixX = E::Matrix<Scalar, E::Dynamic, E::Dynamic>;
+    template<typename Scalar> using EHomoTransform = E::Matrix<Scalar, HOMO_SIZE, HOMO_SIZE>;
+
+    // Pose jacobian in the compressed per-vertex format: a vertex only stores the derivatives w.r.t. the pose parameters 
+    // that affect it, i.e. the rotations of the ancestors of its skinning joints and of the joints whose pose blendshapes move it
+    struct PoseJacobian {
+        // entries of vertex v are [offsets[v], offsets[v + 1])
+        std::vector<int> offsets;
+        std::vector<int> params;
+        // d vertex / d param of each entry
+        E::Matrix<double, E::Dynamic, SPACE_DIM, E::RowMajor> values;
+    };
+
+    // Gauss-Newton normal equations of the residuals that depend on the model vertices: 
+    // J^T J and J^T r with J = d residuals / d parameters
+    struct NormalEquations {
+        E::MatrixXd JtJ;
+        E::VectorXd Jtr;
+    };
+
+    // Intermediate values of the model calculation. 
+    // Owned by the caller, so the same model could be evaluated by many threads, each with its own workspace
+    struct Workspace {
+        ERigidTransform fk_transforms[JOINTS_NUM];
+        // JOINTS_NUM x POSE_SIZE in [joint * POSE_SIZE + pose_param] order, the last row is implicitly zero.
+        // Only the parameters of the joint's ancestors are filled (see SMPLModel::getJointAncestorsMask()).
+        // Allocated on the first calculation with derivatives and re-used after
+        std::vector<ERigidTransform, E::aligned_allocator<ERigidTransform>> fk_derivatives;
+        // homogeneous to keep the 4-wide columns for the skinning kernel
+        EHomoCoordMatrix lbs_transforms[JOINTS_NUM];
+        E::Matrix3d local_rotations[JOINTS_NUM];
+        E::Matrix3d local_rotations_jac[POSE_SIZE];
+        E::MatrixXd blendshapes_derivatives;
+        E::MatrixXd joint_locations;
+
+        // Memoized stages: re-used while the inputs are the same as on the last calculation with this workspace
+        // shaped rest mesh and joints. nullptr shape is memoized as zero shape
+        E::VectorXd shaped_for;             // empty if the stage was never calculated
+        E::MatrixXd shaped_verts;
+        E::MatrixXd shaped_joints;
+        std::size_t shape_version = 0;      // incremented on every re-calculation of the shaped stage
+        // fk_*, lbs_*, local_rotations* and blendshapes_derivatives of the shaped joints
+        ERMatrixXd transforms_for_pose;
+        std::size_t transforms_for_shape_version = 0;
+        bool transforms_with_jac = false;
+        bool transforms_valid = false;      // reset by any direct update of the fk transforms
+        // single-precision copies for the float mode: the lbs transforms are converted with every update,
+        // the shaped rest mesh on the first use after the shape change
+        EHomoTransform<float> lbs_transforms_single[JOINTS_NUM];
+        E::MatrixXf shaped_verts_single;
+        std::size_t shaped_single_version = 0;  // shape_version of the copy
+
+        // Scratch buffers of the evaluation: sized on the first use and re-used after,
+        // so the repeated evaluations don't allocate
+        E::MatrixXf verts_single;           // vertex stages of the float mode
+        E::MatrixXd rest_verts;             // rest pose with the pose blendshapes for the jacobians
+        // per vertex chunk of the normal equations accumulation
+        std::vector<NormalEquations> chunk_sums;
+        std::vector<E::MatrixXd> chunk_jacs;
+        std::vector<E::VectorXd> chunk_residuals;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
 
     /*
     Class should be initialized with the gender of the model to use and with the path to the model folder,
     that contains the files in a pre-defined structure.
     gender is either "f" or "m"
-    The joints hierarchy is expectes to be so that the parent's id is always less than the child's
+    The model data is only read from disk if it's not already loaded for the gender and path (see SMPLModel)
     Pose blendshapes are memory exensive, so there is an option to turn them off
     */
     SMPLWrapper(char gender, const std::string path, const bool pose_blendshapes = true);
+    // pose blendshapes are only used if the model has them
+    SMPLWrapper(std::shared_ptr<const SMPLModel> model, const bool pose_blendshapes = true);
     ~SMPLWrapper();
 
     // getters
-    char getGender() const                    { return gender_; };
-    const E::MatrixXi& getFaces() const              { return faces_; };
-    const E::MatrixXd& getTemplateVertices() const   { return verts_template_normalized_; };
+    char getGender() const                    { return model_->getGender(); };
+    const E::MatrixXi& getFaces() const              { return model_->getFaces(); };
+    const E::MatrixXd& getTemplateVertices() const   { return model_->getTemplateVertices(); };
     const E::VectorXd& getTemplateMeanPoint() const  { return E::Vector3d(0, 0, 0); };
-    const E::MatrixXd& getPoseStiffness() const      { return pose_stiffness_; };
+    const E::MatrixXd& getPoseStiffness() const      { return model_->getPoseStiffness(); };
+    std::shared_ptr<const SMPLModel> getModel() const { return model_; }
     // !! gives access to the inner arrays
     State& getStatePointers() { return state_; }
-    const NeighboursList& getVertNeighbours(int vert_id) const { return verts_neighbours_[vert_id]; }
+    const NeighboursList& getVertNeighbours(int vert_id) const { return model_->getVertNeighbours(vert_id); }
+    // nullptr is for ThreadPool::getDefault() (the default)
+    void setThreadPool(std::shared_ptr<ThreadPool> thread_pool) { thread_pool_ = std::move(thread_pool); }
+    const std::shared_ptr<ThreadPool>& getThreadPool() const { return thread_pool_; }
+    // Evaluate the vertex stages of calcModel() (blendshapes, skinning, translation), the vertex normals 
+    // and the distance queries of the cost functions in float: half the memory traffic and twice the SIMD width.
+    // Relative error of the output is about 1e-7; off by default
+    void setSinglePrecision(bool single_precision) { use_single_precision_ = single_precision; }
+    bool isSinglePrecision() const { return use_single_precision_; }
 
     // modify state
     void rotateLimbToDirection(const std::string joint_name, const E::Vector3d& direction);
@@ -80,16 +177,67 @@ public:
     void loadParametersFromFile(const std::string filename);
 
     // calculate the model output mesh
-    // *_jacs are expected to have space for POSE_SIZE and SHAPE_SIZE Matrices
+    // shape_jac and displacement_jac are vertex-major: (VERTICES_NUM * SPACE_DIM) x (SHAPE_SIZE or SPACE_DIM), row-major,
+    // the row v * SPACE_DIM + axis is d vertex(v, axis) / d params, so the entries of each vertex are contiguous.
+    // Each vertex only depends on its own displacement, with the blended skinning rotation R_v as the jacobian:
+    // the rows of the vertex in displacement_jac are R_v
     E::MatrixXd calcModel(const E::VectorXd * translation, 
         const ERMatrixXd * pose,
         const E::VectorXd * shape,
         const ERMatrixXd * displacement,
-        E::MatrixXd * pose_jac = nullptr,
-        E::MatrixXd * shape_jac = nullptr,
-        E::MatrixXd * displacement_jac = nullptr);
+        PoseJacobian * pose_jac = nullptr,
+        ERMatrixXd * shape_jac = nullptr,
+        ERMatrixXd * displacement_jac = nullptr);
+    // Reentrant version: only the workspace is modified
+    E::MatrixXd calcModel(const E::VectorXd * translation,
+        const ERMatrixXd * pose,
+        const E::VectorXd * shape,
+        const ERMatrixXd * displacement,
+        Workspace & workspace,
+        PoseJacobian * pose_jac = nullptr,
+        ERMatrixXd * shape_jac = nullptr,
+        ERMatrixXd * displacement_jac = nullptr) const;
+    // The same with the output written to verts: doesn't allocate once the workspace, verts and the jacobians
+    // were used for the same kind of calculation
+    void calcModel(const E::VectorXd * translation,
+        const ERMatrixXd * pose,
+        const E::VectorXd * shape,
+        const ERMatrixXd * displacement,
+        Workspace & workspace,
+        E::MatrixXd & verts,
+        PoseJacobian * pose_jac = nullptr,
+        ERMatrixXd * shape_jac = nullptr,
+        ERMatrixXd * displacement_jac = nullptr) const;
+    /*
+    Normal equations of the per-vertex residuals (VERTICES_NUM) w.r.t. the pose or the shape parameters,
+    accumulated while streaming through the model jacobian vertex by vertex, so the jacobian is never stored.
+    residual_grads.row(v) is d residual_v / d vertex_v; the vertices with zero gradient are skipped.
+    The vertex chunks are processed in parallel on the thread pool of the wrapper and reduced in order,
+    so the result doesn't depend on the number of threads.
+    Translation doesn't affect the jacobians and is not needed.
+    */
+    void calcPoseNormalEquations(const ERMatrixXd & pose,
+        const E::VectorXd * shape,
+        const ERMatrixXd * displacement,
+        const E::MatrixXd & residual_grads, const E::VectorXd & residuals,
+        Workspace & workspace, NormalEquations & out) const;
+    void calcShapeNormalEquations(const ERMatrixXd * pose,
+        const E::VectorXd & shape,
+        const E::MatrixXd & residual_grads, const E::VectorXd & residuals,
+        Workspace & workspace, NormalEquations & out) const;
+    /*
+    Evaluates many parameter sets at once: out[n] is calcModel() with the translation, pose, shape and displacements of states[n] 
+    (empty displacements are treated as zero). The states are processed in sub-batches: the shape and the pose blendshapes 
+    of a sub-batch are one matrix product each, FK runs joint by joint over all the skeletons,
+    and each vertex chunk is shaped, blended and skinned for the whole sub-batch while it's in cache.
+    Jacobians are not available in this mode
+    */
+    std::vector<E::MatrixXd> calcModelBatch(const std::vector<State> & states) const;
     // calculate for the supplied vertices (calcModel output)
-    E::MatrixXd calcVertexNormals(const E::MatrixXd* verts);
+    // Area-weighted, as igl::per_vertex_normals() by default
+    E::MatrixXd calcVertexNormals(const E::MatrixXd* verts) const;
+    // into the given matrix, without allocations if it has the right size
+    void calcVertexNormals(const E::MatrixXd & verts, E::MatrixXd & normals) const;
     // using current SMPLWrapper state
     E::MatrixXd calcModel();
     E::MatrixXd calcJointLocations();
@@ -103,17 +251,6 @@ public:
     void logParameters(const std::string filename);
 
 private:
-    void readTemplate_();
-    void readJointMat_();
-    void readPoseStiffnessMat_();
-    void readJointNames_();
-    void readShapes_();
-    void readPoseBlendshapes_();
-    void readWeights_();
-    void readHierarchy_();
-    // to be called after the faces are collected
-    void fillVertsNeighbours_();
-
     void saveToObj_(const E::VectorXd* translation, const ERMatrixXd * pose,
         const E::VectorXd* shape, const ERMatrixXd* displacements,
         const std::string path);
@@ -122,89 +259,184 @@ private:
     static E::Vector3d angle_axis_(const E::Vector3d& from, const E::Vector3d& to);
     static E::Vector3d rotate_by_angle_axis_(const E::Vector3d& vector, const E::Vector3d& angle_axis_rotation);
     static E::Vector3d combine_two_angle_axis_(const E::Vector3d& first, const E::Vector3d& second);
-    // pass fk_transforms_ to be explicit of which version of fk_transforms is used for calculations
+    // pass fk_transform to be explicit of which version of fk_transforms is used for calculations
     void assignJointGlobalRotation_(int joint_id, E::VectorXd rotation, 
-        const EHomoCoordMatrix(&fk_transform)[JOINTS_NUM]);
+        const ERigidTransform(&fk_transform)[JOINTS_NUM]);
    
     // Model calculation
-   // if not nullptr, shape_jac is expected to be an array of SHAPE_SIZE of MatrixXd, one matrix for each shape parameter
-    void shapeSMPL_(const E::VectorXd& shape, E::MatrixXd &verts, E::MatrixXd* shape_jac = nullptr);
-    // Careful with the use_previous_pose_matrix paramter when calling the posing for the first time!
-    void poseSMPL_(const ERMatrixXd& pose, E::MatrixXd & verts, const ERMatrixXd *displacement, E::MatrixXd * pose_jac = nullptr,
-        bool use_previous_pose_matrix = false);
+    // Evaluation paths of calcModel(): the requested jacobians and the model options are compile-time flags,
+    // so each combination is a separate specialization without the dead stages and the per-vertex checks of the options.
+    // The path is looked up once per calcModel() call from the non-null jacobians
+    enum ModelPathFlags : unsigned {
+        PATH_POSE_JAC = 1u << 0,
+        PATH_SHAPE_JAC = 1u << 1,
+        PATH_DISPLACEMENT_JAC = 1u << 2,
+        PATH_POSE_BLENDSHAPES = 1u << 3,
+        PATH_SINGLE_PRECISION = 1u << 4,   // the vertex stages in float
+        PATHS_NUM = 1u << 5
+    };
+    using ModelPath = void (SMPLWrapper::*)(const E::VectorXd * translation,
+        const ERMatrixXd * pose,
+        const E::VectorXd * shape,
+        const ERMatrixXd * displacement,
+        Workspace & workspace, E::MatrixXd & verts,
+        PoseJacobian * pose_jac, ERMatrixXd * shape_jac, ERMatrixXd * displacement_jac) const;
+    // The jacobians of the path are expected to be non-null, the others are ignored
+    template<unsigned Path>
+    void calcModel_(const E::VectorXd * translation,
+        const ERMatrixXd * pose,
+        const E::VectorXd * shape,
+        const ERMatrixXd * displacement,
+        Workspace & workspace, E::MatrixXd & verts,
+        PoseJacobian * pose_jac, ERMatrixXd * shape_jac, ERMatrixXd * displacement_jac) const;
+    // model_paths_[path] is calcModel_<path>
+    template<std::size_t... Paths>
+    static constexpr std::array<ModelPath, sizeof...(Paths)> makeModelPaths_(std::index_sequence<Paths...>);
+    static const std::array<ModelPath, PATHS_NUM> model_paths_;
+    void shapeSMPL_(const E::VectorXd& shape, E::MatrixXd &verts) const;
+    // Updates the shaped_* of the workspace if the shape differs from the memoized one
+    void updateShapedRest_(const E::VectorXd* shape, Workspace & workspace) const;
+    // Updates the pose transforms of the workspace for the shaped joints if the pose or the shape changed
+    // or if the derivatives are requested but were not calculated. Expects the shaped stage to be up-to-date
+    void updatePoseTransforms_(const ERMatrixXd& pose, Workspace & workspace, bool calc_derivatives) const;
+    // lbs transforms (and pose blendshapes derivatives, if requested) from the fk_* of the workspace
+    void updateLBSTransforms_(const E::MatrixXd & t_pose_joints_locations, Workspace & workspace,
+        bool calc_derivatives) const;
+    // Scalar versions of the shaped rest mesh and the lbs transforms of the up-to-date workspace
+    template<typename Scalar>
+    static const EMatrixX<Scalar>& shapedRest_(Workspace & workspace);
+    template<typename Scalar>
+    static const EHomoTransform<Scalar>* lbsTransforms_(const Workspace & workspace);
+    // buffer for the vertex stages: the output itself for double
+    template<typename Scalar>
+    static EMatrixX<Scalar>& workingVerts_(Workspace & workspace, E::MatrixXd & verts);
+    // The pose matrices are taken from the workspace (see updatePoseTransforms_()), 
+    // and should include the derivatives if pose_jac is requested
+    template<typename Scalar, bool PoseBlendshapes, bool WithPoseJac>
+    void poseSMPL_(EMatrixX<Scalar> & verts, const ERMatrixXd *displacement, 
+        Workspace & workspace, PoseJacobian * pose_jac) const;
+    // Fused pass over the vertices for all the pose parameters at once.
+    // verts are in the rest pose with pose blendshapes applied; uses the transforms and derivatives from the workspace
+    template<bool PoseBlendshapes>
+    void calcPoseJac_(const E::MatrixXd & verts, const ERMatrixXd * displacement, 
+        const Workspace & workspace, PoseJacobian & pose_jac) const;
+    // d(fk_a) * fk_a^-1 for each pose parameter of the joint a
+    static void calcRotationJacs_(const Workspace & workspace, E::Matrix3d (&rotation_jacs)[POSE_SIZE]);
+    // Pose jacobian entries of one vertex at rest_point (with pose blendshapes and displacement) in the ascending param order:
+    // fills params and values (SPACE_DIM per entry) and returns the number of entries
+    template<bool PoseBlendshapes>
+    int calcVertexPoseJac_(int vert_id, const E::Vector3d & rest_point, const E::Matrix3d (&rotation_jacs)[POSE_SIZE],
+        const Workspace & workspace, int * params, double * values) const;
+    // Shape jacobian of the posed model by linearity: the rotations don't depend on the shape, 
+    // so only the shape blendshapes (rotated) and the translations of the joints (through the joint shape basis) contribute.
+    // Uses the transforms of the workspace
+    void calcShapeJac_(const Workspace & workspace, ERMatrixXd * shape_jac) const;
+    // d(lbs_j translation) / d(shape_i)
+    void calcLBSTranslationsShapeJac_(const Workspace & workspace,
+        E::Vector3d (&lbs_translations_jac)[JOINTS_NUM][SHAPE_SIZE]) const;
+    // column i is d vertex / d shape_i
+    void calcVertexShapeJac_(int vert_id, const E::Vector3d (&lbs_translations_jac)[JOINTS_NUM][SHAPE_SIZE],
+        const Workspace & workspace, E::Matrix<double, SPACE_DIM, SHAPE_SIZE> & vertex_jac) const;
+    // vertex_jac(vert_id, params, values) fills the jacobian entries of the vertex as calcVertexPoseJac_() does
+    // The per-chunk buffers are taken from the workspace
+    template<typename VertexJacobian>
+    void accumulateNormalEquations_(int params_num, const E::MatrixXd & residual_grads, const E::VectorXd & residuals,
+        const VertexJacobian & vertex_jac, Workspace & workspace, NormalEquations & out) const;
+    // O(V) from the transforms of the workspace: no posing needed
+    void calcDisplacementJac_(const Workspace & workspace, ERMatrixXd * displacement_jac) const;
+    // sum of the rotational parts of the lbs transforms of the vertex, weighted
+    E::Matrix3d blendedRotation_(int vert_id, const Workspace & workspace) const;
+    // joints which rotations affect the vertex
+    template<bool PoseBlendshapes>
+    std::uint32_t vertexPoseMask_(int vert_id) const;
+    template<typename Scalar>
+    void calcVertexNormals_(const E::MatrixXd & verts, E::MatrixXd & normals) const;
     // Jaconian is not provided because it's always an identity: dv_i / d_tj == 1 => don't want to waste memory on it
-    void translate_(const E::VectorXd& translation, E::MatrixXd & verts);
-    void addJointPoseBlendshape_(const int blendshape_id_offset, const E::MatrixXd& coeff, E::MatrixXd & verts);
-    void addPoseBlendshapes_(const E::MatrixXd local_rotations_[JOINTS_NUM], E::MatrixXd & verts);
-    void calcPoseBlendshapesJac_(const E::MatrixXd local_rotations_jac_[POSE_SIZE],
-        E::MatrixXd* blendshapes_jac);
+    template<typename Scalar>
+    void translate_(const E::VectorXd& translation, EMatrixX<Scalar> & verts) const;
+    // pose blendshapes are applied all at once as (pose_basis_ x coefficients)
+    template<typename Scalar>
+    void addPoseBlendshapes_(const E::Matrix3d local_rotations_[JOINTS_NUM], EMatrixX<Scalar> & verts) const;
+    // model arrays in Scalar (see SMPLModel::getSinglePrecisionData())
+    template<typename Scalar>
+    E::Map<const EMatrixX<Scalar>> poseBasis_() const;
+    template<typename Scalar>
+    const E::Matrix<Scalar, E::Dynamic, WEIGHTS_BY_VERTEX>& skinningWeights_() const;
+    // blendshapes_jac is (VERTICES_NUM * SPACE_DIM) x POSE_SIZE, 
+    // each column is the derivative w.r.t. the pose parameter flattened as the vertex matrix
+    void calcPoseBlendshapesJac_(const E::Matrix3d local_rotations_jac_[POSE_SIZE],
+        E::MatrixXd & blendshapes_jac) const;
 
     // don't account for displacement, because the jointRegressor was not designed for it
-    E::MatrixXd calcJointLocations_(const E::VectorXd* translation = nullptr,
-        const E::VectorXd* shape = nullptr, const ERMatrixXd * pose = nullptr);
+    // fk transforms in the workspace are updated if the pose is given
+    E::MatrixXd calcJointLocations_(Workspace & workspace, const E::VectorXd* translation = nullptr,
+        const E::VectorXd* shape = nullptr, const ERMatrixXd * pose = nullptr) const;
 
-    // pass fk_transforms_ to be explicit of which version of fk_transforms is used for calculations
-    static E::MatrixXd extractJointLocationFromFKTransform_(const EHomoCoordMatrix(&fk_transform)[JOINTS_NUM]);
+    // out is expected to have space for batch_size matrices
+    void calcModelSubBatch_(const State * states, int batch_size, E::MatrixXd * out) const;
 
-    // result passed in the form of stacked transposed matrices with the homo row clipped: JOINTS_NUM * 4 x 3
-    static E::MatrixXd extractLBSJointTransformFromFKTransform_(
-        const EHomoCoordMatrix (&fk_transform) [JOINTS_NUM], const E::MatrixXd & t_pose_joints_locations,
-        const E::MatrixXd (*FKDerivatives)[JOINTS_NUM][POSE_SIZE] = nullptr, 
-        E::MatrixXd * jacsTotal = nullptr);
+    // pass fk_transform to be explicit of which version of fk_transforms is used for calculations
+    static E::MatrixXd extractJointLocationFromFKTransform_(const ERigidTransform(&fk_transform)[JOINTS_NUM]);
+
+    // LBS transforms move the T-pose vertices to the posed location: fk_transform * translation(-t_pose_joint_location)
+    static void extractLBSJointTransformFromFKTransform_(
+        const ERigidTransform (&fk_transform) [JOINTS_NUM], const E::MatrixXd & t_pose_joints_locations,
+        EHomoCoordMatrix (&lbs_transforms)[JOINTS_NUM]);
 
     // Posing routines: all sssumes that SPACE_DIM == 3
     // Assumes the default joint angles to be all zeros
-    // Updates fk_*
+    // Updates fk_* and local_rotations* of the workspace and invalidates its memoized transforms
     void updateJointsFKTransforms_(const ERMatrixXd & pose,
-        const E::MatrixXd & t_pose_joints_locations, bool calc_derivatives = false);
+        const E::MatrixXd & t_pose_joints_locations, Workspace & workspace, bool calc_derivatives = false) const;
     
-    static E::MatrixXd get3DLocalTransformMat_(
-        const E::Vector3d & jointAxisAngleRotation, const E::Vector3d & jointToParentDist);
-
-    static void get3DLocalTransformJac_(
+    // Rodrigues formula
+    static E::Matrix3d get3DLocalRotation_(const E::Vector3d & jointAxisAngleRotation);
+    // derivatives of the rotation matrix w.r.t. each of the axis-angle components
+    static void get3DLocalRotationJac_(
         const E::Vector3d & jointAxisAngleRotation,
-        const E::MatrixXd & transform_mat,
-        E::MatrixXd* local_transform_jac_out);
-
-    static E::MatrixXd get3DTranslationMat_(const E::Vector3d & translationVector);
+        const E::Matrix3d & rotation,
+        E::Matrix3d (&rotation_jac_out)[SPACE_DIM]);
+    // parent * [rotation | translation]. Also valid for the derivative of the parent as the left operand
+    static ERigidTransform composeRigid_(const ERigidTransform & parent, 
+        const E::Matrix3d & rotation, const E::Vector3d & translation);
     
-    // Composes weights (object local) and given vertices in the rest pose into (Sparse) LBSMatrix. 
-    // Inspired by igl::lbs_matrix(..)
-    E::SparseMatrix<double> getLBSMatrix_(const E::MatrixXd & verts) const;
+    // the wrapper's pool or the default one
+    std::shared_ptr<ThreadPool> threadPool_() const;
+    // func(chunk_begin, chunk_end) over the chunks of [0, n_verts) on the thread pool
+    template<typename ChunkFunction>
+    void parallelForVertices_(int n_verts, const ChunkFunction & func) const;
+
+    // Linear Blend Skinning with the packed weights table:
+    // out.row(v) = sum_k weight_vk * transforms[joint_vk] * (verts.row(v) [+ displacement.row(v)], homo_coord)
+    // homo_coord is 1 for points and 0 for directions (e.g. derivatives of the vertex positions)
+    // transforms is an array of JOINTS_NUM matrices; out is allowed to be the same object as verts
+    // The scalar type is expected explicitly: skinVertices_<double>(..)
+    template<typename Scalar>
+    void skinVertices_(const EHomoTransform<Scalar> * transforms, const E::Ref<const EMatrixX<Scalar>> & verts,
+        const ERMatrixXd * displacement, Scalar homo_coord, EMatrixX<Scalar> & out) const;
+    // the same for the vertices in [range_begin, range_end) in the calling thread. out is expected to be allocated.
+    // displacement is only used (and expected to be non-null) if Displaced
+    template<typename Scalar, bool Displaced>
+    void skinVertexRange_(const EHomoTransform<Scalar> * transforms, const E::Ref<const EMatrixX<Scalar>> & verts,
+        const ERMatrixXd * displacement, Scalar homo_coord,
+        EMatrixX<Scalar> & out, int range_begin, int range_end) const;
 
     // ---------------- VARS -------------
-    // initial info
-    char gender_;
-    std::string gender_path_;
-    std::string general_path_;
+    // constant model info, shared with other wrappers
+    std::shared_ptr<const SMPLModel> model_;
     bool use_pose_blendshapes_;
-
-    // constant model info
-    E::MatrixXi faces_;
-    std::array<NeighboursList, VERTICES_NUM> verts_neighbours_;
-    E::MatrixXd verts_template_;
-    E::MatrixXd verts_template_normalized_;
-    E::MatrixXd joint_locations_template_;
-    E::MatrixXd shape_diffs_[10];  // store only differences between blendshapes and template
-    E::MatrixXd pose_diffs_[POSE_BLENDSHAPES_NUM];  // store only differences between blendshapes and template
-    E::MatrixXd jointRegressorMat_;
-    E::MatrixXd pose_stiffness_;
-    static int joints_parents_[JOINTS_NUM];
-    DictionaryInt joint_names_;
-    E::SparseMatrix<double> weights_;
+    bool use_single_precision_ = false;
+    std::shared_ptr<ThreadPool> thread_pool_ = nullptr;
+    static constexpr int VERTEX_CHUNK_SIZE = 512;
+    // calcModelBatch(): the sub-batch buffers are (VERTICES_NUM * SPACE_DIM) x MODEL_BATCH_SIZE
+    static constexpr int MODEL_BATCH_SIZE = 32;
 
     // current state
     State state_;
 
-    // These vars indicate the last model re-calculation 
+    // Workspace of the state-based calculations: indicates the last model re-calculation 
     // !! Params are allowed to be changed directly, so make sure it's fresh before using
-    EHomoCoordMatrix fk_transforms_[JOINTS_NUM];
-    E::MatrixXd fk_derivatives_[JOINTS_NUM][POSE_SIZE];
-    E::MatrixXd local_rotations_[JOINTS_NUM];
-    E::MatrixXd local_rotations_jac_[POSE_SIZE];
-    E::MatrixXd blendshapes_derivatives_[POSE_SIZE];
-
-    E::MatrixXd joint_locations_;
+    Workspace workspace_;
 
     //E::MatrixXd joints_global_transform_;
     //E::MatrixXd shaped_joints_locations_;
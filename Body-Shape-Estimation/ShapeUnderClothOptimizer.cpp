@@ -1,4 +1,40 @@
 #include "ShapeUnderClothOptimizer.h"
+#include "SignedDistanceField.h"
+#include "ThreadPool.h"
+
+namespace
+{
+    // The model and the query are shared with the caller: their evaluation settings changed for the fit
+    // are restored on the scope exit, also when Solve() or the field construction throws
+    class EvaluationSettingsGuard
+    {
+    public:
+        EvaluationSettingsGuard(SMPLWrapper& smpl, MeshDistanceQuery& query)
+            : smpl_(smpl), query_(query),
+            smpl_single_precision_(smpl.isSinglePrecision()),
+            smpl_thread_pool_(smpl.getThreadPool()),
+            query_thread_pool_(query.getThreadPool()),
+            query_distance_field_(query.isUsingDistanceField())
+        {}
+        ~EvaluationSettingsGuard()
+        {
+            smpl_.setSinglePrecision(smpl_single_precision_);
+            smpl_.setThreadPool(smpl_thread_pool_);
+            query_.setThreadPool(query_thread_pool_);
+            query_.setUseDistanceField(query_distance_field_);
+        }
+        EvaluationSettingsGuard(const EvaluationSettingsGuard&) = delete;
+        EvaluationSettingsGuard& operator=(const EvaluationSettingsGuard&) = delete;
+
+    private:
+        SMPLWrapper& smpl_;
+        MeshDistanceQuery& query_;
+        const bool smpl_single_precision_;
+        const std::shared_ptr<ThreadPool> smpl_thread_pool_;
+        const std::shared_ptr<ThreadPool> query_thread_pool_;
+        const bool query_distance_field_;
+    };
+}
 
 
 ShapeUnderClothOptimizer::ShapeUnderClothOptimizer(std::shared_ptr<SMPLWrapper> smpl, 
@@ -7,7 +43,7 @@ ShapeUnderClothOptimizer::ShapeUnderClothOptimizer(std::shared_ptr<SMPLWrapper>
 {
     // note: could be nullptr
     smpl_ = std::move(smpl);
-    input_ = std::move(input);
+    setNewInput(std::move(input));
 }
 
 ShapeUnderClothOptimizer::~ShapeUnderClothOptimizer()
@@ -20,6 +56,12 @@ void ShapeUnderClothOptimizer::setNewSMPLModel(std::shared_ptr<SMPLWrapper> smpl
 
 void ShapeUnderClothOptimizer::setNewInput(std::shared_ptr<GeneralMesh> input)
 {
+    // the same input might be supplied again -- no need to rebuild the distance structures then
+    if (input != nullptr && (input != input_ || input_query_ == nullptr))
+        input_query_ = std::make_shared<MeshDistanceQuery>(*input);
+    else if (input == nullptr)
+        input_query_ = nullptr;
+
     input_ = std::move(input);
 }
 
@@ -46,6 +88,24 @@ void ShapeUnderClothOptimizer::findOptimalSMPLParameters(std::vector<Eigen::Matr
 
     checkCeresOptions(config_.ceres);
 
+    EvaluationSettingsGuard settings_guard(*smpl_, *input_query_);
+    smpl_->setSinglePrecision(config_.single_precision);
+    if (config_.threads_num > 0)
+    {
+        // a single pool for the model and the distance queries: they never run concurrently
+        auto thread_pool = std::make_shared<ThreadPool>(config_.threads_num);
+        smpl_->setThreadPool(thread_pool);
+        input_query_->setThreadPool(thread_pool);
+    }
+    // the field only depends on the input => kept for the following calls with the same settings
+    const SignedDistanceField* field = input_query_->getDistanceField();
+    if (config_.distance_field && (field == nullptr
+        || field->getVoxelSize() != config_.distance_field_voxel_size
+        || field->getBandWidth() != config_.distance_field_band_width))
+    {
+        input_query_->buildDistanceField(config_.distance_field_voxel_size, config_.distance_field_band_width);
+    }
+
     auto start_time = std::chrono::system_clock::now();
     // just some number of cycles
     for (int i = 0; i < 3; ++i)
@@ -109,16 +169,15 @@ void ShapeUnderClothOptimizer::translationEstimation_(OptimizationOptions& confi
     Problem problem;
 
     // send raw pointers because inner class were not refactored
-    AbsoluteDistanceBase* cost_function = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::TRANSLATION, AbsoluteDistanceBase::BOTH_DIST);
-    // for pre-computation
-    config.ceres.evaluation_callback = cost_function;
+    auto context = distanceContext_(AbsoluteDistanceBase::TRANSLATION, config);
+    AbsoluteDistanceBase* cost_function = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::BOTH_DIST);
     
     problem.AddResidualBlock(cost_function, nullptr, smpl_->getStatePointers().translation.data());
 
     // Run the solver!
     Solver::Summary summary;
-    Solve(config.ceres, &problem, &summary);
+    solve_(config, problem, summary);
 
     // Print summary
     std::cout << "Translation estimation summary:" << std::endl;
@@ -152,7 +211,7 @@ void ShapeUnderClothOptimizer::poseEstimation_(OptimizationOptions& config, cere
 
     // Run the solver!
     Solver::Summary summary;
-    Solve(config.ceres, &problem, &summary);
+    solve_(config, problem, summary);
 
     // Print summary
     std::cout << "Pose estimation summary:" << std::endl;
@@ -164,11 +223,12 @@ void ShapeUnderClothOptimizer::poseEstimation_(OptimizationOptions& config, cere
 
 void ShapeUnderClothOptimizer::poseMainCostNoSegmetation_(Problem & problem, OptimizationOptions& config)
 {
+    auto context = distanceContext_(AbsoluteDistanceBase::POSE, config);
     // send raw pointers because inner class were not refactored
-    AbsoluteDistanceBase* out_cost_function = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::POSE, AbsoluteDistanceBase::OUT_DIST);
-    AbsoluteDistanceBase* in_cost_function = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::POSE, AbsoluteDistanceBase::IN_DIST);
+    AbsoluteDistanceBase* out_cost_function = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::OUT_DIST, 100.);
+    AbsoluteDistanceBase* in_cost_function = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::IN_DIST, 100.);
 
     problem.AddResidualBlock(out_cost_function, nullptr,
         smpl_->getStatePointers().pose.data());
@@ -176,20 +236,27 @@ void ShapeUnderClothOptimizer::poseMainCostNoSegmetation_(Problem & problem, Opt
     // in_verts distance needs scaling 
     problem.AddResidualBlock(in_cost_function, innerVerticesLoss_(config),
         smpl_->getStatePointers().pose.data());
-
-    // set any of the defined costs for pre-computation
-    config.ceres.evaluation_callback = out_cost_function;
 }
 
 void ShapeUnderClothOptimizer::poseMainCostClothAware_(Problem & problem, OptimizationOptions& config)
 {
+    auto context = distanceContext_(AbsoluteDistanceBase::POSE, config);
+    if (config.fuse_cloth_distance_costs)
+    {
+        // the CLOTH_IN loss is applied by the cost itself
+        FusedDistanceCost* cost = new FusedDistanceCost(context, input_.get(), innerVerticesLoss_(config));
+        problem.AddResidualBlock(cost, nullptr,
+            smpl_->getStatePointers().pose.data());
+        return;
+    }
+
     // send raw pointers because inner class was not refactored
-    AbsoluteDistanceBase* cloth_out_cost = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::POSE, AbsoluteDistanceBase::CLOTH_OUT);
-    AbsoluteDistanceBase* cloth_in_cost = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::POSE, AbsoluteDistanceBase::CLOTH_IN);
-    AbsoluteDistanceBase* skin_cost = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::POSE, AbsoluteDistanceBase::SKIN_BOTH);
+    AbsoluteDistanceBase* cloth_out_cost = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::CLOTH_OUT, 100.);
+    AbsoluteDistanceBase* cloth_in_cost = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::CLOTH_IN, 100.);
+    AbsoluteDistanceBase* skin_cost = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::SKIN_BOTH, 100.);
 
     problem.AddResidualBlock(skin_cost, nullptr,
         smpl_->getStatePointers().pose.data());
@@ -199,9 +266,6 @@ void ShapeUnderClothOptimizer::poseMainCostClothAware_(Problem & problem, Optimi
 
     problem.AddResidualBlock(cloth_in_cost, innerVerticesLoss_(config),
         smpl_->getStatePointers().pose.data());
-
-    // set any of the defined costs for pre-computation
-    config.ceres.evaluation_callback = cloth_out_cost;
 }
 
 void ShapeUnderClothOptimizer::shapeEstimation_(OptimizationOptions& config)
@@ -228,7 +292,7 @@ void ShapeUnderClothOptimizer::shapeEstimation_(OptimizationOptions& config)
 
     // Run the solver!
     Solver::Summary summary;
-    Solve(config.ceres, &problem, &summary);
+    solve_(config, problem, summary);
 
     // Print summary
     std::cout << "Shape estimation summary:" << std::endl;
@@ -240,10 +304,11 @@ void ShapeUnderClothOptimizer::shapeEstimation_(OptimizationOptions& config)
 
 void ShapeUnderClothOptimizer::shapeMainCostNoSegmetation_(Problem & problem, OptimizationOptions& config)
 {
-    AbsoluteDistanceBase* out_cost_function = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::SHAPE, AbsoluteDistanceBase::OUT_DIST, config.shape_prune_threshold);
-    AbsoluteDistanceBase* in_cost_function = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::SHAPE, AbsoluteDistanceBase::IN_DIST);  // no threshold
+    auto context = distanceContext_(AbsoluteDistanceBase::SHAPE, config);
+    AbsoluteDistanceBase* out_cost_function = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::OUT_DIST, config.shape_prune_threshold);
+    AbsoluteDistanceBase* in_cost_function = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::IN_DIST, 100.);  // no threshold
 
     // add Residuals 
     problem.AddResidualBlock(out_cost_function, nullptr,
@@ -251,20 +316,27 @@ void ShapeUnderClothOptimizer::shapeMainCostNoSegmetation_(Problem & problem, Op
 
     problem.AddResidualBlock(in_cost_function, innerVerticesLoss_(config),
         smpl_->getStatePointers().shape.data());
-
-    // set any of the defined costs for pre-computation
-    config.ceres.evaluation_callback = out_cost_function;
 }
 
 void ShapeUnderClothOptimizer::shapeMainCostClothAware_(Problem & problem, OptimizationOptions& config)
 {
+    auto context = distanceContext_(AbsoluteDistanceBase::SHAPE, config);
+    if (config.fuse_cloth_distance_costs)
+    {
+        // the CLOTH_IN loss is applied by the cost itself
+        FusedDistanceCost* cost = new FusedDistanceCost(context, input_.get(), innerVerticesLoss_(config));
+        problem.AddResidualBlock(cost, nullptr,
+            smpl_->getStatePointers().shape.data());
+        return;
+    }
+
     // send raw pointers because inner class was not refactored
-    AbsoluteDistanceBase* cloth_out_cost = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::SHAPE, AbsoluteDistanceBase::CLOTH_OUT);
-    AbsoluteDistanceBase* cloth_in_cost = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::SHAPE, AbsoluteDistanceBase::CLOTH_IN);
-    AbsoluteDistanceBase* skin_cost = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-        AbsoluteDistanceBase::SHAPE, AbsoluteDistanceBase::SKIN_BOTH);
+    AbsoluteDistanceBase* cloth_out_cost = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::CLOTH_OUT, 100.);
+    AbsoluteDistanceBase* cloth_in_cost = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::CLOTH_IN, 100.);
+    AbsoluteDistanceBase* skin_cost = new AbsoluteDistanceBase(context, input_.get(),
+        AbsoluteDistanceBase::SKIN_BOTH, 100.);
 
     problem.AddResidualBlock(skin_cost, nullptr,
         smpl_->getStatePointers().shape.data());
@@ -274,9 +346,6 @@ void ShapeUnderClothOptimizer::shapeMainCostClothAware_(Problem & problem, Optim
 
     problem.AddResidualBlock(cloth_in_cost, innerVerticesLoss_(config),
         smpl_->getStatePointers().shape.data());
-
-    // set any of the defined costs for pre-computation
-    config.ceres.evaluation_callback = cloth_out_cost;
 }
 
 void ShapeUnderClothOptimizer::displacementEstimation_(OptimizationOptions& config)
@@ -295,26 +364,19 @@ void ShapeUnderClothOptimizer::displacementEstimation_(OptimizationOptions& conf
     LossFunction* smoothing_scale_loss = new ScaledLoss(NULL, config.displacement_smoothing_weight, ceres::TAKE_OWNERSHIP);
 
     // Main cost -- for each vertex
-    bool eval_callback_added = false;
+    auto context = distanceContext_(AbsoluteDistanceBase::DISPLACEMENT, config);
     for (int v_id = 0; v_id < SMPLWrapper::VERTICES_NUM; v_id++) //int v_id = 1084;
     {
-        AbsoluteDistanceBase* out_cost_function = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-            AbsoluteDistanceBase::DISPLACEMENT, AbsoluteDistanceBase::OUT_DIST,
+        AbsoluteDistanceBase* out_cost_function = new AbsoluteDistanceBase(context, input_.get(),
+            AbsoluteDistanceBase::OUT_DIST,
             config.shape_prune_threshold, v_id);    // TODO recheck thresholding for displacements shape_prune_threshold_
-        AbsoluteDistanceBase* in_cost_function = new AbsoluteDistanceBase(smpl_.get(), input_.get(),
-            AbsoluteDistanceBase::DISPLACEMENT, AbsoluteDistanceBase::IN_DIST, 
+        AbsoluteDistanceBase* in_cost_function = new AbsoluteDistanceBase(context, input_.get(),
+            AbsoluteDistanceBase::IN_DIST,
             100., v_id);  // no threshold
         // nothe that it requres the dispalacements params to be pushed to smpl object 
-        // -> evaluation callback of the out/in_cost_function will work
+        // -> evaluation callback of the distance context will work
         SmoothDisplacementCost* smoothing_cost_function = new SmoothDisplacementCost(smpl_, v_id);
 
-        // add for performing pre-computation
-        if (!eval_callback_added)
-        {
-            config.ceres.evaluation_callback = out_cost_function;
-            eval_callback_added = true;
-        }
-
         // add out Residuals for corresponding vertex
         problem.AddResidualBlock(out_cost_function, nullptr,
             smpl_->getStatePointers().displacements.data() + v_id * SMPLWrapper::SPACE_DIM);
@@ -332,7 +394,7 @@ void ShapeUnderClothOptimizer::displacementEstimation_(OptimizationOptions& conf
 
     // Run the solver!
     Solver::Summary summary;
-    Solve(config.ceres, &problem, &summary);
+    solve_(config, problem, summary);
 
     // Print summary
     std::cout << "Displacement estimation summary:" << std::endl;
@@ -342,6 +404,34 @@ void ShapeUnderClothOptimizer::displacementEstimation_(OptimizationOptions& conf
     config.ceres.evaluation_callback = NULL;
 }
 
+void ShapeUnderClothOptimizer::solve_(const OptimizationOptions & config, Problem & problem, Solver::Summary & summary)
+{
+    EvaluationSettingsGuard settings_guard(*smpl_, *input_query_);
+    if (config.distance_field)
+    {
+        input_query_->setUseDistanceField(true);
+        Solve(config.ceres, &problem, &summary);
+        std::cout << "Distance field pass: " << summary.BriefReport() << std::endl;
+    }
+
+    // exact queries from the approximate solution: only a few iterations are left
+    input_query_->setUseDistanceField(false);
+    Solve(config.ceres, &problem, &summary);
+}
+
+std::shared_ptr<AbsoluteDistanceBase::EvaluationContext> ShapeUnderClothOptimizer::distanceContext_(
+    AbsoluteDistanceBase::ParameterType parameter, OptimizationOptions & config)
+{
+    const bool compress_residuals = config.compress_distance_residuals
+        && (parameter == AbsoluteDistanceBase::SHAPE || parameter == AbsoluteDistanceBase::POSE);
+    // not make_shared: the context has the aligned operator new
+    std::shared_ptr<AbsoluteDistanceBase::EvaluationContext> context(
+        new AbsoluteDistanceBase::EvaluationContext(smpl_.get(), input_query_.get(), parameter, compress_residuals));
+    // for pre-computation
+    config.ceres.evaluation_callback = context.get();
+    return context;
+}
+
 ceres::ComposedLoss* ShapeUnderClothOptimizer::innerVerticesLoss_(const OptimizationOptions& config)
 {
     LossFunction* scale_in_cost = new ScaledLoss(NULL, config.in_verts_scaling_weight, ceres::TAKE_OWNERSHIP);
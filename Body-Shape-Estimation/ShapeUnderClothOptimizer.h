@@ -10,8 +10,10 @@
 
 #include <GeneralMesh/GeneralMesh.h>
 #include "SMPLWrapper.h"
+#include "MeshDistanceQuery.h"
 // cost functions
 #include "AbsoluteDistanceBase.h"
+#include "FusedDistanceCost.h"
 #include "SmoothDisplacementCost.h"
 
 using ceres::AutoDiffCostFunction;
@@ -40,6 +42,20 @@ public:
         double shape_prune_threshold;
         double gm_saturation_threshold;
         double in_verts_scaling_weight;
+        // shape and pose distance costs use the normal equations instead of the per-vertex jacobian
+        bool compress_distance_residuals;
+        // cloth-aware stages: the CLOTH_OUT, CLOTH_IN and SKIN_BOTH distances as a single cost (see FusedDistanceCost)
+        bool fuse_cloth_distance_costs;
+        // model and distance evaluation in float (see SMPLWrapper::setSinglePrecision()), the parameters stay double
+        bool single_precision;
+        // threads of the model and distance evaluation;
+        // 0 keeps the pools of the model and the input query (ThreadPool::getDefault() unless set otherwise)
+        int threads_num;
+        // each stage is first solved with the distance queries approximated by the narrow-band distance field of the input
+        // (see SignedDistanceField) and then refined with the exact queries, so the converged result keeps the exact accuracy
+        bool distance_field;
+        double distance_field_voxel_size;
+        double distance_field_band_width;
 
         OptimizationOptions()
         { // defaults
@@ -50,6 +66,13 @@ public:
             shape_prune_threshold = 0.05;
             gm_saturation_threshold = 2;
             in_verts_scaling_weight = 0.1;
+            compress_distance_residuals = true;
+            fuse_cloth_distance_costs = true;
+            single_precision = false;
+            threads_num = 0;
+            distance_field = false;
+            distance_field_voxel_size = 0.01;
+            distance_field_band_width = 0.05;
         }
     };
 
@@ -92,6 +115,12 @@ private:
     void displacementEstimation_(OptimizationOptions& config);
 
     // utils
+    // the evaluation state of the problem's distance costs: the context is set as the evaluation callback of config.ceres
+    // and is kept alive by the costs
+    std::shared_ptr<AbsoluteDistanceBase::EvaluationContext> distanceContext_(
+        AbsoluteDistanceBase::ParameterType parameter, OptimizationOptions& config);
+    // Solve() with the distance field pass first, if configured
+    void solve_(const OptimizationOptions& config, Problem& problem, Solver::Summary& summary);
     ceres::ComposedLoss* innerVerticesLoss_(const OptimizationOptions& config);
     void checkCeresOptions(const Solver::Options& config);
 
@@ -99,6 +128,8 @@ private:
     // use the shared_ptr to make sure objects won't dissapear in-between calls to this class
     std::shared_ptr<SMPLWrapper> smpl_ = nullptr;
     std::shared_ptr<GeneralMesh> input_ = nullptr;
+    // built once per input and shared by all the distance costs of all the optimization stages
+    std::shared_ptr<MeshDistanceQuery> input_query_ = nullptr;
     OptimizationOptions config_;
 
     // inner classes
@@ -0,0 +1,202 @@
+#include "SignedDistanceField.h"
+#include "MeshDistanceQuery.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace
+{
+    // 21 bits per block coordinate in the key
+    constexpr int BLOCK_COORD_OFFSET = 1 << 20;
+    // node coordinates beyond this are out of the key range (and of any reasonable mesh)
+    constexpr double MAX_NODE_COORD = (double)(1 << 22);
+}
+
+SignedDistanceField::SignedDistanceField(const MeshDistanceQuery & query, double voxel_size, double band_width)
+    : voxel_size_(voxel_size), band_width_(band_width)
+{
+    if (!(voxel_size > 0.) || !(band_width > 0.))
+        throw std::invalid_argument("SignedDistanceField: voxel size and band width should be positive");
+    if (!(query.getVertices().cwiseAbs().maxCoeff() / voxel_size + band_width / voxel_size < MAX_NODE_COORD))
+        throw std::invalid_argument("SignedDistanceField: voxel size is too small for the mesh extent");
+
+    build_(query);
+}
+
+SignedDistanceField::~SignedDistanceField()
+{
+}
+
+bool SignedDistanceField::query(const Eigen::RowVector3d & point,
+    double & signed_dist, int & closest_face_id,
+    Eigen::RowVector3d & closest_point, Eigen::RowVector3d & gradient) const
+{
+    int base[3];
+    double frac[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const double grid_coord = point(axis) / voxel_size_;
+        const double floored = std::floor(grid_coord);
+        // also rejects NaN
+        if (!(std::abs(floored) < MAX_NODE_COORD))
+            return false;
+        base[axis] = (int)floored;
+        frac[axis] = grid_coord - floored;
+    }
+
+    // the cell nodes mostly belong to the same block => look up only when the block changes
+    std::uint64_t last_key = 0;
+    const Block* block = nullptr;
+
+    double dist = 0.;
+    Eigen::RowVector3d grad = Eigen::RowVector3d::Zero();
+    double nearest_weight = -1.;
+    int nearest_face_id = -1;
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        int block_coords[3];
+        int local[3];
+        double weight = 1.;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const int offset = (corner >> axis) & 1;
+            const int node = base[axis] + offset;
+            block_coords[axis] = blockCoord_(node);
+            local[axis] = node - block_coords[axis] * BLOCK_SIZE;
+            weight *= offset ? frac[axis] : 1. - frac[axis];
+        }
+
+        const std::uint64_t key = blockKey_(block_coords[0], block_coords[1], block_coords[2]);
+        if (block == nullptr || key != last_key)
+        {
+            block = findBlock_(block_coords[0], block_coords[1], block_coords[2]);
+            if (block == nullptr)
+                return false;
+            last_key = key;
+        }
+
+        const int node_id = nodeIndex_(local[0], local[1], local[2]);
+        if (block->face_ids[node_id] < 0)
+            return false;
+
+        dist += weight * block->dists[node_id];
+        for (int axis = 0; axis < 3; ++axis)
+            grad(axis) += weight * block->gradients[node_id][axis];
+        if (weight > nearest_weight)
+        {
+            nearest_weight = weight;
+            nearest_face_id = block->face_ids[node_id];
+        }
+    }
+
+    // the gradients of the nodes on the opposite sides of the medial axis cancel out: no direction to rely on
+    const double grad_norm = grad.norm();
+    if (!(grad_norm > 1e-6))
+        return false;
+
+    signed_dist = dist;
+    closest_face_id = nearest_face_id;
+    gradient = grad / grad_norm;
+    closest_point = point - dist * gradient;
+    return true;
+}
+
+void SignedDistanceField::build_(const MeshDistanceQuery & query)
+{
+    const Eigen::MatrixXd& verts = query.getVertices();
+    const Eigen::MatrixXi& faces = query.getFaces();
+
+    // blocks overlapping the band around each face's bounding box
+    std::vector<Eigen::Vector3i> blocks_coords;
+    for (int f = 0; f < faces.rows(); ++f)
+    {
+        Eigen::RowVector3d face_min = verts.row(faces(f, 0));
+        Eigen::RowVector3d face_max = face_min;
+        for (int corner = 1; corner < 3; ++corner)
+        {
+            face_min = face_min.cwiseMin(verts.row(faces(f, corner)));
+            face_max = face_max.cwiseMax(verts.row(faces(f, corner)));
+        }
+
+        int block_min[3], block_max[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            block_min[axis] = blockCoord_((int)std::floor((face_min(axis) - band_width_) / voxel_size_));
+            block_max[axis] = blockCoord_((int)std::ceil((face_max(axis) + band_width_) / voxel_size_));
+        }
+
+        for (int z = block_min[2]; z <= block_max[2]; ++z)
+            for (int y = block_min[1]; y <= block_max[1]; ++y)
+                for (int x = block_min[0]; x <= block_max[0]; ++x)
+                {
+                    if (blocks_index_.emplace(blockKey_(x, y, z), (int)blocks_coords.size()).second)
+                        blocks_coords.emplace_back(x, y, z);
+                }
+    }
+    blocks_.resize(blocks_coords.size());
+
+    // exact queries at the nodes, a batch of blocks at a time
+    Eigen::MatrixXd points;
+    Eigen::VectorXd signed_dists;
+    Eigen::VectorXi closest_face_ids;
+    Eigen::MatrixXd closest_points;
+    Eigen::MatrixXd normals_for_sign;
+    for (std::size_t batch_begin = 0; batch_begin < blocks_.size(); batch_begin += BUILD_BATCH_BLOCKS)
+    {
+        const std::size_t batch_end = std::min(blocks_.size(), batch_begin + BUILD_BATCH_BLOCKS);
+
+        points.resize((batch_end - batch_begin) * BLOCK_NODES, 3);
+        for (std::size_t b = batch_begin; b < batch_end; ++b)
+        {
+            const Eigen::Vector3i& block_coords = blocks_coords[b];
+            for (int z = 0; z < BLOCK_SIZE; ++z)
+                for (int y = 0; y < BLOCK_SIZE; ++y)
+                    for (int x = 0; x < BLOCK_SIZE; ++x)
+                    {
+                        const Eigen::Index point_id = (b - batch_begin) * BLOCK_NODES + nodeIndex_(x, y, z);
+                        points(point_id, 0) = (block_coords.x() * BLOCK_SIZE + x) * voxel_size_;
+                        points(point_id, 1) = (block_coords.y() * BLOCK_SIZE + y) * voxel_size_;
+                        points(point_id, 2) = (block_coords.z() * BLOCK_SIZE + z) * voxel_size_;
+                    }
+        }
+
+        query.signedDistance(points, signed_dists, closest_face_ids, closest_points, normals_for_sign);
+
+        for (std::size_t b = batch_begin; b < batch_end; ++b)
+        {
+            Block& block = blocks_[b];
+            for (int node_id = 0; node_id < BLOCK_NODES; ++node_id)
+            {
+                const Eigen::Index point_id = (b - batch_begin) * BLOCK_NODES + node_id;
+                const double dist = signed_dists(point_id);
+
+                Eigen::RowVector3d gradient;
+                if (std::abs(dist) > 1e-6 * voxel_size_)
+                    // d = sign * |p - c| => grad d = (p - c) / d
+                    gradient = (points.row(point_id) - closest_points.row(point_id)) / dist;
+                else
+                    // on the surface: the pseudonormal is the outward direction
+                    gradient = normals_for_sign.row(point_id).normalized();
+
+                block.dists[node_id] = (float)dist;
+                block.face_ids[node_id] = std::abs(dist) <= band_width_ ? closest_face_ids(point_id) : -1;
+                for (int axis = 0; axis < 3; ++axis)
+                    block.gradients[node_id][axis] = (float)gradient(axis);
+            }
+        }
+    }
+}
+
+const SignedDistanceField::Block * SignedDistanceField::findBlock_(int block_x, int block_y, int block_z) const
+{
+    const auto found = blocks_index_.find(blockKey_(block_x, block_y, block_z));
+    return found != blocks_index_.end() ? &blocks_[found->second] : nullptr;
+}
+
+std::uint64_t SignedDistanceField::blockKey_(int block_x, int block_y, int block_z)
+{
+    return (std::uint64_t)(block_x + BLOCK_COORD_OFFSET)
+        | (std::uint64_t)(block_y + BLOCK_COORD_OFFSET) << 21
+        | (std::uint64_t)(block_z + BLOCK_COORD_OFFSET) << 42;
+}
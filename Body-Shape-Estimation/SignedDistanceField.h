@@ -0,0 +1,74 @@
+#pragma once
+/*
+Narrow-band signed distance field of the mesh of a MeshDistanceQuery: the exact signed distances, the closest face ids
+and the distance gradients are sampled once on the regular grid nodes within the band around the mesh,
+and the queries are answered by the trilinear interpolation of the 8 nodes of the point's cell in O(1).
+
+The grid is sparse: only the blocks of BLOCK_SIZE^3 nodes overlapping the band are stored,
+in a hash map by the block coordinates. The grid is aligned with the origin, node (i, j, k) is at (i, j, k) * voxel_size.
+The closest point is approximated as the point moved along the interpolated gradient by the interpolated distance,
+the closest face id is taken from the nearest cell node.
+
+The approximation error is O(voxel_size^2) for the distance away from the mesh features (edges, high curvature),
+and is larger near them, so the field is meant for the early iterations with the exact queries to finish with.
+Limitations:
+    - The points outside the band (any node of the cell is out of the band) are not answered: query() returns false
+    - The field is built for the mesh as is and is not updated if the query is rebuilt
+*/
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Dense>
+
+class MeshDistanceQuery;
+
+class SignedDistanceField
+{
+public:
+    static constexpr int BLOCK_SIZE = 8;     // nodes per block side
+    static constexpr int BLOCK_NODES = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE;
+
+    // the nodes are sampled with the exact queries of the given object (on its thread pool)
+    // band_width is the max absolute distance of the stored nodes. Throws std::invalid_argument for non-positive sizes
+    SignedDistanceField(const MeshDistanceQuery& query, double voxel_size, double band_width);
+    ~SignedDistanceField();
+
+    double getVoxelSize() const { return voxel_size_; }
+    double getBandWidth() const { return band_width_; }
+    std::size_t getBlocksNum() const { return blocks_.size(); }
+
+    // false if the point is out of the band, the outputs are not changed then
+    // gradient is the unit direction of the distance growth (outward on the surface)
+    bool query(const Eigen::RowVector3d& point,
+        double& signed_dist, int& closest_face_id,
+        Eigen::RowVector3d& closest_point, Eigen::RowVector3d& gradient) const;
+
+private:
+    struct Block {
+        float dists[BLOCK_NODES];
+        int face_ids[BLOCK_NODES];      // -1 for the nodes out of the band
+        float gradients[BLOCK_NODES][3];
+    };
+
+    // blocks of the given number of nodes are sampled at once to bound the memory of the query results
+    static constexpr int BUILD_BATCH_BLOCKS = 64;
+
+    void build_(const MeshDistanceQuery& query);
+    // nullptr if the node's block is not stored
+    const Block* findBlock_(int block_x, int block_y, int block_z) const;
+    static std::uint64_t blockKey_(int block_x, int block_y, int block_z);
+    // rounds towards minus infinity, also for the negative node coordinates
+    static int blockCoord_(int node_coord) { return node_coord >= 0 ? node_coord / BLOCK_SIZE : (node_coord + 1) / BLOCK_SIZE - 1; }
+    static int nodeIndex_(int local_x, int local_y, int local_z)
+    {
+        return (local_z * BLOCK_SIZE + local_y) * BLOCK_SIZE + local_x;
+    }
+
+    // ---------------- VARS -------------
+    double voxel_size_;
+    double band_width_;
+    std::vector<Block> blocks_;
+    std::unordered_map<std::uint64_t, int> blocks_index_;   // key -> id in blocks_
+};
@@ -16,7 +16,7 @@ SmoothDisplacementCost::~SmoothDisplacementCost()
 
 bool SmoothDisplacementCost::Evaluate(double const * const * parameters, double * residuals, double ** jacobians) const
 {
-    Eigen::VectorXd average = vertNeighboursAverageDisplacement_();
+    const Eigen::Vector3d average = vertNeighboursAverageDisplacement_();
     // fill residuals
     for (int axis = 0; axis < parameter_block_sizes()[0]; axis++)
     {
@@ -38,18 +38,18 @@ bool SmoothDisplacementCost::Evaluate(double const * const * parameters, double
     return true;
 }
 
-Eigen::VectorXd SmoothDisplacementCost::vertNeighboursAverageDisplacement_() const
+Eigen::Vector3d SmoothDisplacementCost::vertNeighboursAverageDisplacement_() const
 {
     const SMPLWrapper::NeighboursList& neighbours = smpl_->getVertNeighbours(vert_id_);
     const SMPLWrapper::ERMatrixXd& displacements = smpl_->getStatePointers().displacements;
 
-    Eigen::VectorXd average = Eigen::VectorXd::Zero(SMPLWrapper::SPACE_DIM);
+    Eigen::Vector3d average = Eigen::Vector3d::Zero();
 
     for (auto neighbour : neighbours)
     {
-        average = average + displacements.row(neighbour);
+        average += displacements.row(neighbour).transpose();
     }
-    average = average / neighbours.size();
+    average /= (double)neighbours.size();
 
     return average;
 }
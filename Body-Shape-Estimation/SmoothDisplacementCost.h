@@ -16,7 +16,7 @@ public:
         double** jacobians) const;
 
 private:
-    Eigen::VectorXd vertNeighboursAverageDisplacement_() const;
+    Eigen::Vector3d vertNeighboursAverageDisplacement_() const;
 
     // state
     std::shared_ptr<SMPLWrapper> smpl_;
@@ -0,0 +1,154 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+std::mutex ThreadPool::default_mutex_;
+std::shared_ptr<ThreadPool> ThreadPool::default_pool_;
+
+namespace
+{
+    // set while the thread executes the chunks of some loop => nested loops run serially
+    thread_local bool inside_loop = false;
+}
+
+ThreadPool::ThreadPool(int threads_num)
+{
+    if (threads_num <= 0)
+        threads_num = std::max(1, (int)std::thread::hardware_concurrency());
+
+    // the calling thread is one of the threads
+    for (int i = 0; i < threads_num - 1; ++i)
+        workers_.emplace_back(&ThreadPool::workerMain_, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    loop_started_.notify_all();
+    for (auto& worker : workers_)
+        worker.join();
+}
+
+void ThreadPool::run_(int begin, int end, int chunk_size, const void* func, ChunkCall call)
+{
+    if (chunk_size <= 0)
+        throw std::invalid_argument("ThreadPool::ERROR::chunk size should be positive");
+
+    const int chunks_num = chunksNum(begin, end, chunk_size);
+    if (chunks_num == 0)
+        return;
+
+    // not worth the synchronization
+    if (chunks_num == 1 || workers_.empty() || inside_loop)
+    {
+        for (int chunk = 0; chunk < chunks_num; ++chunk)
+        {
+            const int chunk_begin = begin + chunk * chunk_size;
+            call(func, chunk, chunk_begin, std::min(end, chunk_begin + chunk_size));
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+
+    Loop loop;
+    loop.func = func;
+    loop.call = call;
+    loop.begin = begin;
+    loop.end = end;
+    loop.chunk_size = chunk_size;
+    loop.chunks_num = chunks_num;
+    loop.next_chunk = 0;
+    loop.done_chunks = 0;
+    loop.failed = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loop_ = &loop;
+        ++loop_id_;
+    }
+    loop_started_.notify_all();
+
+    runChunks_(loop);
+
+    // the loop is on the stack => no worker should be left inside
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        loop_finished_.wait(lock, [this, &loop] { return loop.done_chunks == loop.chunks_num && loop_users_ == 0; });
+        loop_ = nullptr;
+    }
+
+    if (loop.error)
+        std::rethrow_exception(loop.error);
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::getDefault()
+{
+    std::lock_guard<std::mutex> lock(default_mutex_);
+    if (default_pool_ == nullptr)
+        default_pool_ = std::make_shared<ThreadPool>();
+    return default_pool_;
+}
+
+void ThreadPool::setDefaultThreadsNum(int threads_num)
+{
+    std::lock_guard<std::mutex> lock(default_mutex_);
+    if (default_pool_ == nullptr || default_pool_->getThreadsNum() != threads_num)
+        default_pool_ = std::make_shared<ThreadPool>(threads_num);
+}
+
+void ThreadPool::workerMain_()
+{
+    std::size_t last_loop_id = 0;
+    while (true)
+    {
+        Loop* loop;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            loop_started_.wait(lock, [this, last_loop_id] { return stop_ || (loop_ != nullptr && loop_id_ != last_loop_id); });
+            if (stop_)
+                return;
+            loop = loop_;
+            last_loop_id = loop_id_;
+            ++loop_users_;
+        }
+
+        runChunks_(*loop);
+
+        // the caller waits for the last chunk and for the workers to leave the loop
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --loop_users_;
+        }
+        loop_finished_.notify_all();
+    }
+}
+
+void ThreadPool::runChunks_(Loop & loop)
+{
+    const bool was_inside_loop = inside_loop;
+    inside_loop = true;
+    for (int chunk = loop.next_chunk++; chunk < loop.chunks_num; chunk = loop.next_chunk++)
+    {
+        if (!loop.failed)
+        {
+            const int chunk_begin = loop.begin + chunk * loop.chunk_size;
+            try
+            {
+                loop.call(loop.func, chunk, chunk_begin, std::min(loop.end, chunk_begin + loop.chunk_size));
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(loop.error_mutex);
+                if (!loop.failed)
+                    loop.error = std::current_exception();
+                loop.failed = true;
+            }
+        }
+        ++loop.done_chunks;
+    }
+    inside_loop = was_inside_loop;
+}
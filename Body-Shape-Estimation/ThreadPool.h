@@ -0,0 +1,92 @@
+#pragma once
+/*
+Fixed-size pool of worker threads for the data-parallel loops (e.g. over the SMPL vertices).
+
+parallelFor() splits the range into chunks of the given size, independent of the number of threads,
+so the per-chunk partial results combined in the chunk order are the same for any thread count (deterministic).
+The calling thread takes part in the work and the call blocks until all the chunks are done.
+The loop function is called by reference and the loop state lives on the caller's stack, so parallelFor() doesn't allocate.
+
+Limitations:
+    - One loop at a time: concurrent parallelFor() calls on the same pool are served one after another
+    - parallelFor() called from inside a running loop (nested) is executed serially by the calling thread
+    - setDefaultThreadsNum() replaces the default pool: the users that already hold the old one keep using it
+*/
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // threads_num includes the calling thread; 0 is for the number of hardware threads
+    explicit ThreadPool(int threads_num = 0);
+    ~ThreadPool();
+
+    int getThreadsNum() const { return (int)workers_.size() + 1; }
+
+    // func(chunk_id, chunk_begin, chunk_end) is called for each chunk.
+    // Exceptions thrown by func are re-thrown in the calling thread (the first one), the other chunks are skipped then
+    template<typename ChunkFunction>
+    void parallelFor(int begin, int end, int chunk_size, const ChunkFunction& func)
+    {
+        run_(begin, end, chunk_size, &func, [](const void* func_ptr, int chunk, int chunk_begin, int chunk_end)
+        {
+            (*static_cast<const ChunkFunction*>(func_ptr))(chunk, chunk_begin, chunk_end);
+        });
+    }
+    static int chunksNum(int begin, int end, int chunk_size)
+    {
+        return end > begin ? (end - begin + chunk_size - 1) / chunk_size : 0;
+    }
+
+    // shared by the library routines
+    static std::shared_ptr<ThreadPool> getDefault();
+    static void setDefaultThreadsNum(int threads_num);
+
+private:
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // type-erased reference to the loop function
+    using ChunkCall = void(*)(const void* func, int chunk, int chunk_begin, int chunk_end);
+
+    struct Loop {
+        const void* func;
+        ChunkCall call;
+        int begin;
+        int end;
+        int chunk_size;
+        int chunks_num;
+        std::atomic<int> next_chunk;
+        std::atomic<int> done_chunks;
+        std::atomic<bool> failed;
+        std::exception_ptr error;   // of the first failed chunk
+        std::mutex error_mutex;
+    };
+
+    void run_(int begin, int end, int chunk_size, const void* func, ChunkCall call);
+    void workerMain_();
+    // takes the chunks of the loop until none is left
+    static void runChunks_(Loop& loop);
+
+    // ---------------- VARS -------------
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable loop_started_;
+    std::condition_variable loop_finished_;
+    Loop* loop_ = nullptr;              // the running loop, if any
+    std::size_t loop_id_ = 0;           // to let each worker join every loop once
+    int loop_users_ = 0;                // workers inside the running loop: the caller waits for them to leave
+    bool stop_ = false;
+    // serializes the callers
+    std::mutex run_mutex_;
+
+    static std::mutex default_mutex_;
+    static std::shared_ptr<ThreadPool> default_pool_;
+};
@@ -23,8 +23,10 @@
 #include <igl/opengl/glfw/imgui/ImGuiMenu.h>
 #include <igl/point_mesh_squared_distance.h>
 #include <igl/signed_distance.h>
+#include <igl/AABB.h>
 #include <igl/per_vertex_normals.h>
 #include <igl/per_face_normals.h>
+#include <igl/per_edge_normals.h>
 
 #include <ceres/ceres.h>
 #include <ceres/normal_prior.h>